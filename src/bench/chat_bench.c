@@ -0,0 +1,524 @@
+#include "dbg.h"
+#include "../shared/message.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+/*
+ * chat_bench
+ * ----------
+ * Load generator for chat_server. A few threads each own a slice of the
+ * simulated clients, all multiplexed on one epoll instance per thread:
+ *
+ *   - every client connects, JOINs and moves to room "bench<k>" (clients are
+ *     spread round-robin over -R rooms); it counts as joined once its own
+ *     ROOM_ENTERED comes back;
+ *   - each thread then sends its share of -r NOTEs per second, rotating over
+ *     its joined clients; the note text carries the run tag and the send time
+ *     (CLOCK_MONOTONIC, so the bench and the server must share a host clock --
+ *     run both on the same machine);
+ *   - every DELIVER of one of our notes records send-to-receive latency into
+ *     a per-thread log-linear histogram;
+ *   - with -j, clients are disconnected (LEAVE) and reconnected under a new
+ *     name at that many per second, spread over the threads.
+ *
+ * Phases: connect -> warmup (traffic, not measured) -> measure -> drain
+ * (no new notes; late deliveries of measured notes still count).
+ *
+ * The result is a single JSON object on stdout; progress goes to stderr.
+ */
+
+#define BENCH_TAG         "~b"
+#define BENCH_EVENTS      256
+#define BENCH_HIST        1024      /* log-linear buckets, 16 per power of two */
+#define BENCH_DRAIN_NS    1000000000ULL
+#define BENCH_JOIN_WAIT_S 60
+#define BENCH_NOTE_MIN    40        /* tag, run id and timestamp */
+
+enum { PHASE_CONNECT, PHASE_WARMUP, PHASE_MEASURE, PHASE_DRAIN, PHASE_STOP };
+
+typedef struct {
+    const char *host;
+    uint16_t    port;
+    int         clients;
+    int         threads;
+    int         rooms;
+    double      rate;           /* notes per second, all threads together */
+    size_t      size;           /* note text bytes */
+    double      duration;       /* measured seconds */
+    double      warmup;
+    double      churn;          /* reconnects per second, all threads together */
+    const char *features;       /* JOIN text, e.g. "v2 deflate" */
+} bench_cfg_t;
+
+struct bench_thread;
+
+typedef struct {
+    int          fd;
+    int          idx;
+    unsigned     gen;           /* bumped on every reconnect, part of the name */
+    int          joined;
+    msg_reader_t rd;
+    char         name[64];
+    char         room[32];
+    struct bench_thread *t;
+} bench_client_t;
+
+typedef struct bench_thread {
+    pthread_t       tid;
+    int             id;
+    int             ep;
+    bench_client_t *clients;
+    int             count;
+
+    uint64_t        send_interval, churn_interval;     /* ns, 0 = off */
+    uint64_t        next_send, next_churn;
+    int             send_rr, churn_rr;
+
+    uint64_t        sent, delivered, churned, disconnects, errors;
+    uint64_t        lat_min, lat_max;
+    uint64_t        hist[BENCH_HIST];
+} bench_thread_t;
+
+static bench_cfg_t      g_bench;
+static _Atomic int      g_phase = PHASE_CONNECT;
+static _Atomic int      g_joined;
+static _Atomic uint64_t g_measure_start, g_measure_end;
+static unsigned         g_run_tag;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = { .tv_sec = (time_t)(ns / 1000000000ULL), .tv_nsec = (long)(ns % 1000000000ULL) };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) { }
+}
+
+/*
+ * Latency histogram
+ * -----------------
+ * Values below 16 ns get a bucket each; above that every power of two is
+ * split into 16 linear sub-buckets, so any reported percentile is within
+ * ~6% of the true value.
+ */
+static unsigned hist_bucket(uint64_t v) {
+    if (v < 16) return (unsigned)v;
+    unsigned msb = 63u - (unsigned)__builtin_clzll(v);
+    return (msb - 3u) * 16u + (unsigned)((v >> (msb - 4u)) & 15u);
+}
+
+/* Midpoint of a bucket's range. */
+static uint64_t hist_value(unsigned bucket) {
+    if (bucket < 16) return bucket;
+    unsigned msb = bucket / 16u + 3u;
+    uint64_t low = (16ULL | (bucket % 16u)) << (msb - 4u);
+    return low + ((1ULL << (msb - 4u)) >> 1);
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double pct) {
+    if (!total) return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)total + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    for (unsigned b = 0; b < BENCH_HIST; b++) {
+        seen += hist[b];
+        if (seen >= rank) return hist_value(b);
+    }
+    return hist_value(BENCH_HIST - 1);
+}
+
+/*
+ * client_connect
+ * --------------
+ * Opens a blocking TCP connection, JOINs under a fresh name and asks for the
+ * client's room. The socket stays blocking: the server never stops reading,
+ * and receives only happen after epoll reported the socket readable.
+ * Returns 0 or -1.
+ */
+static int client_connect(bench_client_t *c) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(g_bench.port) };
+    if (inet_pton(AF_INET, g_bench.host, &addr.sin_addr) != 1) {
+        log_err("bad host address %s", g_bench.host);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    snprintf(c->name, sizeof(c->name), "bench-%x-%d-%u", g_run_tag, c->idx, c->gen);
+    if (msg_send(fd, MSG_JOIN, c->name, g_bench.features) != 0 ||
+        msg_send(fd, MSG_ROOM_JOIN, NULL, c->room) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(c->t->ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    c->joined = 0;
+    msg_reader_init(&c->rd, fd);
+    return 0;
+}
+
+static void client_close(bench_client_t *c, int say_goodbye) {
+    if (c->fd < 0) return;
+    if (say_goodbye) msg_send(c->fd, MSG_LEAVE, NULL, NULL);
+    close(c->fd);   /* also drops it from the epoll set */
+    msg_reader_free(&c->rd);
+    c->fd = -1;
+    if (c->joined) atomic_fetch_sub(&g_joined, 1);
+    c->joined = 0;
+}
+
+/*
+ * Records the latency of one delivered bench note. Notes from other runs
+ * (e.g. replayed history) and from outside the measured window are ignored.
+ */
+static void record_delivery(bench_thread_t *t, const char *text, uint64_t now) {
+    unsigned tag;
+    unsigned long long sent_at;
+    if (!text || sscanf(text, BENCH_TAG " %x %llu", &tag, &sent_at) != 2 || tag != g_run_tag) return;
+
+    int phase = atomic_load(&g_phase);
+    if (phase != PHASE_MEASURE && phase != PHASE_DRAIN) return;
+    if (sent_at < atomic_load(&g_measure_start)) return;
+    uint64_t end = atomic_load(&g_measure_end);
+    if (end && sent_at > end) return;
+
+    uint64_t lat = now > sent_at ? now - sent_at : 0;
+    t->hist[hist_bucket(lat)]++;
+    if (!t->delivered || lat < t->lat_min) t->lat_min = lat;
+    if (lat > t->lat_max) t->lat_max = lat;
+    t->delivered++;
+}
+
+static void client_readable(bench_thread_t *t, bench_client_t *c) {
+    ssize_t recvd = msg_reader_fill(&c->rd);
+    if (recvd < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (recvd <= 0) {
+        t->disconnects++;
+        client_close(c, 0);
+        return;
+    }
+
+    uint64_t now = now_ns();
+    msg_type_t type;
+    char *name = NULL, *text = NULL;
+    int parsed;
+    while ((parsed = msg_reader_next(&c->rd, &type, &name, &text)) > 0) {
+        switch (type) {
+        case MSG_DELIVER:
+            record_delivery(t, text, now);
+            break;
+        case MSG_ROOM_ENTERED:
+            if (!c->joined && name && strcmp(name, c->name) == 0) {
+                c->joined = 1;
+                atomic_fetch_add(&g_joined, 1);
+            }
+            break;
+        case MSG_ERROR:
+            t->errors++;
+            break;
+        default:
+            break;
+        }
+        msg_free(name, text);
+        name = text = NULL;
+    }
+    if (parsed < 0) {
+        log_warn("malformed frame on %s", c->name);
+        t->errors++;
+        t->disconnects++;
+        client_close(c, 0);
+        return;
+    }
+    msg_reader_trim(&c->rd);
+}
+
+/* Next joined client after the cursor, or NULL if none is. */
+static bench_client_t *next_joined(bench_thread_t *t, int *cursor) {
+    for (int i = 0; i < t->count; i++) {
+        bench_client_t *c = &t->clients[*cursor];
+        *cursor = (*cursor + 1) % t->count;
+        if (c->fd >= 0 && c->joined) return c;
+    }
+    return NULL;
+}
+
+static void send_note(bench_thread_t *t, char *text) {
+    bench_client_t *c = next_joined(t, &t->send_rr);
+    if (!c) return;
+
+    /* Fixed-width header so the padding never moves. */
+    char head[48];
+    int n = snprintf(head, sizeof(head), BENCH_TAG " %08x %020llu ", g_run_tag,
+                     (unsigned long long)now_ns());
+    memcpy(text, head, (size_t)n);
+
+    if (msg_send(c->fd, MSG_NOTE, NULL, text) != 0) {
+        t->disconnects++;
+        client_close(c, 0);
+        return;
+    }
+    if (atomic_load(&g_phase) == PHASE_MEASURE) t->sent++;
+}
+
+static void churn_one(bench_thread_t *t) {
+    bench_client_t *c = next_joined(t, &t->churn_rr);
+    if (!c) return;
+    client_close(c, 1);
+    c->gen++;
+    if (client_connect(c) != 0) {
+        t->errors++;
+        return;
+    }
+    t->churned++;
+}
+
+/*
+ * bench_thread_main
+ * -----------------
+ * Connects this thread's clients, then alternates between epoll_wait() and
+ * the send / churn schedules until the main thread says stop. A schedule
+ * that falls more than a second behind is restarted rather than bursting.
+ */
+static void *bench_thread_main(void *arg) {
+    bench_thread_t *t = arg;
+
+    for (int i = 0; i < t->count; i++) {
+        if (client_connect(&t->clients[i]) != 0) {
+            log_warn("client %d failed to connect", t->clients[i].idx);
+            t->errors++;
+        }
+    }
+
+    char *text = malloc(g_bench.size + 1);
+    if (!text) return NULL;
+    memset(text, 'x', g_bench.size);
+    text[g_bench.size] = '\0';
+
+    struct epoll_event events[BENCH_EVENTS];
+    uint64_t now = now_ns();
+    t->next_send = t->next_churn = now;
+
+    int phase;
+    while ((phase = atomic_load(&g_phase)) != PHASE_STOP) {
+        int sending = phase == PHASE_WARMUP || phase == PHASE_MEASURE;
+        int timeout = 100;
+        if (sending) {
+            uint64_t next = UINT64_MAX;
+            if (t->send_interval)  next = t->next_send;
+            if (t->churn_interval && t->next_churn < next) next = t->next_churn;
+            if (next != UINT64_MAX) {
+                now = now_ns();
+                uint64_t wait_ms = next > now ? (next - now) / 1000000ULL : 0;
+                if (wait_ms < (uint64_t)timeout) timeout = (int)wait_ms;
+            }
+        }
+
+        int n = epoll_wait(t->ep, events, BENCH_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            bench_client_t *c = events[i].data.ptr;
+            if (c->fd >= 0) client_readable(t, c);
+        }
+        if (!sending) continue;
+
+        now = now_ns();
+        if (t->send_interval) {
+            if (now > t->next_send + 1000000000ULL) t->next_send = now;
+            while (t->next_send <= now) {
+                send_note(t, text);
+                t->next_send += t->send_interval;
+            }
+        }
+        if (t->churn_interval) {
+            if (now > t->next_churn + 1000000000ULL) t->next_churn = now;
+            while (t->next_churn <= now) {
+                churn_one(t);
+                t->next_churn += t->churn_interval;
+            }
+        }
+    }
+
+    for (int i = 0; i < t->count; i++) client_close(&t->clients[i], 1);
+    free(text);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-H host] [-p port] [-c clients] [-t threads] [-R rooms]\n"
+            "          [-r notes_per_sec] [-s note_bytes] [-d seconds] [-w warmup_seconds]\n"
+            "          [-j reconnects_per_sec] [-P join_features]\n"
+            "defaults: -H 127.0.0.1 -p 7777 -c 100 -t 4 -R 1 -r 1000 -s 64 -d 10 -w 1 -j 0 -P \"\"\n",
+            prog);
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void print_report(bench_thread_t *threads, double connect_s, int joined) {
+    uint64_t sent = 0, delivered = 0, churned = 0, disconnects = 0, errors = 0;
+    uint64_t lat_min = 0, lat_max = 0;
+    static uint64_t hist[BENCH_HIST];
+
+    for (int i = 0; i < g_bench.threads; i++) {
+        bench_thread_t *t = &threads[i];
+        sent += t->sent;
+        churned += t->churned;
+        disconnects += t->disconnects;
+        errors += t->errors;
+        if (t->delivered && (!delivered || t->lat_min < lat_min)) lat_min = t->lat_min;
+        if (t->lat_max > lat_max) lat_max = t->lat_max;
+        delivered += t->delivered;
+        for (unsigned b = 0; b < BENCH_HIST; b++) hist[b] += t->hist[b];
+    }
+
+    double secs = (double)(atomic_load(&g_measure_end) - atomic_load(&g_measure_start)) / 1e9;
+    printf("{\"clients\":%d,\"threads\":%d,\"rooms\":%d,\"rate\":%.1f,\"size\":%zu,"
+           "\"duration_s\":%.3f,\"churn\":%.1f,\"features\":\"%s\",\"connect_s\":%.3f,"
+           "\"joined\":%d,\"sent\":%llu,\"delivered\":%llu,"
+           "\"sent_per_s\":%.1f,\"delivered_per_s\":%.1f,"
+           "\"latency_us\":{\"min\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+           "\"churned\":%llu,\"disconnects\":%llu,\"errors\":%llu}\n",
+           g_bench.clients, g_bench.threads, g_bench.rooms, g_bench.rate, g_bench.size,
+           secs, g_bench.churn, g_bench.features, connect_s,
+           joined, (unsigned long long)sent, (unsigned long long)delivered,
+           secs > 0 ? (double)sent / secs : 0.0, secs > 0 ? (double)delivered / secs : 0.0,
+           (double)lat_min / 1e3,
+           (double)hist_percentile(hist, delivered, 50.0) / 1e3,
+           (double)hist_percentile(hist, delivered, 90.0) / 1e3,
+           (double)hist_percentile(hist, delivered, 99.0) / 1e3,
+           (double)hist_percentile(hist, delivered, 99.9) / 1e3,
+           (double)lat_max / 1e3,
+           (unsigned long long)churned, (unsigned long long)disconnects, (unsigned long long)errors);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    g_bench = (bench_cfg_t){
+        .host = "127.0.0.1", .port = 7777, .clients = 100, .threads = 4, .rooms = 1,
+        .rate = 1000, .size = 64, .duration = 10, .warmup = 1, .churn = 0, .features = "",
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:t:R:r:s:d:w:j:P:h")) != -1) {
+        switch (opt) {
+        case 'H': g_bench.host = optarg; break;
+        case 'p': g_bench.port = (uint16_t)atoi(optarg); break;
+        case 'c': g_bench.clients = atoi(optarg); break;
+        case 't': g_bench.threads = atoi(optarg); break;
+        case 'R': g_bench.rooms = atoi(optarg); break;
+        case 'r': g_bench.rate = atof(optarg); break;
+        case 's': g_bench.size = (size_t)atol(optarg); break;
+        case 'd': g_bench.duration = atof(optarg); break;
+        case 'w': g_bench.warmup = atof(optarg); break;
+        case 'j': g_bench.churn = atof(optarg); break;
+        case 'P': g_bench.features = optarg; break;
+        default:  usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (g_bench.clients < 1 || g_bench.threads < 1 || g_bench.rooms < 1 ||
+        g_bench.rate < 0 || g_bench.churn < 0 || g_bench.duration <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (g_bench.threads > g_bench.clients) g_bench.threads = g_bench.clients;
+    if (g_bench.size < BENCH_NOTE_MIN) g_bench.size = BENCH_NOTE_MIN;   /* room for the tag and timestamp */
+
+    raise_fd_limit();
+    g_run_tag = (unsigned)getpid() ^ (unsigned)now_ns();
+
+    bench_client_t *clients = calloc((size_t)g_bench.clients, sizeof(*clients));
+    bench_thread_t *threads = calloc((size_t)g_bench.threads, sizeof(*threads));
+    probe(clients && threads, "out of memory");
+
+    for (int i = 0; i < g_bench.threads; i++) {
+        bench_thread_t *t = &threads[i];
+        int first = (int)((long)g_bench.clients * i / g_bench.threads);
+        int last  = (int)((long)g_bench.clients * (i + 1) / g_bench.threads);
+        t->id = i;
+        t->clients = clients + first;
+        t->count = last - first;
+        if (g_bench.rate > 0)  t->send_interval  = (uint64_t)(1e9 * g_bench.threads / g_bench.rate);
+        if (g_bench.churn > 0) t->churn_interval = (uint64_t)(1e9 * g_bench.threads / g_bench.churn);
+        t->ep = epoll_create1(EPOLL_CLOEXEC);
+        probe(t->ep >= 0, "epoll_create1 failed");
+        for (int k = first; k < last; k++) {
+            clients[k].fd = -1;
+            clients[k].idx = k;
+            clients[k].t = t;
+            snprintf(clients[k].room, sizeof(clients[k].room), "bench%d", k % g_bench.rooms);
+        }
+    }
+
+    uint64_t started = now_ns();
+    for (int i = 0; i < g_bench.threads; i++)
+        probe(pthread_create(&threads[i].tid, NULL, bench_thread_main, &threads[i]) == 0,
+              "pthread_create failed");
+
+    while (atomic_load(&g_joined) < g_bench.clients &&
+           now_ns() - started < BENCH_JOIN_WAIT_S * 1000000000ULL)
+        sleep_ns(10000000ULL);
+    double connect_s = (double)(now_ns() - started) / 1e9;
+    if (atomic_load(&g_joined) < g_bench.clients)
+        log_warn("only %d of %d clients joined", atomic_load(&g_joined), g_bench.clients);
+    log_info("%d clients joined in %.2fs, warming up", atomic_load(&g_joined), connect_s);
+
+    atomic_store(&g_phase, PHASE_WARMUP);
+    sleep_ns((uint64_t)(g_bench.warmup * 1e9));
+
+    atomic_store(&g_measure_start, now_ns());
+    atomic_store(&g_phase, PHASE_MEASURE);
+    sleep_ns((uint64_t)(g_bench.duration * 1e9));
+    atomic_store(&g_measure_end, now_ns());
+    atomic_store(&g_phase, PHASE_DRAIN);
+    sleep_ns(BENCH_DRAIN_NS);
+    int joined = atomic_load(&g_joined);
+    atomic_store(&g_phase, PHASE_STOP);
+
+    for (int i = 0; i < g_bench.threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        close(threads[i].ep);
+    }
+
+    print_report(threads, connect_s, joined);
+    free(threads);
+    free(clients);
+    return 0;
+
+error:
+    free(threads);
+    free(clients);
+    return 1;
+}
@@ -0,0 +1,385 @@
+#include "dbg.h"
+#include "../shared/message.h"
+#include "../shared/chat_node.h"
+#include "../shared/pool.h"
+#include "../server/main.h"
+#include "../server/membership.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+/*
+ * microbench (make bench)
+ * -----------------------
+ * Isolated, single-threaded timings of the hot paths under the server:
+ * frame encode/decode in memory and over a socketpair, the participant
+ * registry at several sizes, and the thread-mode NOTE fanout (room snapshot +
+ * shared frame + one send per member, as in talk_to_client()).
+ *
+ * Each row reports ns/op plus two allocation counts per op, taken only over
+ * the timed region:
+ *   heap/op  malloc/calloc/realloc calls made by our code (pool misses, views)
+ *   pool/op  pool_alloc/pool_strndup calls (slab hits or misses)
+ * They are counted by linking with ld --wrap (see the Makefile), which only
+ * intercepts calls from our own objects, not from libc or zlib internals.
+ *
+ * The output is one whitespace-separated row per benchmark so two runs can be
+ * compared with diff or a short script.
+ */
+
+#define BENCH_MIN_NS   200000000ULL     /* keep repeating until this much was timed */
+#define FAKE_SOCK_BASE (1 << 24)        /* above any real fd: cn_remove_*() close()s it harmlessly */
+
+/* Server globals that membership.c links against. */
+chat_registry_t g_clients;
+pthread_mutex_t g_clients_mx = PTHREAD_MUTEX_INITIALIZER;
+volatile int    g_shutdown_all = 0;
+
+static uint64_t g_heap_allocs, g_pool_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_pool_alloc(size_t size);
+char *__real_pool_strndup(const char *src, size_t len);
+
+void *__wrap_malloc(size_t size)              { g_heap_allocs++; return __real_malloc(size); }
+void *__wrap_calloc(size_t n, size_t size)    { g_heap_allocs++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *ptr, size_t size)  { g_heap_allocs++; return __real_realloc(ptr, size); }
+void *__wrap_pool_alloc(size_t size)          { g_pool_allocs++; return __real_pool_alloc(size); }
+char *__wrap_pool_strndup(const char *src, size_t len) {
+    g_pool_allocs++;
+    return __real_pool_strndup(src, len);
+}
+
+/*
+ * Meter
+ * -----
+ * Accumulates time and allocation counts over one or more timed regions;
+ * untimed setup between meter_start() and meter_stop() pairs is not counted.
+ */
+typedef struct {
+    uint64_t ns, heap, pool, ops;
+    uint64_t t0, heap0, pool0;
+} meter_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void meter_start(meter_t *m) {
+    m->heap0 = g_heap_allocs;
+    m->pool0 = g_pool_allocs;
+    m->t0 = now_ns();
+}
+
+static void meter_stop(meter_t *m, uint64_t ops) {
+    m->ns   += now_ns() - m->t0;
+    m->heap += g_heap_allocs - m->heap0;
+    m->pool += g_pool_allocs - m->pool0;
+    m->ops  += ops;
+}
+
+static int meter_done(const meter_t *m) {
+    return m->ns >= BENCH_MIN_NS;
+}
+
+static void meter_report(const char *name, size_t size, const meter_t *m) {
+    double ops = m->ops ? (double)m->ops : 1.0;
+    printf("%-26s %8zu %12.1f %10.3f %10.3f %12llu\n", name, size,
+           (double)m->ns / ops, (double)m->heap / ops, (double)m->pool / ops,
+           (unsigned long long)m->ops);
+    fflush(stdout);
+}
+
+static char *make_text(size_t len) {
+    char *text = malloc(len + 1);
+    if (!text) return NULL;
+    for (size_t i = 0; i < len; i++) text[i] = (char)('a' + i % 26);
+    text[len] = '\0';
+    return text;
+}
+
+/* ---- framing ---------------------------------------------------------- */
+
+static void bench_encode(size_t text_len) {
+    char *text = make_text(text_len);
+    size_t len = msg_encoded_len("alice", text);
+    unsigned char *buf = malloc(len);
+    meter_t m = {0};
+    if (!text || !buf) goto out;
+
+    while (!meter_done(&m)) {
+        meter_start(&m);
+        for (int i = 0; i < 1000; i++) {
+            msg_encode(buf, MSG_DELIVER, "alice", text);
+            __asm__ volatile("" : : "r"(buf) : "memory");
+        }
+        meter_stop(&m, 1000);
+    }
+    meter_report("encode_v1", text_len, &m);
+
+    m = (meter_t){0};
+    size_t len2 = msg_encoded_len_v2(MSG_DELIVER, "alice", text, 0);
+    unsigned char *buf2 = malloc(len2);
+    if (buf2) {
+        while (!meter_done(&m)) {
+            meter_start(&m);
+            for (int i = 0; i < 1000; i++) {
+                msg_encode_v2(buf2, MSG_DELIVER, "alice", text, 0);
+                __asm__ volatile("" : : "r"(buf2) : "memory");
+            }
+            meter_stop(&m, 1000);
+        }
+        meter_report("encode_v2", text_len, &m);
+        free(buf2);
+    }
+
+    m = (meter_t){0};
+    while (!meter_done(&m)) {
+        meter_start(&m);
+        for (int i = 0; i < 1000; i++) {
+            msg_type_t type;
+            char *name = NULL, *out = NULL;
+            if (msg_decode(buf, len, &type, &name, &out) <= 0) break;
+            msg_free(name, out);
+        }
+        meter_stop(&m, 1000);
+    }
+    meter_report("decode_v1", text_len, &m);
+
+out:
+    free(buf);
+    free(text);
+}
+
+/* Buffered reader parsing frames that are already in memory (no syscalls). */
+static void bench_reader(size_t text_len) {
+    enum { FRAMES = 256 };
+    char *text = make_text(text_len);
+    size_t len = msg_encoded_len("alice", text);
+    unsigned char *buf = malloc(len * FRAMES);
+    meter_t m = {0};
+    if (!text || !buf) goto out;
+    for (int i = 0; i < FRAMES; i++) msg_encode(buf + (size_t)i * len, MSG_DELIVER, "alice", text);
+
+    msg_reader_t rd;
+    msg_reader_init(&rd, -1);
+    while (!meter_done(&m)) {
+        if (msg_reader_feed(&rd, buf, len * FRAMES) != 0) break;
+        meter_start(&m);
+        msg_type_t type;
+        char *name = NULL, *out = NULL;
+        while (msg_reader_next(&rd, &type, &name, &out) > 0) msg_free(name, out);
+        meter_stop(&m, FRAMES);
+    }
+    msg_reader_free(&rd);
+    meter_report("reader_next_v1", text_len, &m);
+
+out:
+    free(buf);
+    free(text);
+}
+
+/* msg_send() then msg_recv() of the same frame across an AF_UNIX socketpair. */
+static void bench_socketpair(size_t text_len) {
+    int sv[2];
+    char *text = make_text(text_len);
+    meter_t m = {0};
+    if (!text || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        free(text);
+        return;
+    }
+
+    while (!meter_done(&m)) {
+        meter_start(&m);
+        for (int i = 0; i < 1000; i++) {
+            msg_type_t type;
+            char *name = NULL, *out = NULL;
+            if (msg_send(sv[0], MSG_DELIVER, "alice", text) != 0) break;
+            if (msg_recv(sv[1], &type, &name, &out) != 0) break;
+            msg_free(name, out);
+        }
+        meter_stop(&m, 1000);
+    }
+    meter_report("send_recv_socketpair", text_len, &m);
+
+    close(sv[0]);
+    close(sv[1]);
+    free(text);
+}
+
+/* ---- registry --------------------------------------------------------- */
+
+static uint32_t lcg(uint32_t *state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+/*
+ * cn_add() of `members` nodes into an empty registry, then as many
+ * cn_find_by_name() hits in random order, then cn_remove_by_sock() of all of
+ * them in random order. Sockets are fake numbers above any real fd, so the
+ * close() inside cn_remove_by_sock() fails fast with EBADF (its syscall is
+ * part of the measured cost, as it is in the server).
+ */
+static void bench_registry(size_t members) {
+    chat_node_t *nodes = calloc(members, sizeof(*nodes));
+    size_t      *order = malloc(members * sizeof(*order));
+    meter_t add = {0}, find = {0}, rem = {0};
+    if (!nodes || !order) goto out;
+
+    for (size_t i = 0; i < members; i++) {
+        snprintf(nodes[i].name, sizeof(nodes[i].name), "member-%zu", i);
+        nodes[i].sock = FAKE_SOCK_BASE + (int)i;
+        nodes[i].shard = -1;
+        order[i] = i;
+    }
+    uint32_t seed = 12345;
+    for (size_t i = members; i > 1; i--) {
+        size_t j = lcg(&seed) % i, tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+
+    while (!meter_done(&add) || !meter_done(&find) || !meter_done(&rem)) {
+        chat_registry_t reg;
+        cn_registry_init(&reg);
+
+        meter_start(&add);
+        for (size_t i = 0; i < members; i++) cn_add(&reg, &nodes[i]);
+        meter_stop(&add, members);
+
+        meter_start(&find);
+        for (size_t i = 0; i < members; i++) {
+            chat_node_t *hit = cn_find_by_name(&reg, nodes[order[i]].name);
+            __asm__ volatile("" : : "r"(hit) : "memory");
+        }
+        meter_stop(&find, members);
+
+        meter_start(&rem);
+        for (size_t i = 0; i < members; i++) cn_remove_by_sock(&reg, nodes[order[i]].sock);
+        meter_stop(&rem, members);
+
+        cn_registry_free(&reg);
+    }
+    meter_report("cn_add", members, &add);
+    meter_report("cn_find_by_name", members, &find);
+    meter_report("cn_remove_by_sock", members, &rem);
+
+out:
+    free(order);
+    free(nodes);
+}
+
+/* ---- thread-mode fanout ----------------------------------------------- */
+
+/* Same steps as a NOTE in talk_to_client(): snapshot the room, send one shared frame to each. */
+static void snapshot_and_send(room_t *room, int sender, const char *name, const char *text) {
+    int   *sockets = NULL;
+    size_t count = 0;
+    membership_room_snapshot(room, sender, &sockets, &count);
+    if (count) {
+        msg_frame_t *frame = msg_frame_new(MSG_DELIVER, name, text);
+        if (frame) {
+            for (size_t i = 0; i < count; i++) msg_frame_send(sockets[i], frame);
+            msg_frame_unref(frame);
+        }
+    }
+    pool_scratch_reset();
+}
+
+/*
+ * One op = one NOTE fanned out to `members - 1` socketpair peers. The peers
+ * are drained between ops, outside the timed region.
+ */
+static void bench_fanout(size_t members, size_t text_len) {
+    int  *ours  = malloc(members * sizeof(int));
+    int  *peers = malloc(members * sizeof(int));
+    char *text  = make_text(text_len);
+    char  sink[65536];
+    size_t joined = 0;
+    meter_t m = {0};
+    if (!ours || !peers || !text) goto out;
+
+    for (; joined < members; joined++) {
+        int sv[2];
+        char name[64];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) break;
+        snprintf(name, sizeof(name), "member-%zu", joined);
+        if (membership_join(sv[0], -1, name, NULL, NULL) != 0) {
+            close(sv[0]);
+            close(sv[1]);
+            break;
+        }
+        fcntl(sv[1], F_SETFL, O_NONBLOCK);
+        ours[joined] = sv[0];
+        peers[joined] = sv[1];
+    }
+    if (joined < members) {
+        log_warn("fanout: only %zu of %zu members could be created", joined, members);
+        goto out;
+    }
+
+    room_t *lobby = membership_lobby();
+    while (!meter_done(&m)) {
+        meter_start(&m);
+        for (int i = 0; i < 16; i++) snapshot_and_send(lobby, ours[0], "member-0", text);
+        meter_stop(&m, 16);
+
+        for (size_t i = 1; i < members; i++)
+            while (recv(peers[i], sink, sizeof(sink), 0) > 0) { }
+    }
+    char label[32];
+    snprintf(label, sizeof(label), "fanout_%zub", text_len);
+    meter_report(label, members, &m);
+
+out:
+    for (size_t i = 0; i < joined; i++) {
+        membership_leave(ours[i], NULL, NULL);     /* closes ours[i] */
+        close(peers[i]);
+    }
+    free(text);
+    free(peers);
+    free(ours);
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(void) {
+    static const size_t text_sizes[] = { 64, 4096 };
+    static const size_t registry_sizes[] = { 10, 1000, 100000 };
+    static const size_t fanout_sizes[] = { 10, 100, 1000 };
+
+    raise_fd_limit();
+    cn_registry_init(&g_clients);
+
+    printf("%-26s %8s %12s %10s %10s %12s\n", "benchmark", "size", "ns/op", "heap/op", "pool/op", "ops");
+    for (size_t i = 0; i < sizeof(text_sizes) / sizeof(*text_sizes); i++) {
+        bench_encode(text_sizes[i]);
+        bench_reader(text_sizes[i]);
+        bench_socketpair(text_sizes[i]);
+    }
+    for (size_t i = 0; i < sizeof(registry_sizes) / sizeof(*registry_sizes); i++)
+        bench_registry(registry_sizes[i]);
+    for (size_t i = 0; i < sizeof(fanout_sizes) / sizeof(*fanout_sizes); i++)
+        bench_fanout(fanout_sizes[i], 64);
+    return 0;
+}
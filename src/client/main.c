@@ -3,20 +3,90 @@
 #include "properties.h"
 #include "main.h"
 #include "receiver_handler.h"
+#include "render.h"
 #include "sender_handler.h"
 
-#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define INPUT_LINE_MAX 2048
+
+/*
+ * connect_to_server
+ * -----------------
+ * Starts a non-blocking connect to ip:port and returns the socket (the
+ * connection may still be in progress), or -1. The main loop finishes it.
+ */
+int connect_to_server(const char *ip, uint16_t port) {
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &server_addr.sin_addr) != 1) {
+        log_err("bad IP");
+        return -1;
+    }
+
+    int new_socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (new_socket_fd < 0) {
+        log_err("socket failed");
+        return -1;
+    }
+    if (connect(new_socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        log_err("connect failed");
+        close(new_socket_fd);
+        return -1;
+    }
+    return new_socket_fd;
+}
+
+/*
+ * Completes a connect the socket reported writable for: checks the result,
+ * goes back to blocking writes (frames are sent whole) and sends JOIN.
+ */
+static void finish_connect(client_ctx_t *ctx) {
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(ctx->sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) err = errno;
+    if (err) {
+        errno = err;
+        log_err("connect failed");
+        client_close(ctx);
+        return;
+    }
+
+    fcntl(ctx->sock, F_SETFL, fcntl(ctx->sock, F_GETFL) & ~O_NONBLOCK);
+    int nodelay = 1;  /* one write per frame; don't let Nagle hold notes back */
+    setsockopt(ctx->sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (sender_send_join(ctx) != 0) client_close(ctx);
+}
+
+/* Drops the connection in whatever state it is; back to OFFLINE. */
+void client_close(client_ctx_t *ctx) {
+    if (ctx->state == CLIENT_JOINED) msg_reader_free(&ctx->reader);
+    if (ctx->sock >= 0) close(ctx->sock);
+    ctx->sock  = -1;
+    ctx->state = CLIENT_OFFLINE;
+}
 
 /*
  * Client entry:
  * - Read config from client.properties (CLIENT_NAME, SERVER_IP, SERVER_PORT).
- * - Initialize sender context with that configuration.
- * - Start the sender thread (reads stdin, issues JOIN/LEAVE/NOTE/SHUTDOWN).
- * - Lazily start the receiver thread after JOIN succeeds (when sock >= 0).
- * - Wait for threads to finish and exit.
+ * - Run one poll() loop over stdin and the server socket (no threads):
+ *     stdin lines   → sender_handle_line() (JOIN/LEAVE/ROOM/NOTE/SHUTDOWN)
+ *     socket ready  → finish a pending connect, or receiver_on_readable()
+ * - While a JOIN is connecting, input is left unread so later lines only run
+ *   once the JOIN is on the wire; replies are read from that moment on.
+ * - Output is written as stdout takes it (render.h), never blocking the loop;
+ *   RENDER_RATE caps the server messages shown per second (0 = no cap) and
+ *   RENDER_BACKLOG how far the terminal may fall behind before they are collapsed.
+ * - Exit on SHUTDOWN / SHUTDOWN ALL or at the end of input.
  */
 int main(int argc, char **argv) {
     const char *properties_path = (argc>1 ? argv[1] : "client.properties");
@@ -26,39 +96,91 @@ int main(int argc, char **argv) {
     char *prop_client_name  = property_get_property(client_properties, "CLIENT_NAME");
     char *prop_server_ip    = property_get_property(client_properties, "SERVER_IP");
     char *prop_server_port  = property_get_property(client_properties, "SERVER_PORT");
+    char *prop_render_rate  = property_get_property(client_properties, "RENDER_RATE");
+    char *prop_backlog      = property_get_property(client_properties, "RENDER_BACKLOG");
+    render_init(prop_render_rate ? (unsigned)strtoul(prop_render_rate, NULL, 10) : 0,
+                prop_backlog ? strtoul(prop_backlog, NULL, 10) : 0);
 
     snprintf(loaded_cfg.name, sizeof(loaded_cfg.name), "%s", prop_client_name ? prop_client_name : "Anonymous");
     snprintf(loaded_cfg.server_ip, sizeof(loaded_cfg.server_ip), "%s", prop_server_ip ? prop_server_ip : "127.0.0.1");
     loaded_cfg.server_port = (uint16_t)(prop_server_port ? atoi(prop_server_port) : 7777);
 
-    sender_ctx_t sender_ctx = { .sock = -1, .quit = 0 };
-    snprintf(sender_ctx.my_name, sizeof(sender_ctx.my_name), "%s", loaded_cfg.name);
-    snprintf(sender_ctx.server_ip, sizeof(sender_ctx.server_ip), "%s", loaded_cfg.server_ip);
-    sender_ctx.server_port = loaded_cfg.server_port;
-
-    printf("Commands:\n  JOIN IP port\n  LEAVE\n  SHUTDOWN\n  SHUTDOWN ALL\n  <any text> -> NOTE\n");
-
-    /* Sender thread: parses user commands from stdin and talks to the server. */
-    pthread_t sender_thread_id;
-    pthread_create(&sender_thread_id, NULL, sender_thread, &sender_ctx);
-
-    /*
-     * Receiver thread lifecycle:
-     * - We don't create it until the first successful JOIN (when sender sets sock >= 0).
-     * - This avoids having a receiver spinning on an invalid socket before JOIN.
-     */
-    pthread_t receiver_thread_id = 0;
-    int receiver_running = 0;
-    while (!sender_ctx.quit) {
-        if (!receiver_running && sender_ctx.sock >= 0) {
-            receiver_running = 1;
-            pthread_create(&receiver_thread_id, NULL, receiver_thread, (void*)(intptr_t)sender_ctx.sock);
+    client_ctx_t ctx = { .state = CLIENT_OFFLINE, .sock = -1, .quit = 0 };
+    snprintf(ctx.my_name, sizeof(ctx.my_name), "%s", loaded_cfg.name);
+    snprintf(ctx.server_ip, sizeof(ctx.server_ip), "%s", loaded_cfg.server_ip);
+    ctx.server_port = loaded_cfg.server_port;
+
+    render_printf("Commands:\n  JOIN IP port\n  LEAVE\n  ROOM JOIN name\n  ROOM LEAVE\n  ROOM LIST\n"
+           "  HISTORY [seq|@unix_time] [count]\n"
+           "  @name text -> direct message\n  SHUTDOWN\n  SHUTDOWN ALL\n  <any text> -> NOTE\n");
+
+    char   input[INPUT_LINE_MAX];
+    size_t input_len = 0;
+    int    input_eof = 0;
+
+    while (!ctx.quit) {
+        /* Run every complete line we have, unless a JOIN is still connecting. */
+        while (!ctx.quit && ctx.state != CLIENT_CONNECTING) {
+            char *newline = memchr(input, '\n', input_len);
+            size_t line_len = newline ? (size_t)(newline - input)
+                            : (input_eof || input_len == sizeof(input) - 1) ? input_len : 0;
+            if (!newline && !line_len) break;
+
+            size_t consumed = line_len + (newline ? 1 : 0);
+            input[line_len] = '\0';
+            input[strcspn(input, "\r")] = '\0';
+            sender_handle_line(&ctx, input);
+            memmove(input, input + consumed, input_len - consumed);
+            input_len -= consumed;
+        }
+        if (ctx.quit || (input_eof && !input_len && ctx.state != CLIENT_CONNECTING)) break;
+
+        struct pollfd fds[3];
+        nfds_t nfds = 0, stdin_at = 3, sock_at = 3, stdout_at = 3;
+        if (!input_eof && ctx.state != CLIENT_CONNECTING) {
+            stdin_at = nfds;
+            fds[nfds++] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+        }
+        if (ctx.sock >= 0) {
+            sock_at = nfds;
+            fds[nfds++] = (struct pollfd){ .fd = ctx.sock,
+                                           .events = ctx.state == CLIENT_CONNECTING ? POLLOUT : POLLIN };
+        }
+
+        if (render_pending()) {
+            stdout_at = nfds;
+            fds[nfds++] = (struct pollfd){ .fd = STDOUT_FILENO, .events = POLLOUT };
+        }
+
+        if (poll(fds, nfds, render_timeout_ms()) < 0) {
+            if (errno == EINTR) continue;
+            log_err("poll failed");
+            break;
+        }
+        render_tick();
+        if (stdout_at < nfds && fds[stdout_at].revents && render_flush(STDOUT_FILENO) != 0) {
+            ctx.quit = 1;           /* nobody is reading our output any more */
+            break;
+        }
+
+        if (sock_at < nfds && fds[sock_at].revents) {
+            if (ctx.state == CLIENT_CONNECTING) {
+                finish_connect(&ctx);
+            } else if (receiver_on_readable(&ctx) != 0) {
+                client_close(&ctx);
+                render_printf("[info] disconnected from server\n");
+            }
+        }
+
+        if (stdin_at < nfds && fds[stdin_at].revents) {
+            ssize_t got = read(STDIN_FILENO, input + input_len, sizeof(input) - 1 - input_len);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) input_eof = 1;
+            else          input_len += (size_t)got;
         }
-        /* Poll at a small interval to avoid busy-waiting while keeping code simple. */
-        usleep(50*1000);
     }
 
-    if (receiver_running) pthread_join(receiver_thread_id, NULL);
-    pthread_join(sender_thread_id, NULL);
+    client_close(&ctx);
+    render_drain(STDOUT_FILENO);
     return 0;
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include "../shared/message.h"
 
 typedef struct {
     char   name[64];
@@ -7,4 +8,30 @@ typedef struct {
     uint16_t server_port;
 } client_cfg_t;
 
-int connect_to_server(const char *ip, uint16_t port);
+/*
+ * Connection state machine (main.c drives it from one poll loop):
+ *   OFFLINE    --JOIN-->                CONNECTING
+ *   CONNECTING --connected, JOIN sent--> JOINED       (stdin is paused until then)
+ *   CONNECTING --connect failed-->      OFFLINE
+ *   JOINED     --LEAVE / BYE / EOF-->   OFFLINE
+ */
+typedef enum {
+    CLIENT_OFFLINE,
+    CLIENT_CONNECTING,
+    CLIENT_JOINED
+} client_state_t;
+
+typedef struct {
+    client_state_t state;
+    int            sock;            // -1 when OFFLINE
+    msg_reader_t   reader;          // frames from the server, valid while JOINED
+    char           my_name[64];
+    char           server_ip[64];
+    unsigned short server_port;
+    int            quit;            // set by SHUTDOWN, SHUTDOWN ALL or end of input
+    int            wire_version;    // 1, or 2 once the server acked our v2 request
+    int            deflate;         // server acked compression: large requests go compressed
+} client_ctx_t;
+
+int  connect_to_server(const char *ip, uint16_t port);
+void client_close(client_ctx_t *ctx);
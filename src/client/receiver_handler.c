@@ -1,9 +1,12 @@
 #include "receiver_handler.h"
 #include "../shared/message.h"
+#include "render.h"
 #include "text_color.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 /*
@@ -12,53 +15,98 @@
  * - MSG_JOINING: print notice that someone joined (not this client)
  * - MSG_LEFT:    print notice that someone left
  * - MSG_BYE:     server asks everyone to shut down (receiver will break loop)
+ * - MSG_ROOM_ENTERED / MSG_ROOM_EXITED: someone (maybe us) moved between rooms
+ * - MSG_ROOM_LIST_REPLY: answer to ROOM LIST
+ * - MSG_DIRECT_DELIVER: private message, printed as "[dm] Name: text"
+ * - MSG_HISTORY_ENTRY: a logged note, printed as "[#seq HH:MM:SS] Name: text"
+ * - MSG_ERROR:   the server rejected our last request
  *
  * Colors come from text_color.h; fall back to plain text if those macros are no-ops.
+ * Output is buffered (render.h); chat traffic may be collapsed into a count,
+ * answers to our own requests never are.
  */
 void  dispatch_server_message(int t, const char *name, const char *text) {
+    if (t != MSG_BYE && t != MSG_ERROR && t != MSG_ROOM_LIST_REPLY && t != MSG_HISTORY_ENTRY &&
+        !render_admit()) return;
+
     switch ((msg_type_t)t) {
     case MSG_DELIVER:
-        if (name && text) printf(NOTE_COLOR "%s: %s" RESET_COLOR "\n", name, text);
+        if (name && text) render_printf(NOTE_COLOR "%s: %s" RESET_COLOR "\n", name, text);
         break;
     case MSG_JOINING:
-        if (name) printf(JOINED_COLOR "[info] %s joined" RESET_COLOR "\n", name);
+        if (name) render_printf(JOINED_COLOR "[info] %s joined" RESET_COLOR "\n", name);
         break;
     case MSG_LEFT:
-        if (name) printf(LEFT_COLOR "[info] %s left" RESET_COLOR "\n", name);
+        if (name) render_printf(LEFT_COLOR "[info] %s left" RESET_COLOR "\n", name);
         break;
     case MSG_BYE:
-        if (text) printf("[server] %s\n", text);
+        if (text) render_printf("[server] %s\n", text);
+        break;
+    case MSG_ROOM_ENTERED:
+        if (name && text) render_printf(JOINED_COLOR "[info] %s entered #%s" RESET_COLOR "\n", name, text);
+        break;
+    case MSG_ROOM_EXITED:
+        if (name && text) render_printf(LEFT_COLOR "[info] %s left #%s" RESET_COLOR "\n", name, text);
+        break;
+    case MSG_DIRECT_DELIVER:
+        if (name && text) render_printf(NOTE_COLOR "[dm] %s: %s" RESET_COLOR "\n", name, text);
+        break;
+    case MSG_HISTORY_ENTRY: {
+        unsigned long long seq, when;
+        int note_at = 0;
+        if (!name || !text || sscanf(text, "%llu %llu %n", &seq, &when, &note_at) != 2) break;
+        time_t logged_at = (time_t)when;
+        struct tm tm;
+        char stamp[16];
+        strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime_r(&logged_at, &tm));
+        render_printf("[#%llu %s] %s: %s\n", seq, stamp, name, text + note_at);
+        break;
+    }
+    case MSG_ERROR:
+        if (text) render_printf("[error] %s\n", text);
+        break;
+    case MSG_ROOM_LIST_REPLY:
+        render_printf("[rooms] %s\n", text && *text ? text : "(none)");
         break;
     default:
         /* Unknown message types are silently ignored. */
         break;
     }
-    fflush(stdout);
 }
 
 /*
- * Receiver thread:
- * - Blocks on msg_recv() to read framed messages.
- * - For each message, hands it to dispatch_server_message().
- * - Exits when MSG_BYE is received or when the connection is closed.
+ * Called by the main loop when the server socket is readable:
+ * - One recv() into the frame reader, then every complete frame it holds.
+ * - A PROTO_ACK switches our requests to wire protocol v2, and to compressing
+ *   large ones if it lists that (replies are decoded in any form by the reader).
+ * - For each other message, hands it to dispatch_server_message().
+ * Returns -1 when the server said BYE or the connection is closed or broken;
+ * the caller then closes it.
  */
-void *receiver_thread(void *arg) {
-    int server_socket_fd = (int)(intptr_t)arg;
+int receiver_on_readable(client_ctx_t *ctx) {
+    ssize_t recvd = msg_reader_fill(&ctx->reader);
+    if (recvd < 0 && errno == EINTR) return 0;
+    if (recvd <= 0) return -1;
 
     for (;;) {
         msg_type_t received_type;
         char *received_name = NULL;
         char *received_text = NULL;
 
-        if (msg_recv(server_socket_fd, &received_type, &received_name, &received_text) != 0)
-            break;
+        int parsed = msg_reader_next(&ctx->reader, &received_type, &received_name, &received_text);
+        if (parsed == 0) break;
+        if (parsed < 0) return -1;
 
-        dispatch_server_message((int)received_type, received_name, received_text);
+        if (received_type == MSG_PROTO_ACK) {
+            ctx->deflate = msg_proto_has(received_text, MSG_PROTO_DEFLATE);
+            if (msg_proto_has(received_text, MSG_PROTO_V2)) ctx->wire_version = 2;
+        } else {
+            dispatch_server_message((int)received_type, received_name, received_text);
+        }
         msg_free(received_name, received_text);
 
-        if (received_type == MSG_BYE) break;
+        if (received_type == MSG_BYE) return -1;
     }
-
-    close(server_socket_fd);
-    return NULL;
+    msg_reader_trim(&ctx->reader);
+    return 0;
 }
@@ -1,3 +1,5 @@
 #pragma once
-void *receiver_thread(void *arg);
+#include "main.h"
+
+int   receiver_on_readable(client_ctx_t *ctx);   // -1: the connection is over
 void  dispatch_server_message(int type, const char *name, const char *text);
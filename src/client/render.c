@@ -0,0 +1,144 @@
+#include "render.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RENDER_WINDOW_MS 1000       /* rate cap window; collapsed counts are shown at its end */
+
+/* The client is single-threaded: module state, no locking. */
+static char    *g_buf;
+static size_t   g_cap, g_start, g_end;      /* pending output is g_buf[g_start, g_end) */
+static size_t   g_backlog_max = 1u << 20;
+static unsigned g_rate;
+static uint64_t g_window_end;               /* ms; end of the current rate window */
+static unsigned g_window_count;             /* messages shown in this window */
+static unsigned long g_collapsed;           /* messages not shown since the last notice */
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+void render_init(unsigned rate_per_sec, size_t backlog_max) {
+    g_rate = rate_per_sec;
+    if (backlog_max) g_backlog_max = backlog_max;
+}
+
+/* Room for `need` more bytes: slide pending output to the front, then grow. */
+static int reserve(size_t need) {
+    if (g_start && g_cap - g_end < need) {
+        memmove(g_buf, g_buf + g_start, g_end - g_start);
+        g_end  -= g_start;
+        g_start = 0;
+    }
+    if (g_cap - g_end >= need) return 0;
+
+    size_t cap = g_cap ? g_cap : 4096;
+    while (cap - g_end < need) cap *= 2;
+    char *grown = realloc(g_buf, cap);
+    if (!grown) return -1;
+    g_buf = grown;
+    g_cap = cap;
+    return 0;
+}
+
+void render_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len <= 0 || reserve((size_t)len + 1) != 0) return;
+
+    va_start(ap, fmt);
+    vsnprintf(g_buf + g_end, g_cap - g_end, fmt, ap);
+    va_end(ap);
+    g_end += (size_t)len;
+}
+
+/* Shows the "… N more messages" line once its window is over. */
+void render_tick(void) {
+    uint64_t now = now_ms();
+    if (now < g_window_end) return;
+    if (g_collapsed && render_pending() < g_backlog_max) {
+        render_printf("\xe2\x80\xa6 %lu more message%s\n", g_collapsed, g_collapsed == 1 ? "" : "s");
+        g_collapsed = 0;
+    }
+    g_window_end   = now + RENDER_WINDOW_MS;
+    g_window_count = 0;
+}
+
+/*
+ * Decides whether the next server message is shown (1) or only counted (0):
+ * over the rate cap, or with the terminal too far behind.
+ */
+int render_admit(void) {
+    render_tick();
+    if (render_pending() >= g_backlog_max || (g_rate && g_window_count >= g_rate)) {
+        g_collapsed++;
+        return 0;
+    }
+    g_window_count++;
+    return 1;
+}
+
+size_t render_pending(void) {
+    return g_end - g_start;
+}
+
+/* How long the main loop may sleep before render_tick() has something to show. */
+int render_timeout_ms(void) {
+    if (!g_collapsed) return -1;
+    uint64_t now = now_ms();
+    return now >= g_window_end ? 0 : (int)(g_window_end - now);
+}
+
+/*
+ * Writes what fd can take after poll() reported it writable: one write of at
+ * most PIPE_BUF bytes. Writable only means a pipe can take PIPE_BUF bytes; a
+ * terminal or socket may take less and a blocking write would then wait, so
+ * fd is non-blocking for the write. Only for the write: stdout usually shares
+ * its open file description with stdin and with the shell's terminal.
+ * Returns -1 if fd is gone.
+ */
+int render_flush(int fd) {
+    size_t pending = render_pending();
+    if (!pending) return 0;
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && !(flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    ssize_t wrote = write(fd, g_buf + g_start, pending < PIPE_BUF ? pending : PIPE_BUF);
+    int saved = errno;
+    if (flags >= 0 && !(flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags);
+    errno = saved;
+    if (wrote < 0) return errno == EINTR || errno == EAGAIN ? 0 : -1;
+    g_start += (size_t)wrote;
+    if (g_start == g_end) g_start = g_end = 0;
+    return 0;
+}
+
+static void write_pending(int fd) {
+    while (render_pending()) {
+        ssize_t wrote = write(fd, g_buf + g_start, render_pending());
+        if (wrote < 0 && errno == EINTR) continue;
+        if (wrote <= 0) break;
+        g_start += (size_t)wrote;
+    }
+    g_start = g_end = 0;
+}
+
+/* At exit: everything still pending plus any collapsed count, blocking as long as it takes. */
+void render_drain(int fd) {
+    write_pending(fd);
+    g_window_end = 0;
+    render_tick();
+    write_pending(fd);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * Terminal output of the client
+ * -----------------------------
+ * Everything the client shows is appended to one buffer; the main loop
+ * writes it out whenever stdout can take more (at most PIPE_BUF bytes per
+ * poll, written non-blocking). A receive batch therefore costs one
+ * write, not one printf + fflush per message, and a slow terminal never
+ * holds up reading the socket.
+ *
+ * Server messages go through render_admit(): past RENDER_RATE messages per
+ * second (0 = no cap), or while the terminal is RENDER_BACKLOG bytes behind,
+ * they are only counted and later shown as one "… N more messages" line.
+ * The client's own status lines are always shown.
+ */
+void   render_init(unsigned rate_per_sec, size_t backlog_max);
+void   render_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int    render_admit(void);
+size_t render_pending(void);
+int    render_timeout_ms(void);
+void   render_tick(void);
+int    render_flush(int fd);
+void   render_drain(int fd);
@@ -1,43 +1,52 @@
 #define DBG
 #include "dbg.h"
 #include "sender_handler.h"
+#include "render.h"
 #include "../shared/message.h"
 
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
 
 /*
- * Connect to the server and send a JOIN with our configured name.
- * On success, sets ctx->sock to the connected socket and prints a short status line.
+ * Sends one request in whichever wire protocol version the server agreed to.
  */
-static int do_join(sender_ctx_t *ctx) {
-    if (ctx->sock >= 0) { printf("[warn] already joined\n"); return 0; }
+static int send_request(client_ctx_t *ctx, msg_type_t type, const char *name, const char *text) {
+    if (ctx->wire_version == 2)
+        return msg_send_v2(ctx->sock, type, name, text, ctx->deflate ? MSG_DEFLATE_MIN : 0);
+    return msg_send(ctx->sock, type, name, text);
+}
 
-    int new_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in server_addr = {0};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(ctx->server_port);
+/*
+ * Start connecting to the configured server. The JOIN itself goes out from
+ * sender_send_join() once the main loop sees the connection complete.
+ */
+static int do_join(client_ctx_t *ctx) {
+    if (ctx->state != CLIENT_OFFLINE) { render_printf("[warn] already joined\n"); return 0; }
 
-    if (inet_pton(AF_INET, ctx->server_ip, &server_addr.sin_addr) != 1) {
-        log_err("bad IP");
-        close(new_socket_fd);
-        return -1;
-    }
-    if (connect(new_socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        log_err("connect failed");
-        close(new_socket_fd);
-        return -1;
-    }
-    if (msg_send(new_socket_fd, MSG_JOIN, ctx->my_name, NULL) != 0) {
+    int new_socket_fd = connect_to_server(ctx->server_ip, ctx->server_port);
+    if (new_socket_fd < 0) return -1;
+
+    ctx->sock  = new_socket_fd;
+    ctx->state = CLIENT_CONNECTING;
+    return 0;
+}
+
+/*
+ * Connection is up: send a JOIN with our configured name, asking for the
+ * compact v2 protocol with compression (requests switch over once the
+ * server acks), and start receiving.
+ */
+int sender_send_join(client_ctx_t *ctx) {
+    ctx->wire_version = 1;
+    ctx->deflate      = 0;
+    if (msg_send(ctx->sock, MSG_JOIN, ctx->my_name, MSG_PROTO_V2 " " MSG_PROTO_DEFLATE) != 0) {
         log_err("JOIN send failed");
-        close(new_socket_fd);
         return -1;
     }
 
-    ctx->sock = new_socket_fd;
-    printf("[info] joined %s:%u as %s\n", ctx->server_ip, ctx->server_port, ctx->my_name);
+    msg_reader_init(&ctx->reader, ctx->sock);
+    ctx->state = CLIENT_JOINED;
+    render_printf("[info] joined %s:%u as %s\n", ctx->server_ip, ctx->server_port, ctx->my_name);
     return 0;
 }
 
@@ -45,65 +54,89 @@ static int do_join(sender_ctx_t *ctx) {
  * Send LEAVE and close our current socket.
  * After this, the user may JOIN again to the same or a different server.
  */
-static int do_leave(sender_ctx_t *ctx) {
-    if (ctx->sock < 0) { printf("[warn] not joined\n"); return 0; }
-    msg_send(ctx->sock, MSG_LEAVE, NULL, NULL);
-    close(ctx->sock);
-    ctx->sock = -1;
-    printf("[info] left chat\n");
+static int do_leave(client_ctx_t *ctx) {
+    if (ctx->state != CLIENT_JOINED) { render_printf("[warn] not joined\n"); return 0; }
+    send_request(ctx, MSG_LEAVE, NULL, NULL);
+    client_close(ctx);
+    render_printf("[info] left chat\n");
     return 0;
 }
 
 /*
- * Sender thread:
- * - Reads lines from stdin (blocking).
+ * Handles one line of user input (newline already stripped). The main loop
+ * holds input back while a JOIN is connecting, so every line here sees
+ * either OFFLINE or JOINED.
  * - Recognized commands:
  *     "JOIN IP port"   → connects and sends JOIN (updates ctx->server_ip/port if provided)
  *     "LEAVE"          → sends LEAVE and closes the socket
+ *     "ROOM JOIN name" → moves to room `name` (created on first use)
+ *     "ROOM LEAVE"     → moves back to the lobby
+ *     "ROOM LIST"      → asks for the non-empty rooms and their sizes
+ *     "HISTORY [seq|@unix_time] [count]" → logged notes of our room (default: the newest)
+ *     "@name text"     → sends `text` privately to `name` only
  *     "SHUTDOWN"       → sends SHUTDOWN (leaves if joined), then sets quit flag
  *     "SHUTDOWN ALL"   → sends SHUTDOWN_ALL (only valid if joined), then sets quit flag
- *   Any other text     → sent as NOTE to all other clients (must be joined)
+ *   Any other text     → sent as NOTE to the other clients in our room (must be joined)
  */
-void *sender_thread(void *arg) {
-    sender_ctx_t *ctx = (sender_ctx_t*)arg;
-    char input_line[2048];
-
-    while (!ctx->quit) {
-        if (!fgets(input_line, sizeof(input_line), stdin)) break;
-        input_line[strcspn(input_line, "\r\n")] = 0; /* strip newline */
-        if (!*input_line) continue;
-
-        if (!strncmp(input_line, "JOIN ", 5)) {
-            char ip_str[64]; int port_val = 0;
-            if (sscanf(input_line+5, "%63s %d", ip_str, &port_val) == 2) {
-                /* Update destination from user command before attempting the join. */
-                strncpy(ctx->server_ip, ip_str, sizeof(ctx->server_ip)-1);
-                ctx->server_port = (unsigned short)port_val;
-            }
-            do_join(ctx);
-
-        } else if (!strcmp(input_line, "LEAVE")) {
-            do_leave(ctx);
-
-        } else if (!strcmp(input_line, "SHUTDOWN ALL")) {
-            if (ctx->sock >= 0) msg_send(ctx->sock, MSG_SHUTDOWN_ALL, NULL, NULL);
-            ctx->quit = 1;
-
-        } else if (!strcmp(input_line, "SHUTDOWN")) {
-            if (ctx->sock >= 0) msg_send(ctx->sock, MSG_SHUTDOWN, NULL, NULL);
-            if (ctx->sock >= 0) { close(ctx->sock); ctx->sock = -1; }
-            ctx->quit = 1;
+void sender_handle_line(client_ctx_t *ctx, char *input_line) {
+    int joined = ctx->state == CLIENT_JOINED;
+    if (!*input_line) return;
 
+    if (!strncmp(input_line, "JOIN ", 5)) {
+        char ip_str[64]; int port_val = 0;
+        if (sscanf(input_line+5, "%63s %d", ip_str, &port_val) == 2 && !joined) {
+            /* Update destination from user command before attempting the join. */
+            snprintf(ctx->server_ip, sizeof(ctx->server_ip), "%s", ip_str);
+            ctx->server_port = (unsigned short)port_val;
+        }
+        do_join(ctx);
+
+    } else if (!strcmp(input_line, "LEAVE")) {
+        do_leave(ctx);
+
+    } else if (!strncmp(input_line, "ROOM JOIN ", 10)) {
+        if (!joined) render_printf("[warn] you must JOIN before changing rooms\n");
+        else         send_request(ctx, MSG_ROOM_JOIN, NULL, input_line + 10);
+
+    } else if (!strcmp(input_line, "ROOM LEAVE")) {
+        if (!joined) render_printf("[warn] not joined\n");
+        else         send_request(ctx, MSG_ROOM_LEAVE, NULL, NULL);
+
+    } else if (!strcmp(input_line, "ROOM LIST")) {
+        if (!joined) render_printf("[warn] not joined\n");
+        else         send_request(ctx, MSG_ROOM_LIST, NULL, NULL);
+
+    } else if (!strcmp(input_line, "HISTORY") || !strncmp(input_line, "HISTORY ", 8)) {
+        if (!joined) render_printf("[warn] not joined\n");
+        else         send_request(ctx, MSG_HISTORY, NULL, input_line[7] ? input_line + 8 : NULL);
+
+    } else if (input_line[0] == '@') {
+        /* Direct message: "@name text". */
+        char *text = strchr(input_line, ' ');
+        if (!joined) {
+            render_printf("[warn] you must JOIN before sending messages\n");
+        } else if (!text || text == input_line + 1 || !text[1]) {
+            render_printf("[warn] usage: @name text\n");
         } else {
-            /* Default: treat as NOTE, but only if we are currently a chat participant. */
-            if (ctx->sock < 0) {
-                printf("[warn] you must JOIN before sending notes\n");
-            } else {
-                msg_send(ctx->sock, MSG_NOTE, NULL, input_line);
-            }
+            *text++ = '\0';
+            send_request(ctx, MSG_DIRECT, input_line + 1, text);
         }
-    }
 
-    if (ctx->sock >= 0) close(ctx->sock);
-    return NULL;
+    } else if (!strcmp(input_line, "SHUTDOWN ALL")) {
+        if (joined) send_request(ctx, MSG_SHUTDOWN_ALL, NULL, NULL);
+        ctx->quit = 1;
+
+    } else if (!strcmp(input_line, "SHUTDOWN")) {
+        if (joined) send_request(ctx, MSG_SHUTDOWN, NULL, NULL);
+        client_close(ctx);
+        ctx->quit = 1;
+
+    } else {
+        /* Default: treat as NOTE, but only if we are currently a chat participant. */
+        if (!joined) {
+            render_printf("[warn] you must JOIN before sending notes\n");
+        } else {
+            send_request(ctx, MSG_NOTE, NULL, input_line);
+        }
+    }
 }
@@ -1,30 +1,82 @@
-#define DBG
-#include "dbg.h"
+#include "../shared/slog.h"
 #include "client_handler.h"
 #include "main.h"
 #include "../shared/message.h"
 #include "../shared/chat_node.h"
+#include "../shared/pool.h"
+#include "../shared/trace.h"
+#include "membership.h"
+#include "metrics.h"
 
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 /*
- * Convenience wrappers to send specific server->client indications.
- * These keep call sites short and make intent obvious.
+ * Sends one server->client indication to every socket in a snapshot.
+ * The frame is encoded once and the same bytes go to every recipient.
  */
-static int send_joining(int client_socket_fd, const char *joining_name) {
-    return msg_send(client_socket_fd, MSG_JOINING, joining_name, NULL);
+static void broadcast(const int *sockets, size_t count, msg_type_t type, const char *name, const char *text) {
+    if (count == 0) return;
+    msg_frame_t *frame = msg_frame_new(type, name, text);
+    if (!frame) return;
+    size_t sent = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (msg_frame_send(sockets[i], frame) == 0) sent++;
+    }
+    metrics_sent(type, sent);
+    metrics_bytes_out(sent * frame->len);
+    msg_frame_unref(frame);
 }
-static int send_left(int client_socket_fd, const char *leaving_name) {
-    return msg_send(client_socket_fd, MSG_LEFT, leaving_name, NULL);
+
+/* Sends one indication to a single client. */
+static void reply(int sock, msg_type_t type, const char *name, const char *text) {
+    if (msg_send(sock, type, name, text) != 0) return;
+    metrics_sent(type, 1);
+    if (g_metrics_on) metrics_bytes_out(msg_encoded_len(name, text));
 }
-static int send_deliver(int client_socket_fd, const char *from_name, const char *note_text) {
-    return msg_send(client_socket_fd, MSG_DELIVER, from_name, note_text);
+
+/*
+ * Removes this client from g_clients (which closes its socket) and tells
+ * everyone else that it left.
+ */
+static void leave_and_notify(int client_socket_fd, const char *leaving_name) {
+    int   *notify_sockets = NULL;
+    size_t notify_count = 0;
+    membership_leave(client_socket_fd, &notify_sockets, &notify_count);
+
+    broadcast(notify_sockets, notify_count, MSG_LEFT, leaving_name, NULL);
+    pool_scratch_reset();
 }
-static int send_bye(int client_socket_fd) {
-    return msg_send(client_socket_fd, MSG_BYE, NULL, "Server shutting down");
+
+/*
+ * Moves this client into the room called `target` and tells both rooms about
+ * it: MSG_ROOM_EXITED to whoever is left behind, MSG_ROOM_ENTERED to the new
+ * room (including the mover, as confirmation).
+ */
+static void change_room(int client_socket_fd, const char *name, room_t **current, const char *target) {
+    char from_name[ROOM_NAME_MAX + 1];
+    snprintf(from_name, sizeof(from_name), "%s", membership_room_name(*current));
+
+    room_t *to;
+    int    *sockets = NULL;
+    size_t  count = 0;
+    int rc = membership_room_move(client_socket_fd, target, &to, &sockets, &count);
+    if (rc == -2) {
+        reply(client_socket_fd, MSG_ERROR, NULL, "invalid room name or too many rooms");
+        return;
+    }
+    if (rc != 0) return;
+    *current = to;
+
+    /* The old room may have closed already: its members were snapshotted by the move. */
+    broadcast(sockets, count, MSG_ROOM_EXITED, name, from_name);
+
+    membership_room_snapshot(to, -1, &sockets, &count);
+    broadcast(sockets, count, MSG_ROOM_ENTERED, name, membership_room_name(to));
+    pool_scratch_reset();
 }
 
 /*
@@ -32,7 +84,8 @@ static int send_bye(int client_socket_fd) {
  * --------------
  * Per-connection thread entry. Handles the entire lifetime of a single client socket:
  *   - Receives length-prefixed messages (see message.c) from one client.
- *   - Validates and processes JOIN / NOTE / LEAVE / SHUTDOWN / SHUTDOWN_ALL.
+ *   - Validates and processes JOIN / NOTE / LEAVE / SHUTDOWN / SHUTDOWN_ALL
+ *     the ROOM_JOIN / ROOM_LEAVE / ROOM_LIST room commands and DIRECT messages.
  *   - Maintains global membership list g_clients under g_clients_mx.
  *   - Broadcasts JOINING/LEFT/DELIVER/BYE events to other clients.
  *
@@ -47,6 +100,12 @@ void *talk_to_client(void *arg) {
     int client_socket_fd = (int)(intptr_t)arg;     /* Connected socket for this client thread */
     char *joined_client_name = NULL;               /* malloc'd copy of the client's name after JOIN */
     int   has_joined = 0;                          /* Whether this client has successfully JOINed */
+    room_t *room = NULL;                           /* Room our NOTEs go to, once joined */
+    int   socket_closed = 0;                       /* membership_leave() closes the socket for us */
+    msg_reader_t reader;                           /* buffers pipelined frames between recv() calls */
+    msg_reader_init(&reader, client_socket_fd);
+    reader.from_client = 1;
+    TRACE_THREAD_NAME("client fd %d", client_socket_fd);
 
     for (;;) {
         /* Receive a single framed message from this client. */
@@ -54,11 +113,14 @@ void *talk_to_client(void *arg) {
         char *incoming_name = NULL;                /* If present in frame; owned until msg_free */
         char *incoming_text = NULL;                /* If present in frame; owned until msg_free */
 
-        if (msg_recv(client_socket_fd, &incoming_type, &incoming_name, &incoming_text) != 0) {
+        if (msg_reader_recv(&reader, &incoming_type, &incoming_name, &incoming_text) != 0) {
             /* Socket closed or protocol error; exit the loop and clean up. */
             debug("client socket %d closed or bad frame\n", client_socket_fd);
             break;
         }
+        /* Thread mode peers speak v1 only, so the re-encoded length is what arrived. */
+        metrics_received(incoming_type);
+        if (g_metrics_on) metrics_bytes_in(msg_encoded_len(incoming_name, incoming_text));
 
         switch (incoming_type) {
 
@@ -78,68 +140,96 @@ void *talk_to_client(void *arg) {
             if (!has_joined && incoming_name && *incoming_name) {
                 debug("JOIN from %s\n", incoming_name);
 
-                /* Dynamic array of sockets to notify after releasing the lock. */
+                /* Sockets to notify, snapshotted under the lock by membership_join(). */
                 int   *notify_sockets = NULL;
-                size_t notify_count = 0, notify_cap = 0;
-
-                pthread_mutex_lock(&g_clients_mx);
-                if (!cn_find_by_name(g_clients, incoming_name)) {
-                    /* Insert new member into the global list. */
-                    chat_node_t new_member = (chat_node_t){0};
-                    snprintf(new_member.name, sizeof(new_member.name), "%s", incoming_name);
-                    new_member.sock = client_socket_fd;
-                    cn_add(&g_clients, &new_member);
+                size_t notify_count = 0;
 
+                if (membership_join(client_socket_fd, -1, incoming_name, &notify_sockets, &notify_count) == 0) {
                     has_joined = 1;
                     joined_client_name = strdup(incoming_name);
-
-                    /* Snapshot recipients (all other sockets) for MSG_JOINING. */
-                    for (chat_node_list_t *it = g_clients; it; it = it->next) {
-                        if (it->node.sock == client_socket_fd) continue; /* do not notify the joiner */
-                        if (notify_count == notify_cap) {
-                            notify_cap = notify_cap ? notify_cap * 2 : 8;
-                            notify_sockets = realloc(notify_sockets, notify_cap * sizeof(int));
-                        }
-                        notify_sockets[notify_count++] = it->node.sock;
-                    }
+                    room = membership_lobby();
                 }
-                pthread_mutex_unlock(&g_clients_mx);
 
                 /* Perform network I/O without holding the mutex. */
-                for (size_t i = 0; i < notify_count; i++) {
-                    msg_send(notify_sockets[i], MSG_JOINING, joined_client_name, NULL);
-                }
-                free(notify_sockets);
+                broadcast(notify_sockets, notify_count, MSG_JOINING, joined_client_name, NULL);
+                pool_scratch_reset();
             }
             break;
 
         case MSG_NOTE:
             /*
-             * Forward a NOTE (incoming_text) from this client to all other participants.
-             * The sender must have joined already. The payload is delivered as MSG_DELIVER
-             * with sender's name (joined_client_name).
+             * Forward a NOTE (incoming_text) from this client to the other members of its
+             * room. The sender must have joined already. The payload is delivered as
+             * MSG_DELIVER with sender's name (joined_client_name).
              */
             if (has_joined && incoming_text) {
                 debug("NOTE from %s: %s\n", joined_client_name, incoming_text);
 
+                /* Traced as one "note" span: "snapshot", then one "msg_frame_send" per recipient. */
+                uint64_t trace_id = TRACE_ID_NEXT();
+                TRACE_SET_CURRENT(trace_id);
+                TRACE_BEGIN(note_span);
+                uint64_t fanout = metrics_begin();
                 int   *recipient_sockets = NULL;
-                size_t recipient_count = 0, recipient_cap = 0;
-
-                pthread_mutex_lock(&g_clients_mx);
-                for (chat_node_list_t *it = g_clients; it; it = it->next) {
-                    if (it->node.sock == client_socket_fd) continue; /* do not echo to originator */
-                    if (recipient_count == recipient_cap) {
-                        recipient_cap = recipient_cap ? recipient_cap * 2 : 8;
-                        recipient_sockets = realloc(recipient_sockets, recipient_cap * sizeof(int));
-                    }
-                    recipient_sockets[recipient_count++] = it->node.sock;
-                }
-                pthread_mutex_unlock(&g_clients_mx);
+                size_t recipient_count = 0;
+                TRACE_BEGIN(snapshot_span);
+                membership_room_snapshot(room, client_socket_fd, &recipient_sockets, &recipient_count);
+                TRACE_END(snapshot_span, "snapshot", trace_id, TRACE_FLOW_STEP, (uint32_t)recipient_count);
+
+                broadcast(recipient_sockets, recipient_count, MSG_DELIVER, joined_client_name, incoming_text);
+                pool_scratch_reset();
+                metrics_end(METRICS_FANOUT, fanout);
+                TRACE_END(note_span, "note", trace_id, TRACE_FLOW_START, (uint32_t)client_socket_fd);
+                TRACE_SET_CURRENT(0);
+            }
+            break;
+
+        case MSG_ROOM_JOIN:
+        case MSG_ROOM_LEAVE:
+            /*
+             * Switch rooms (ROOM_JOIN names the room, created on first use and
+             * closed when its last member leaves) or go back to the lobby
+             * (ROOM_LEAVE). Invalid room names get MSG_ERROR.
+             */
+            if (has_joined) {
+                const char *target = incoming_type == MSG_ROOM_JOIN ? incoming_text : ROOM_LOBBY;
+                change_room(client_socket_fd, joined_client_name, &room, target);
+            }
+            break;
 
-                for (size_t i = 0; i < recipient_count; i++) {
-                    send_deliver(recipient_sockets[i], joined_client_name, incoming_text);
+        case MSG_DIRECT:
+            /*
+             * Private message: incoming_name is the recipient. Resolved through the
+             * registry's name index and sent to that one socket only, under the
+             * registry lock so the fd cannot be reused by a new connection in
+             * between; the sender gets MSG_ERROR if nobody by that name is connected.
+             */
+            if (has_joined && incoming_name && incoming_text) {
+                msg_frame_t *frame = msg_frame_new(MSG_DIRECT_DELIVER, joined_client_name, incoming_text);
+                int rc = frame ? membership_send_direct(incoming_name, frame) : -2;
+                if (rc == 0) {
+                    metrics_sent(MSG_DIRECT_DELIVER, 1);
+                    metrics_bytes_out(frame->len);
                 }
-                free(recipient_sockets);
+                if (frame) msg_frame_unref(frame);
+                if (rc == -1) {
+                    char reason[96];
+                    snprintf(reason, sizeof(reason), "no such user: %.63s", incoming_name);
+                    reply(client_socket_fd, MSG_ERROR, NULL, reason);
+                }
+            }
+            break;
+
+        case MSG_HISTORY:
+            /* Room history (the replay rings and the persistent log) lives in the reactors only. */
+            if (has_joined) reply(client_socket_fd, MSG_ERROR, NULL, "history needs SERVER_MODE=epoll/io_uring");
+            break;
+
+        case MSG_ROOM_LIST:
+            if (has_joined) {
+                char *list = membership_room_list();
+                if (list) reply(client_socket_fd, MSG_ROOM_LIST_REPLY, NULL, list);
+                pool_scratch_reset();
             }
             break;
 
@@ -156,27 +246,9 @@ void *talk_to_client(void *arg) {
             if (has_joined) {
                 debug("LEAVE/SHUTDOWN from %s\n", joined_client_name ? joined_client_name : "(unknown)");
 
-                int   *notify_sockets = NULL;
-                size_t notify_count = 0, notify_cap = 0;
-
-                pthread_mutex_lock(&g_clients_mx);
-                for (chat_node_list_t *it = g_clients; it; it = it->next) {
-                    if (it->node.sock == client_socket_fd) continue; /* do not notify the leaver */
-                    if (notify_count == notify_cap) {
-                        notify_cap = notify_cap ? notify_cap * 2 : 8;
-                        notify_sockets = realloc(notify_sockets, notify_cap * sizeof(int));
-                    }
-                    notify_sockets[notify_count++] = it->node.sock;
-                }
-                cn_remove_by_sock(&g_clients, client_socket_fd);
-                pthread_mutex_unlock(&g_clients_mx);
-
-                for (size_t i = 0; i < notify_count; i++) {
-                    send_left(notify_sockets[i], joined_client_name);
-                }
-                free(notify_sockets);
-
+                leave_and_notify(client_socket_fd, joined_client_name);
                 has_joined = 0;
+                socket_closed = 1;
             }
             /* Free the just-received message buffers before exiting the thread. */
             msg_free(incoming_name, incoming_text);
@@ -191,11 +263,12 @@ void *talk_to_client(void *arg) {
              */
             if (has_joined) {
                 g_shutdown_all = 1;
-                pthread_mutex_lock(&g_clients_mx);
-                for (chat_node_list_t *it = g_clients; it; it = it->next) {
-                    send_bye(it->node.sock);
-                }
-                pthread_mutex_unlock(&g_clients_mx);
+
+                int   *bye_sockets = NULL;
+                size_t bye_count = 0;
+                membership_snapshot(-1, &bye_sockets, &bye_count);
+                broadcast(bye_sockets, bye_count, MSG_BYE, NULL, "Server shutting down");
+                pool_scratch_reset();
             }
             msg_free(incoming_name, incoming_text);
             goto cleanup_and_exit;
@@ -210,8 +283,18 @@ void *talk_to_client(void *arg) {
     }
 
 cleanup_and_exit:
-    /* Free per-thread resources and close the socket. */
+    /*
+     * A client that disconnected without LEAVE is still in g_clients; treat it as
+     * having left so nobody keeps sending to a dead (or reused) descriptor.
+     */
+    if (has_joined) {
+        leave_and_notify(client_socket_fd, joined_client_name);
+        socket_closed = 1;
+    }
+
+    /* Free per-thread resources and close the socket (unless leaving already did). */
     if (joined_client_name) free(joined_client_name);
-    close(client_socket_fd);
+    msg_reader_free(&reader);
+    if (!socket_closed) close(client_socket_fd);
     return NULL;
 }
@@ -1,9 +1,12 @@
-#define DBG
-#include "dbg.h"
+#include "../shared/slog.h"
 #include "properties.h"
 #include "main.h"
 #include "../shared/message.h"
+#include "../shared/pool.h"
+#include "../shared/trace.h"
 #include "client_handler.h"
+#include "metrics.h"
+#include "reactor.h"
 
 #include <signal.h>
 #include <stdio.h>
@@ -11,18 +14,19 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <errno.h>
 
 /*
     GLOBAL SERVER STATE
     -------------------
-    g_clients        : Linked list holding all currently connected chat participants.
+    g_clients        : Registry of all currently connected chat participants.
     g_clients_mx     : Mutex protecting concurrent access to g_clients.
     g_shutdown_all   : Set to 1 when a client requests "SHUTDOWN ALL". Causes server to exit.
     g_stop           : Local stop flag set when Ctrl-C is pressed. Causes server to exit.
 */
-chat_node_list_t *g_clients = NULL;
+chat_registry_t   g_clients;
 pthread_mutex_t   g_clients_mx = PTHREAD_MUTEX_INITIALIZER;
 volatile int      g_shutdown_all = 0;
 static volatile int g_stop = 0;
@@ -55,17 +59,22 @@ static void install_sigint_handler(void) {
 }
 
 /*
-    create_listen(port)
-    -------------------
+    create_listening_socket(port, reuse_port)
+    -----------------------------------------
     Creates a TCP socket, binds it to the requested port, and puts it into listening mode.
+    With reuse_port, several sockets (one per reactor) can bind the same port and the
+    kernel load-balances incoming connections across them.
 */
-static int create_listening_socket(uint16_t listening_port) {
+int create_listening_socket(uint16_t listening_port, int reuse_port) {
     int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
     probe(listen_socket >= 0, "socket creation failed");
 
     // Allow fast restart if server was just stopped
     int enable_reuse = 1;
     setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable_reuse, sizeof(enable_reuse));
+    if (reuse_port)
+        probe(setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &enable_reuse, sizeof(enable_reuse)) == 0,
+              "SO_REUSEPORT failed");
 
     struct sockaddr_in server_addr = {0};
     server_addr.sin_family = AF_INET;
@@ -73,7 +82,7 @@ static int create_listening_socket(uint16_t listening_port) {
     server_addr.sin_port = htons(listening_port);
 
     probe(bind(listen_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == 0, "bind failed");
-    probe(listen(listen_socket, 64) == 0, "listen failed");
+    probe(listen(listen_socket, SOMAXCONN) == 0, "listen failed");
 
     return listen_socket;
 
@@ -84,11 +93,27 @@ error:
 /*
     main()
     ------
-    Reads server port from properties file (default: server.properties).
+    Reads server port and mode from properties file (default: server.properties).
     Creates listening socket.
-    Loop:
+    SERVER_MODE = threads (default):
         - Accept new clients.
         - Spawn a thread to handle each client independently.
+        - No room history: JOIN replays nothing and HISTORY gets MSG_ERROR
+          (HISTORY_DEPTH and LOG_DIR are reactor features).
+    SERVER_MODE = epoll:
+        - Run REACTOR_THREADS edge-triggered event loops (reactor.c), default one per CPU,
+          optionally pinned with REACTOR_PIN_CPUS = yes.
+    SERVER_MODE = io_uring:
+        - Same reactors, driven by io_uring instead of epoll (falls back to epoll
+          at runtime if the kernel cannot do it).
+    METRICS_SOCKET = path (any mode):
+        - Serve live counters and latency histograms on that unix socket (metrics.h).
+    SERVER_LOG_LEVEL / _FILE / _FORMAT / _RATE / _BUFFER (any mode):
+        - Diagnostics level (debug() lines only at "debug"), destination, text or json,
+          lines per second per call site and lines buffered per thread (slog.h).
+    TRACE_EVENTS = n (any mode, needs a TRACE=1 build):
+        - Keep the last n trace events per thread; SIGUSR2 or "TRACE" on the metrics
+          socket writes them to TRACE_FILE as a Chrome trace (trace.h).
     When shutting down:
         - Notify connected clients with MSG_BYE.
         - Close all sockets.
@@ -99,15 +124,78 @@ int main(int argc, char **argv) {
 
     // Read configuration
     Properties *server_properties = property_read_properties((char*)properties_path);
+
+    // Server log first, so every later line goes through its writer thread
+    char *log_rate_string   = property_get_property(server_properties, "SERVER_LOG_RATE");
+    char *log_buffer_string = property_get_property(server_properties, "SERVER_LOG_BUFFER");
+    slog_cfg_t slog_cfg = {
+        .level   = property_get_property(server_properties, "SERVER_LOG_LEVEL"),
+        .file    = property_get_property(server_properties, "SERVER_LOG_FILE"),
+        .format  = property_get_property(server_properties, "SERVER_LOG_FORMAT"),
+        .rate    = log_rate_string ? (unsigned)strtoul(log_rate_string, NULL, 10) : 0,
+        .records = log_buffer_string ? (unsigned)strtoul(log_buffer_string, NULL, 10) : 0
+    };
+    slog_start(&slog_cfg);
+
     char *port_string = property_get_property(server_properties, "SERVER_PORT");
     uint16_t listening_port = (uint16_t)(port_string ? atoi(port_string) : 7777);
+    char *mode_string = property_get_property(server_properties, "SERVER_MODE");
+    int use_uring = (mode_string && strcmp(mode_string, "io_uring") == 0);
+    int use_epoll = use_uring || (mode_string && strcmp(mode_string, "epoll") == 0);
+
+    // Reactor tuning (epoll / io_uring modes only)
+    char *threads_string = property_get_property(server_properties, "REACTOR_THREADS");
+    char *pin_string     = property_get_property(server_properties, "REACTOR_PIN_CPUS");
+    char *hwm_string     = property_get_property(server_properties, "OUTQ_HIGH_WATER");
+    char *policy_string  = property_get_property(server_properties, "OUTQ_POLICY");
+    char *zc_string      = property_get_property(server_properties, "ZEROCOPY_THRESHOLD");
+    char *window_string  = property_get_property(server_properties, "FLUSH_WINDOW_US");
+    char *flush_string   = property_get_property(server_properties, "FLUSH_BYTES");
+    char *deflate_string = property_get_property(server_properties, "COMPRESS_THRESHOLD");
+    char *depth_string   = property_get_property(server_properties, "HISTORY_DEPTH");
+    char *history_string = property_get_property(server_properties, "HISTORY_BYTES");
+    char *log_string     = property_get_property(server_properties, "LOG_DIR");
+    char *segment_string = property_get_property(server_properties, "LOG_SEGMENT_BYTES");
+    reactor_cfg_t reactor_cfg = {
+        .threads         = threads_string ? atoi(threads_string) : 0,
+        .pin_cpus        = pin_string && strcmp(pin_string, "yes") == 0,
+        .outq_high_water = hwm_string ? strtoul(hwm_string, NULL, 10) : (1u << 20),
+        .outq_policy     = outq_policy_from_string(policy_string),
+        .backend         = use_uring ? REACTOR_IO_URING : REACTOR_EPOLL,
+        .zerocopy_threshold = zc_string ? strtoul(zc_string, NULL, 10) : 0,
+        .flush_window_us = window_string ? (unsigned)strtoul(window_string, NULL, 10) : 0,
+        .flush_bytes     = flush_string ? strtoul(flush_string, NULL, 10) : (64u << 10),
+        .compress_threshold = deflate_string ? strtoul(deflate_string, NULL, 10) : 0,
+        .history_depth   = depth_string ? strtoul(depth_string, NULL, 10) : 0,
+        .history_bytes   = history_string ? strtoul(history_string, NULL, 10) : (256u << 10),
+        .log_dir         = log_string,
+        .log_segment_bytes = segment_string ? strtoul(segment_string, NULL, 10) : (64u << 20)
+    };
 
     // Enable Ctrl-C exit
     install_sigint_handler();
 
-    // Create server listening socket
-    int listening_socket = create_listening_socket(listening_port);
-    log_info("[server] listening on port %u", (unsigned)listening_port);
+    // Tracing and the metrics admin socket (all modes), started before any worker thread
+    char *trace_events_string = property_get_property(server_properties, "TRACE_EVENTS");
+    trace_start(property_get_property(server_properties, "TRACE_FILE"),
+                trace_events_string ? (unsigned)strtoul(trace_events_string, NULL, 10) : 0);
+    TRACE_THREAD_NAME("main");
+    metrics_start(property_get_property(server_properties, "METRICS_SOCKET"));
+
+    // Epoll mode: every reactor creates its own SO_REUSEPORT listener
+    int listening_socket = -1;
+    if (use_epoll) {
+        log_info("[server] listening on port %u (%s mode)", (unsigned)listening_port,
+                 use_uring ? "io_uring" : "epoll");
+        reactor_run(listening_port, &reactor_cfg, &g_stop);
+    } else {
+        listening_socket = create_listening_socket(listening_port, 0);
+        log_info("[server] listening on port %u (threads mode)", (unsigned)listening_port);
+        if (depth_string || log_string) {
+            errno = 0;
+            log_warn("[server] HISTORY_DEPTH / LOG_DIR need SERVER_MODE=epoll or io_uring, ignoring them");
+        }
+    }
 
     /*
         ACCEPT LOOP
@@ -116,7 +204,7 @@ int main(int argc, char **argv) {
         - Ctrl-C occurs   → g_stop = 1
         - Client triggers SHUTDOWN ALL → g_shutdown_all = 1
     */
-    while (!g_stop && !g_shutdown_all) {
+    while (!use_epoll && !g_stop && !g_shutdown_all) {
         struct sockaddr_in client_addr;
         socklen_t client_addr_len = sizeof(client_addr);
 
@@ -132,10 +220,16 @@ int main(int argc, char **argv) {
             break;
         }
 
+        // Frames leave in one write each, so Nagle would only add latency
+        TRACE_BEGIN(accept_span);
+        int nodelay = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
         // Spawn a dedicated handler per client
         pthread_t client_thread;
         pthread_create(&client_thread, NULL, talk_to_client, (void*)(intptr_t)client_socket);
         pthread_detach(client_thread);
+        TRACE_END(accept_span, "accept", 0, TRACE_FLOW_NONE, (uint32_t)client_socket);
     }
 
     /*
@@ -145,14 +239,16 @@ int main(int argc, char **argv) {
         Close all sockets.
     */
     pthread_mutex_lock(&g_clients_mx);
-    for (chat_node_list_t *node = g_clients; node; node = node->next) {
-        msg_send(node->node.sock, MSG_BYE, NULL, "Server exiting");
-        close(node->node.sock);
-    }
+    for (size_t i = 0; i < g_clients.count; i++)
+        msg_send(g_clients.nodes[i].sock, MSG_BYE, NULL, "Server exiting");
+    cn_registry_free(&g_clients);
     pthread_mutex_unlock(&g_clients_mx);
 
-    close(listening_socket);
-    cn_list_free(g_clients);
+    if (listening_socket >= 0) close(listening_socket);
+    metrics_stop();
+    trace_stop();
+    pool_log_stats();
+    slog_stop();
 
     return 0;
 }
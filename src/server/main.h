@@ -1,7 +1,10 @@
 #pragma once
 #include <pthread.h>
+#include <stdint.h>
 #include "../shared/chat_node.h"
 
-extern chat_node_list_t *g_clients;
+extern chat_registry_t g_clients;
 extern pthread_mutex_t   g_clients_mx;
 extern volatile int      g_shutdown_all;
+
+int create_listening_socket(uint16_t listening_port, int reuse_port);
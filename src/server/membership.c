@@ -0,0 +1,618 @@
+#include "../shared/slog.h"
+#include "membership.h"
+#include "main.h"
+#include "metrics.h"
+#include "../shared/chat_node.h"
+#include "../shared/message.h"
+#include "../shared/pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Published membership views
+ * --------------------------
+ * Writers (JOIN/LEAVE, already serialised by g_clients_mx) build a fresh
+ * immutable membership_view_t after every change and swap it into g_view.
+ * Readers never take the mutex: they announce the epoch they entered in a
+ * per-thread reader record, load g_view, copy what they need and leave again.
+ *
+ * A replaced view is retired with the epoch current at the time of the swap
+ * and freed only once every active reader entered a later epoch, so a reader
+ * can never see its view freed underneath it. Reclamation runs on the writer
+ * path and never waits: views still in use simply stay on the retired list
+ * until a later JOIN/LEAVE finds them free.
+ */
+typedef struct {
+    size_t count;
+    int    socks[];
+} membership_view_t;
+
+typedef struct retired_view {
+    membership_view_t   *view;
+    uint64_t             epoch;
+    struct retired_view *next;
+} retired_view_t;
+
+typedef struct reader_rec {
+    _Atomic uint64_t   epoch;           /* 0 while outside a read section */
+    _Atomic int        in_use;          /* owned by a live thread */
+    struct reader_rec *next;            /* push-only list, never freed */
+} reader_rec_t;
+
+static _Atomic(membership_view_t *) g_view;
+static _Atomic uint64_t              g_epoch = 1;
+static _Atomic(reader_rec_t *)       g_readers;
+static retired_view_t               *g_retired;     /* guarded by g_clients_mx */
+
+static pthread_key_t               g_reader_key;
+static pthread_once_t              g_reader_once = PTHREAD_ONCE_INIT;
+static _Thread_local reader_rec_t *t_reader;
+
+/*
+ * Rooms. Each keeps its own dense member index (swap-with-last removal, the
+ * member's slot is remembered in chat_node_t.room_idx) and its own published
+ * view, so a NOTE reads and copies only its room's sockets. Rooms are created
+ * on first use and found through a name-hashed index (linear probing, same
+ * scheme as the participant registry).
+ *
+ * A room closes when its last member leaves (the lobby never does): its
+ * members and view are released, it leaves the index and its id goes on a
+ * free list for the next new room, with a new generation so stale references
+ * to the old one can be told apart. room_t structs themselves are recycled,
+ * never freed, and a member may keep a pointer to its own room without
+ * holding the mutex, since a room cannot close while it has members.
+ */
+struct room {
+    uint32_t id;
+    uint64_t gen;                       /* incarnation of this id, unique server-wide */
+    char     name[ROOM_NAME_MAX + 1];
+    int     *socks;                     /* guarded by g_clients_mx */
+    size_t   count, cap;
+    _Atomic(membership_view_t *) view;
+    uint32_t next_free;                 /* while closed: next free id + 1, 0 = end */
+};
+
+#define ROOM_INDEX_SLOTS (2 * ROOMS_MAX)    /* power of two, at most half full */
+
+/* All guarded by g_clients_mx. */
+static room_t  **g_rooms;               /* indexed by room id */
+static size_t    g_room_count, g_room_cap;  /* ids handed out so far */
+static uint32_t  g_room_index[ROOM_INDEX_SLOTS];    /* open room id + 1 by name, 0 = empty */
+static uint32_t  g_free_rooms;          /* first closed id + 1, 0 = none */
+static uint64_t  g_room_gen;
+static void    (*g_room_closed)(uint32_t id, uint64_t gen);
+
+static void reader_release(void *arg) {
+    reader_rec_t *rec = arg;
+    atomic_store(&rec->epoch, 0);
+    atomic_store(&rec->in_use, 0);
+    t_reader = NULL;
+}
+
+static void make_reader_key(void) {
+    pthread_key_create(&g_reader_key, reader_release);
+}
+
+/*
+ * The calling thread's reader record: a released one is reused, otherwise a
+ * new one is pushed. Records outlive their threads so the list stays lock-free.
+ */
+static reader_rec_t *my_reader(void) {
+    if (t_reader) return t_reader;
+    pthread_once(&g_reader_once, make_reader_key);
+
+    reader_rec_t *rec;
+    for (rec = atomic_load(&g_readers); rec; rec = rec->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&rec->in_use, &unused, 1)) break;
+    }
+    if (!rec) {
+        rec = calloc(1, sizeof(*rec));
+        if (!rec) return NULL;
+        atomic_store(&rec->in_use, 1);
+        rec->next = atomic_load(&g_readers);
+        while (!atomic_compare_exchange_weak(&g_readers, &rec->next, rec))
+            ;
+    }
+    pthread_setspecific(g_reader_key, rec);
+    return t_reader = rec;
+}
+
+/*
+ * Frees every retired view no reader can still hold. Caller must hold
+ * g_clients_mx.
+ */
+static void reclaim_locked(void) {
+    uint64_t oldest = UINT64_MAX;
+    for (reader_rec_t *rec = atomic_load(&g_readers); rec; rec = rec->next) {
+        uint64_t e = atomic_load(&rec->epoch);
+        if (e && e < oldest) oldest = e;
+    }
+
+    for (retired_view_t **it = &g_retired; *it; ) {
+        retired_view_t *r = *it;
+        if (r->epoch < oldest) {
+            *it = r->next;
+            free(r->view);
+            free(r);
+        } else {
+            it = &r->next;
+        }
+    }
+}
+
+/*
+ * Swaps `view` into `slot` and retires the previous one. Caller must hold
+ * g_clients_mx. A NULL `view` (allocation failure) unpublishes the slot so
+ * readers fall back to the locked path; the stale view is leaked rather than
+ * freed under a reader that may still hold it.
+ */
+static void publish_locked(_Atomic(membership_view_t *) *slot, membership_view_t *view) {
+    retired_view_t *retired = view ? malloc(sizeof(*retired)) : NULL;
+    if (!retired) {
+        free(view);
+        if (atomic_exchange(slot, NULL)) log_err("membership: could not publish a view");
+        return;
+    }
+
+    membership_view_t *old = atomic_exchange(slot, view);
+    if (old) {
+        retired->view  = old;
+        retired->epoch = atomic_fetch_add(&g_epoch, 1);
+        retired->next  = g_retired;
+        g_retired      = retired;
+    } else {
+        free(retired);
+    }
+    reclaim_locked();
+}
+
+static void publish_members_locked(void) {
+    size_t count = g_clients.count;
+    membership_view_t *view = malloc(sizeof(*view) + count * sizeof(int));
+    if (view) {
+        view->count = count;
+        for (size_t i = 0; i < count; i++) view->socks[i] = g_clients.nodes[i].sock;
+    }
+    publish_locked(&g_view, view);
+}
+
+static void publish_room_locked(room_t *room) {
+    membership_view_t *view = malloc(sizeof(*view) + room->count * sizeof(int));
+    if (view) {
+        view->count = room->count;
+        memcpy(view->socks, room->socks, room->count * sizeof(int));
+    }
+    publish_locked(&room->view, view);
+}
+
+/*
+ * Copies `socks` minus `exclude_sock` into the calling thread's scratch arena.
+ */
+static void copy_socks(const int *src, size_t n, int exclude_sock,
+                       int **socks_out, size_t *count_out) {
+    int   *socks = pool_scratch_alloc((n ? n : 1) * sizeof(int));
+    size_t count = 0;
+
+    for (size_t i = 0; i < n && socks; i++)
+        if (src[i] != exclude_sock) socks[count++] = src[i];
+
+    *socks_out = socks;
+    *count_out = count;
+}
+
+/*
+ * Lock-free read of a published view. Returns -1 (and copies nothing) if the
+ * slot is empty or this thread has no reader record, so the caller takes the
+ * mutex instead.
+ */
+static int read_view(_Atomic(membership_view_t *) *slot, int exclude_sock,
+                     int **socks_out, size_t *count_out) {
+    reader_rec_t *rec = my_reader();
+    if (!rec) return -1;
+
+    /* Announce our epoch before loading the view (both seq_cst). */
+    atomic_store(&rec->epoch, atomic_load(&g_epoch));
+    membership_view_t *view = atomic_load(slot);
+    if (view) copy_socks(view->socks, view->count, exclude_sock, socks_out, count_out);
+    atomic_store(&rec->epoch, 0);
+    return view ? 0 : -1;
+}
+
+/*
+ * snapshot_locked
+ * ---------------
+ * Copies every socket in g_clients except `exclude_sock` into the calling
+ * thread's scratch arena. Caller must hold g_clients_mx.
+ */
+static void snapshot_locked(int exclude_sock, int **socks_out, size_t *count_out) {
+    size_t members = g_clients.count;
+    int   *socks = pool_scratch_alloc((members ? members : 1) * sizeof(int));
+    size_t count = 0;
+
+    for (size_t i = 0; i < members && socks; i++) {
+        int sock = g_clients.nodes[i].sock;
+        if (sock != exclude_sock) socks[count++] = sock;
+    }
+
+    *socks_out = socks;
+    *count_out = count;
+}
+
+static int room_name_valid(const char *name) {
+    size_t len = 0;
+    for (; name[len]; len++) {
+        char ch = name[len];
+        int ok = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+                 (ch >= '0' && ch <= '9') || ch == '-' || ch == '_';
+        if (!ok || len >= ROOM_NAME_MAX) return 0;
+    }
+    return len > 0;
+}
+
+static size_t room_home(const char *name) {
+    uint64_t h = 1469598103934665603ULL;           /* FNV-1a */
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h & (ROOM_INDEX_SLOTS - 1);
+}
+
+/* The open room called `name`, or NULL. Caller must hold g_clients_mx. */
+static room_t *room_find_locked(const char *name) {
+    for (size_t i = room_home(name); g_room_index[i]; i = (i + 1) & (ROOM_INDEX_SLOTS - 1)) {
+        room_t *room = g_rooms[g_room_index[i] - 1];
+        if (strcmp(room->name, name) == 0) return room;
+    }
+    return NULL;
+}
+
+static void room_index_insert(const room_t *room) {
+    size_t i = room_home(room->name);
+    while (g_room_index[i]) i = (i + 1) & (ROOM_INDEX_SLOTS - 1);
+    g_room_index[i] = room->id + 1;
+}
+
+/* Backward-shift deletion, as in chat_node.c. */
+static void room_index_delete(const room_t *room) {
+    size_t mask = ROOM_INDEX_SLOTS - 1;
+    size_t hole = room_home(room->name);
+    while (g_room_index[hole] != room->id + 1) hole = (hole + 1) & mask;
+
+    g_room_index[hole] = 0;
+    for (size_t j = (hole + 1) & mask; g_room_index[j]; j = (j + 1) & mask) {
+        size_t home = room_home(g_rooms[g_room_index[j] - 1]->name);
+        int stays = (hole <= j) ? (home > hole && home <= j)
+                                : (home > hole || home <= j);
+        if (stays) continue;
+        g_room_index[hole] = g_room_index[j];
+        g_room_index[j]    = 0;
+        hole               = j;
+    }
+}
+
+/*
+ * Finds or creates a room, reusing a closed room's id if there is one.
+ * Caller must hold g_clients_mx.
+ * Returns NULL if ROOMS_MAX rooms are open or allocation fails.
+ */
+static room_t *room_get_locked(const char *name) {
+    room_t *room = room_find_locked(name);
+    if (room) return room;
+
+    if (g_free_rooms) {
+        room = g_rooms[g_free_rooms - 1];
+        g_free_rooms = room->next_free;
+    } else {
+        if (g_room_count == ROOMS_MAX) return NULL;
+        if (g_room_count == g_room_cap) {
+            size_t new_cap = g_room_cap ? g_room_cap * 2 : 16;
+            room_t **grown = realloc(g_rooms, new_cap * sizeof(*grown));
+            if (!grown) return NULL;
+            g_rooms    = grown;
+            g_room_cap = new_cap;
+        }
+        room = calloc(1, sizeof(*room));
+        if (!room) return NULL;
+        room->id = (uint32_t)g_room_count;
+        g_rooms[g_room_count++] = room;
+    }
+
+    room->gen = ++g_room_gen;
+    snprintf(room->name, sizeof(room->name), "%s", name);
+    room_index_insert(room);
+    return room;
+}
+
+/*
+ * Closes `room` if nobody is left in it (and it is not the lobby): releases
+ * its members and view, recycles its id and tells the hook. Caller must hold
+ * g_clients_mx.
+ * Returns 1 if the room was closed.
+ */
+static int room_close_if_empty_locked(room_t *room) {
+    if (room->count || strcmp(room->name, ROOM_LOBBY) == 0) return 0;
+
+    room_index_delete(room);
+    free(room->socks);
+    room->socks = NULL;
+    room->cap   = 0;
+
+    /* Nobody can be reading the view of an empty room, but retire it like any other. */
+    membership_view_t *old = atomic_exchange(&room->view, NULL);
+    retired_view_t *retired = old ? malloc(sizeof(*retired)) : NULL;
+    if (retired) {
+        retired->view  = old;
+        retired->epoch = atomic_fetch_add(&g_epoch, 1);
+        retired->next  = g_retired;
+        g_retired      = retired;
+        reclaim_locked();
+    }
+
+    room->next_free = g_free_rooms;
+    g_free_rooms    = room->id + 1;
+    if (g_room_closed) g_room_closed(room->id, room->gen);
+    return 1;
+}
+
+/* Makes room for one more member. Caller must hold g_clients_mx. */
+static int room_reserve_locked(room_t *room) {
+    if (room->count < room->cap) return 0;
+    size_t new_cap = room->cap ? room->cap * 2 : 8;
+    int *grown = realloc(room->socks, new_cap * sizeof(*grown));
+    if (!grown) return -1;
+    room->socks = grown;
+    room->cap   = new_cap;
+    return 0;
+}
+
+static int room_add_locked(room_t *room, chat_node_t *member) {
+    if (room_reserve_locked(room) < 0) return -1;
+    member->room     = room->id;
+    member->room_idx = room->count;
+    room->socks[room->count++] = member->sock;
+    publish_room_locked(room);
+    return 0;
+}
+
+/*
+ * Takes `member` out of its room, closing the room if it was the last one.
+ * Caller must hold g_clients_mx.
+ */
+static void room_remove_locked(chat_node_t *member) {
+    room_t *room = g_rooms[member->room];
+    int     last = room->socks[--room->count];
+
+    if (last != member->sock) {
+        room->socks[member->room_idx] = last;
+        cn_find_by_sock(&g_clients, last)->room_idx = member->room_idx;
+    }
+    if (!room_close_if_empty_locked(room)) publish_room_locked(room);
+}
+
+/*
+ * membership_join
+ * ---------------
+ * Registers `sock` under `name` if the name is not already taken, and puts it
+ * in the ROOM_LOBBY room. `shard` is the owning reactor's id (-1 in thread
+ * mode), handed back by membership_find().
+ * On success, *others_out receives every other member's socket (to notify with
+ * MSG_JOINING). Pass NULL for others_out when no snapshot is needed.
+ * Returns:
+ *   0 on success
+ *  -1 if the name is already in use (or the registry could not grow)
+ */
+int membership_join(int sock, int shard, const char *name, int **others_out, size_t *count_out) {
+    if (others_out) { *others_out = NULL; *count_out = 0; }
+
+    metrics_lock(&g_clients_mx);
+    room_t *lobby = room_get_locked(ROOM_LOBBY);
+    if (!lobby || room_reserve_locked(lobby) < 0 || cn_find_by_name(&g_clients, name)) {
+        metrics_unlock(&g_clients_mx);
+        return -1;
+    }
+
+    chat_node_t new_member = (chat_node_t){0};
+    snprintf(new_member.name, sizeof(new_member.name), "%s", name);
+    new_member.sock = sock;
+    new_member.shard = shard;
+    if (cn_add(&g_clients, &new_member) < 0) {
+        metrics_unlock(&g_clients_mx);
+        return -1;
+    }
+    room_add_locked(lobby, cn_find_by_sock(&g_clients, sock));     /* reserved above */
+    publish_members_locked();
+
+    if (others_out) snapshot_locked(sock, others_out, count_out);
+    metrics_unlock(&g_clients_mx);
+    return 0;
+}
+
+/*
+ * membership_leave
+ * ----------------
+ * Removes `sock` from g_clients (and its room) and returns the remaining
+ * members (to notify with MSG_LEFT), or nothing if others_out is NULL.
+ * cn_remove_by_sock() closes the socket, so callers must not close it again
+ * afterwards.
+ */
+void membership_leave(int sock, int **others_out, size_t *count_out) {
+    metrics_lock(&g_clients_mx);
+    if (others_out) snapshot_locked(sock, others_out, count_out);
+    chat_node_t *member = cn_find_by_sock(&g_clients, sock);
+    if (member) {
+        room_remove_locked(member);
+        cn_remove_by_sock(&g_clients, sock);
+        publish_members_locked();
+    }
+    metrics_unlock(&g_clients_mx);
+}
+
+/*
+ * membership_snapshot
+ * -------------------
+ * Returns every member's socket except `exclude_sock` (pass -1 for everyone).
+ * Reads the published view without taking g_clients_mx; the mutex is only
+ * used before the first JOIN or if publishing a view failed.
+ */
+void membership_snapshot(int exclude_sock, int **socks_out, size_t *count_out) {
+    if (read_view(&g_view, exclude_sock, socks_out, count_out) == 0) return;
+
+    metrics_lock(&g_clients_mx);
+    snapshot_locked(exclude_sock, socks_out, count_out);
+    metrics_unlock(&g_clients_mx);
+}
+
+/*
+ * membership_find
+ * ---------------
+ * Looks a member up by name (one hash probe under g_clients_mx), for direct
+ * messages.
+ * Returns:
+ *   0 and the member's socket and shard on success
+ *  -1 if nobody by that name is connected
+ */
+int membership_find(const char *name, int *sock_out, int *shard_out) {
+    metrics_lock(&g_clients_mx);
+    chat_node_t *member = name ? cn_find_by_name(&g_clients, name) : NULL;
+    if (member) {
+        *sock_out  = member->sock;
+        *shard_out = member->shard;
+    }
+    metrics_unlock(&g_clients_mx);
+    return member ? 0 : -1;
+}
+
+/*
+ * membership_send_direct
+ * ----------------------
+ * Sends `frame` to the member called `name` (thread-per-client mode). The
+ * send happens under g_clients_mx: LEAVE closes the member's socket under the
+ * same lock, so the fd cannot be closed and handed to a new connection
+ * between the lookup and the send.
+ * Returns:
+ *   0 if the frame was sent
+ *  -1 if nobody by that name is connected
+ *  -2 if the send failed
+ */
+int membership_send_direct(const char *name, const msg_frame_t *frame) {
+    metrics_lock(&g_clients_mx);
+    chat_node_t *member = name ? cn_find_by_name(&g_clients, name) : NULL;
+    int rc = !member ? -1 : msg_frame_send(member->sock, frame) == 0 ? 0 : -2;
+    metrics_unlock(&g_clients_mx);
+    return rc;
+}
+
+/*
+ * membership_lobby
+ * ----------------
+ * Returns ROOM_LOBBY, where JOIN puts every member. It never closes.
+ * Returns NULL only if it could not be created.
+ */
+room_t *membership_lobby(void) {
+    metrics_lock(&g_clients_mx);
+    room_t *room = room_get_locked(ROOM_LOBBY);
+    metrics_unlock(&g_clients_mx);
+    return room;
+}
+
+const char *membership_room_name(const room_t *room) { return room->name; }
+uint32_t    membership_room_id(const room_t *room)   { return room->id; }
+uint64_t    membership_room_gen(const room_t *room)  { return room->gen; }
+
+/*
+ * membership_on_room_closed
+ * -------------------------
+ * Installs a function called (under g_clients_mx) with the id and generation
+ * of every room that closes, so per-room state kept elsewhere can go too.
+ * Set once, before any client joins.
+ */
+void membership_on_room_closed(void (*hook)(uint32_t id, uint64_t gen)) {
+    g_room_closed = hook;
+}
+
+/*
+ * membership_room_move
+ * --------------------
+ * Moves member `sock` into the room called `name`, creating it on first use;
+ * the room it leaves closes if that was its last member. On success *to_out
+ * is the new room and, if left_out is not NULL, *left_out receives the
+ * sockets still in the old one (snapshotted under the lock, since the old
+ * room may close as soon as it is released).
+ * Returns:
+ *   0 on success
+ *   1 if it already was in that room
+ *  -1 if `sock` is not a member (or allocation failed; it stays put)
+ *  -2 for an invalid name (1..ROOM_NAME_MAX of [A-Za-z0-9_-]) or when
+ *     ROOMS_MAX rooms are open
+ */
+int membership_room_move(int sock, const char *name, room_t **to_out,
+                         int **left_out, size_t *left_count) {
+    if (!name || !room_name_valid(name)) return -2;
+    int rc = -1;
+
+    metrics_lock(&g_clients_mx);
+    chat_node_t *member = cn_find_by_sock(&g_clients, sock);
+    room_t      *to     = member ? room_get_locked(name) : NULL;
+    if (member && !to) {
+        rc = -2;
+    } else if (member && member->room == to->id) {
+        rc = 1;
+    } else if (member && room_reserve_locked(to) == 0) {
+        /* Reserved first, so a failed allocation leaves the member where it was. */
+        room_t *from = g_rooms[member->room];
+        room_remove_locked(member);
+        rc = room_add_locked(to, member);
+        *to_out = to;
+        if (left_out) copy_socks(from->socks, from->count, -1, left_out, left_count);
+    } else if (to) {
+        room_close_if_empty_locked(to);             /* created for nothing */
+    }
+    metrics_unlock(&g_clients_mx);
+    return rc;
+}
+
+/*
+ * membership_room_snapshot
+ * ------------------------
+ * Same as membership_snapshot(), restricted to the members of `room`.
+ */
+void membership_room_snapshot(room_t *room, int exclude_sock, int **socks_out, size_t *count_out) {
+    if (read_view(&room->view, exclude_sock, socks_out, count_out) == 0) return;
+
+    metrics_lock(&g_clients_mx);
+    copy_socks(room->socks, room->count, exclude_sock, socks_out, count_out);
+    metrics_unlock(&g_clients_mx);
+}
+
+/*
+ * membership_room_list
+ * --------------------
+ * Describes every non-empty room as "name (members), ..." in the calling
+ * thread's scratch arena.
+ */
+char *membership_room_list(void) {
+    metrics_lock(&g_clients_mx);
+    size_t cap = 1;
+    for (size_t i = 0; i < g_room_count; i++)
+        if (g_rooms[i]->count) cap += ROOM_NAME_MAX + 32;
+
+    char  *list = pool_scratch_alloc(cap);
+    size_t len  = 0;
+    if (list) {
+        list[0] = '\0';
+        for (size_t i = 0; i < g_room_count; i++) {
+            if (!g_rooms[i]->count) continue;
+            len += (size_t)snprintf(list + len, cap - len, "%s%s (%zu)",
+                                    len ? ", " : "", g_rooms[i]->name, g_rooms[i]->count);
+        }
+    }
+    metrics_unlock(&g_clients_mx);
+    return list;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "../shared/message.h"
+
+#define ROOM_LOBBY    "lobby"   /* every member starts here */
+#define ROOM_NAME_MAX 31
+#define ROOMS_MAX     4096      /* open at once; a power of two */
+
+typedef struct room room_t;
+
+/*
+ * Membership helpers shared by both server modes (thread-per-client and epoll).
+ * JOIN/LEAVE modify g_clients under g_clients_mx and publish an immutable view
+ * of it; membership_snapshot() reads that view without locking. All of them
+ * hand back a snapshot of sockets so the caller can do its network I/O freely.
+ * Snapshots live in the calling thread's scratch arena and are released with
+ * pool_scratch_reset() once the message has been handled.
+ */
+int  membership_join(int sock, int shard, const char *name, int **others_out, size_t *count_out);
+void membership_leave(int sock, int **others_out, size_t *count_out);
+void membership_snapshot(int exclude_sock, int **socks_out, size_t *count_out);
+int  membership_find(const char *name, int *sock_out, int *shard_out);
+int  membership_send_direct(const char *name, const msg_frame_t *frame);
+
+/*
+ * Rooms: a NOTE only goes to the sender's room. Every member is in exactly one
+ * room (ROOM_LOBBY after JOIN); room snapshots are lock-free like the global one.
+ * A room closes when its last member leaves and its id is reused by a later
+ * room with a new generation (membership_room_gen()).
+ */
+room_t     *membership_lobby(void);
+const char *membership_room_name(const room_t *room);
+uint32_t    membership_room_id(const room_t *room);
+uint64_t    membership_room_gen(const room_t *room);
+void        membership_on_room_closed(void (*hook)(uint32_t id, uint64_t gen));
+int         membership_room_move(int sock, const char *name, room_t **to_out,
+                                 int **left_out, size_t *left_count);
+void        membership_room_snapshot(room_t *room, int exclude_sock, int **socks_out, size_t *count_out);
+char       *membership_room_list(void);
@@ -0,0 +1,335 @@
+#include "../shared/slog.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define METRICS_POLL_MS    250      /* how often the admin thread checks for stop */
+#define METRICS_REQUEST_MS 100      /* how long a scraper may take to send its request */
+
+int g_metrics_on;
+_Thread_local metrics_thread_t *t_metrics;
+
+/*
+ * Every block ever handed out stays on g_blocks for the life of the process,
+ * so the admin thread can walk it without coordinating with the writers.
+ * A thread's block is parked when the thread exits (thread mode has one per
+ * client) and reused by the next thread that attaches; its counts keep
+ * accumulating, which is what the exported totals need.
+ */
+static pthread_mutex_t   g_blocks_mx = PTHREAD_MUTEX_INITIALIZER;
+static metrics_thread_t *g_blocks;
+static metrics_thread_t *g_parked[1024];
+static size_t            g_parked_count;
+static size_t            g_block_count;
+static metrics_thread_t  g_spare;           /* shared fallback if allocation fails */
+
+static pthread_key_t     g_key;
+static pthread_once_t    g_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t         g_admin;
+static int               g_admin_fd = -1;
+static volatile int      g_admin_stop;
+static char              g_admin_path[108];
+static uint64_t          g_started_ns;
+
+static const char *const g_type_names[METRICS_TYPES] = {
+    [MSG_JOIN] = "join", [MSG_LEAVE] = "leave", [MSG_NOTE] = "note",
+    [MSG_SHUTDOWN] = "shutdown", [MSG_SHUTDOWN_ALL] = "shutdown_all",
+    [MSG_ROOM_JOIN] = "room_join", [MSG_ROOM_LEAVE] = "room_leave",
+    [MSG_ROOM_LIST] = "room_list", [MSG_DIRECT] = "direct",
+    [MSG_JOINING] = "joining", [MSG_LEFT] = "left", [MSG_DELIVER] = "deliver",
+    [MSG_BYE] = "bye", [MSG_ROOM_ENTERED] = "room_entered", [MSG_ROOM_EXITED] = "room_exited",
+    [MSG_ROOM_LIST_REPLY] = "room_list_reply", [MSG_DIRECT_DELIVER] = "direct_deliver",
+    [MSG_ERROR] = "error", [MSG_PROTO_ACK] = "proto_ack", [MSG_SENDER_ID] = "sender_id",
+    [MSG_HISTORY] = "history", [MSG_HISTORY_ENTRY] = "history_entry",
+};
+
+static void park_block(void *block) {
+    pthread_mutex_lock(&g_blocks_mx);
+    if (block != &g_spare && g_parked_count < sizeof(g_parked) / sizeof(*g_parked))
+        g_parked[g_parked_count++] = block;
+    pthread_mutex_unlock(&g_blocks_mx);
+}
+
+static void make_key(void) {
+    pthread_key_create(&g_key, park_block);
+}
+
+/*
+ * metrics_attach
+ * --------------
+ * Slow path of metrics_self(): gives the calling thread a block, reusing a
+ * parked one when there is any.
+ */
+metrics_thread_t *metrics_attach(void) {
+    pthread_once(&g_key_once, make_key);
+
+    pthread_mutex_lock(&g_blocks_mx);
+    metrics_thread_t *m = g_parked_count ? g_parked[--g_parked_count] : NULL;
+    if (!m) {
+        m = calloc(1, sizeof(*m));
+        if (m) {
+            m->next  = g_blocks;
+            g_blocks = m;
+            g_block_count++;
+        }
+    }
+    pthread_mutex_unlock(&g_blocks_mx);
+
+    if (!m) return &g_spare;
+    m->lock_since = 0;
+    t_metrics = m;
+    pthread_setspecific(g_key, m);
+    return m;
+}
+
+/* ---- exposition ------------------------------------------------------- */
+
+static uint64_t load(const _Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void sum_blocks(metrics_thread_t *total) {
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&g_blocks_mx);
+    metrics_thread_t *head = g_blocks;
+    pthread_mutex_unlock(&g_blocks_mx);
+
+    /* Blocks are only ever prepended, so the list from `head` on is stable. */
+    for (metrics_thread_t *m = head; ; m = m->next) {
+        if (!m) m = &g_spare;
+        for (int t = 0; t < METRICS_TYPES; t++) {
+            metrics_add(&total->msgs_in[t],  load(&m->msgs_in[t]));
+            metrics_add(&total->msgs_out[t], load(&m->msgs_out[t]));
+        }
+        metrics_add(&total->bytes_in,    load(&m->bytes_in));
+        metrics_add(&total->bytes_out,   load(&m->bytes_out));
+        metrics_add(&total->dropped,     load(&m->dropped));
+        metrics_add(&total->slow_closed, load(&m->slow_closed));
+        for (int h = 0; h < METRICS_HISTS; h++) {
+            metrics_add(&total->hist[h].sum, load(&m->hist[h].sum));
+            for (int b = 0; b < METRICS_BUCKETS; b++)
+                metrics_add(&total->hist[h].buckets[b], load(&m->hist[h].buckets[b]));
+        }
+        if (m == &g_spare) break;
+    }
+}
+
+static void put_type_counter(FILE *out, const char *name, const char *help,
+                             const _Atomic uint64_t *counts) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int t = 0; t < METRICS_TYPES; t++) {
+        uint64_t n = load(&counts[t]);
+        if (!n) continue;
+        if (g_type_names[t]) fprintf(out, "%s{type=\"%s\"} %llu\n", name, g_type_names[t], (unsigned long long)n);
+        else                 fprintf(out, "%s{type=\"%d\"} %llu\n", name, t, (unsigned long long)n);
+    }
+}
+
+static void put_counter(FILE *out, const char *name, const char *help, uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+            (unsigned long long)value);
+}
+
+/*
+ * Exports one histogram with bounds just under the powers of two from 2^lo to
+ * 2^hi. 2^k starts a sub-bucket, so the buckets below it hold exactly the
+ * values <= 2^k - 1 (they are integers), and that is the inclusive `le` each
+ * cumulative count is printed with; `scale` converts the recorded unit (1e-9
+ * for ns -> seconds).
+ */
+static void put_hist(FILE *out, const char *name, const char *help, const metrics_hist_t *h,
+                     int lo, int hi, double scale) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t cumulative = 0;
+    unsigned b = 0;
+    for (int k = lo; k <= hi; k++) {
+        unsigned bound = metrics_bucket(1ULL << k);
+        while (b < bound) cumulative += load(&h->buckets[b++]);
+        fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)((1ULL << k) - 1) * scale,
+                (unsigned long long)cumulative);
+    }
+    while (b < METRICS_BUCKETS) cumulative += load(&h->buckets[b++]);
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+    fprintf(out, "%s_sum %.9g\n", name, (double)load(&h->sum) * scale);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long)cumulative);
+}
+
+static char *render(size_t *len_out) {
+    static metrics_thread_t total;      /* admin thread only */
+    char *text = NULL;
+    FILE *out = open_memstream(&text, len_out);
+    if (!out) return NULL;
+
+    sum_blocks(&total);
+    pthread_mutex_lock(&g_blocks_mx);
+    size_t blocks = g_block_count, parked = g_parked_count;
+    pthread_mutex_unlock(&g_blocks_mx);
+
+    fprintf(out, "# HELP chat_uptime_seconds Seconds since metrics collection started.\n"
+                 "# TYPE chat_uptime_seconds gauge\nchat_uptime_seconds %.3f\n",
+            (double)(metrics_clock() - g_started_ns) / 1e9);
+    fprintf(out, "# HELP chat_metrics_threads Threads currently recording metrics.\n"
+                 "# TYPE chat_metrics_threads gauge\nchat_metrics_threads %zu\n", blocks - parked);
+
+    put_type_counter(out, "chat_messages_in_total", "Frames received from clients, by type.", total.msgs_in);
+    put_type_counter(out, "chat_messages_out_total", "Frames queued or sent to clients, by type.", total.msgs_out);
+    put_counter(out, "chat_bytes_in_total", "Bytes received from clients.", load(&total.bytes_in));
+    put_counter(out, "chat_bytes_out_total", "Bytes written to client sockets.", load(&total.bytes_out));
+    put_counter(out, "chat_frames_dropped_total", "Frames discarded by the slow-consumer policy.",
+                load(&total.dropped));
+    put_counter(out, "chat_slow_clients_closed_total", "Clients disconnected for falling behind.",
+                load(&total.slow_closed));
+
+    put_hist(out, "chat_frame_decode_seconds", "Time to parse one buffered client frame.",
+             &total.hist[METRICS_DECODE], 5, 24, 1e-9);
+    put_hist(out, "chat_note_fanout_seconds", "Time to fan one NOTE out to its room.",
+             &total.hist[METRICS_FANOUT], 8, 32, 1e-9);
+    put_hist(out, "chat_clients_lock_wait_seconds", "Time spent waiting for g_clients_mx.",
+             &total.hist[METRICS_LOCK_WAIT], 5, 30, 1e-9);
+    put_hist(out, "chat_clients_lock_hold_seconds", "Time g_clients_mx was held.",
+             &total.hist[METRICS_LOCK_HOLD], 5, 30, 1e-9);
+    put_hist(out, "chat_outq_backlog_bytes", "Bytes still queued to a client after a write.",
+             &total.hist[METRICS_BACKLOG], 6, 30, 1.0);
+
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+/* ---- admin socket ----------------------------------------------------- */
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Answers one scraper: waits briefly for a request line to decide between
+ * plain text and HTTP, then writes a fresh rendering and closes. The request
+ * "TRACE" asks for a trace dump instead (see trace.h), "LOG <level>" changes
+ * the server log level (see slog.h).
+ */
+static void serve_one(int fd) {
+    char request[512];
+    ssize_t got = 0;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, METRICS_REQUEST_MS) > 0) got = recv(fd, request, sizeof(request) - 1, 0);
+    request[got > 0 ? got : 0] = '\0';
+    int http = got >= 4 && memcmp(request, "GET ", 4) == 0;
+
+    if (got >= 5 && memcmp(request, "TRACE", 5) == 0) {
+        static const char reply[] = "trace dump requested\n";
+        trace_dump_request();
+        write_all(fd, reply, sizeof(reply) - 1);
+        return;
+    }
+    if (got >= 4 && memcmp(request, "LOG ", 4) == 0) {
+        char level[16] = "", reply[64];
+        sscanf(request + 4, "%15s", level);
+        if (slog_set_level(level) == 0) log_info("[log] level set to %s", level);
+        int len = snprintf(reply, sizeof(reply), "log level %s\n",
+                           slog_level_name(atomic_load(&g_slog_level)));
+        write_all(fd, reply, (size_t)len);
+        return;
+    }
+
+    size_t len = 0;
+    char *text = render(&len);
+    if (!text) return;
+    if (http) {
+        char header[128];
+        int n = snprintf(header, sizeof(header),
+                         "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\n\r\n", len);
+        if (write_all(fd, header, (size_t)n) != 0) {
+            free(text);
+            return;
+        }
+    }
+    write_all(fd, text, len);
+    free(text);
+}
+
+static void *admin_loop(void *unused) {
+    (void)unused;
+    while (!g_admin_stop) {
+        struct pollfd pfd = { .fd = g_admin_fd, .events = POLLIN };
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0) continue;
+
+        int fd = accept(g_admin_fd, NULL, NULL);
+        if (fd < 0) continue;
+        serve_one(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * metrics_start
+ * -------------
+ * Turns recording on and serves the metrics on a unix socket at
+ * `socket_path` (replacing a stale one). NULL or "" leaves metrics off.
+ * Must run before any server thread starts. Returns 0, or -1 with metrics off.
+ */
+int metrics_start(const char *socket_path) {
+    if (!socket_path || !*socket_path) return 0;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        log_err("METRICS_SOCKET path too long: %s", socket_path);
+        return -1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    snprintf(g_admin_path, sizeof(g_admin_path), "%s", socket_path);
+
+    g_admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    probe(g_admin_fd >= 0, "metrics socket failed");
+    unlink(socket_path);
+    probe(bind(g_admin_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "metrics bind %s failed", socket_path);
+    probe(listen(g_admin_fd, 16) == 0, "metrics listen failed");
+
+    g_started_ns = metrics_clock();
+    g_metrics_on = 1;
+    g_admin_stop = 0;
+    /* Signals stay with the accept loop / reactor 0. */
+    sigset_t block, previous;
+    sigfillset(&block);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+    int rc = pthread_create(&g_admin, NULL, admin_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    probe(rc == 0, "metrics thread failed");
+    log_info("[metrics] serving on %s", socket_path);
+    return 0;
+
+error:
+    g_metrics_on = 0;
+    if (g_admin_fd >= 0) close(g_admin_fd);
+    g_admin_fd = -1;
+    return -1;
+}
+
+void metrics_stop(void) {
+    if (g_admin_fd < 0) return;
+    g_admin_stop = 1;
+    pthread_join(g_admin, NULL);
+    close(g_admin_fd);
+    g_admin_fd = -1;
+    unlink(g_admin_path);
+}
@@ -0,0 +1,155 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "../shared/message.h"
+#include "../shared/trace.h"
+
+/*
+ * Live metrics (METRICS_SOCKET, all server modes)
+ * -----------------------------------------------
+ * Every thread that records something owns a metrics_thread_t: counters and
+ * histograms only that thread writes (plain relaxed load + store, no locked
+ * instructions), which the admin thread sums up when a scraper connects to
+ * the METRICS_SOCKET unix socket. The reply is Prometheus text exposition
+ * (plain, or as an HTTP response if the request starts with "GET").
+ *
+ * Histograms are HDR-style: 16 linear sub-buckets per power of two, so every
+ * bucket is within ~6% of its values. Time is in nanoseconds on the hot path
+ * and exported in seconds.
+ *
+ * With no METRICS_SOCKET nothing is recorded and each hook is one predictable
+ * branch; no clock is read.
+ */
+#define METRICS_TYPES   32          /* msg_type_t values, see MSG_V2_TYPE_MASK */
+#define METRICS_BUCKETS 640         /* covers values up to 2^42 */
+
+typedef enum {
+    METRICS_DECODE,                 /* ns to parse one buffered frame (reactor modes) */
+    METRICS_FANOUT,                 /* ns to fan one NOTE out to its room */
+    METRICS_LOCK_WAIT,              /* ns spent acquiring g_clients_mx */
+    METRICS_LOCK_HOLD,              /* ns g_clients_mx was held */
+    METRICS_BACKLOG,                /* bytes left queued to a client after a write (reactor modes) */
+    METRICS_HISTS
+} metrics_hist_id_t;
+
+typedef struct {
+    _Atomic uint64_t count, sum;
+    _Atomic uint64_t buckets[METRICS_BUCKETS];
+} metrics_hist_t;
+
+typedef struct metrics_thread {
+    _Atomic uint64_t msgs_in[METRICS_TYPES];
+    _Atomic uint64_t msgs_out[METRICS_TYPES];
+    _Atomic uint64_t bytes_in, bytes_out;
+    _Atomic uint64_t dropped;       /* frames discarded by the slow-consumer policy */
+    _Atomic uint64_t slow_closed;   /* clients cut off by OUTQ_POLICY = disconnect */
+    metrics_hist_t   hist[METRICS_HISTS];
+
+    uint64_t         lock_since;    /* owner only: when it took g_clients_mx */
+    struct metrics_thread *next;    /* registry of all blocks, live or parked */
+} metrics_thread_t;
+
+extern int g_metrics_on;
+extern _Thread_local metrics_thread_t *t_metrics;
+
+int  metrics_start(const char *socket_path);
+void metrics_stop(void);
+metrics_thread_t *metrics_attach(void);
+
+static inline metrics_thread_t *metrics_self(void) {
+    return t_metrics ? t_metrics : metrics_attach();
+}
+
+/* Single writer: no read-modify-write atomics needed. */
+static inline void metrics_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline uint64_t metrics_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline unsigned metrics_bucket(uint64_t v) {
+    if (v < 16) return (unsigned)v;
+    unsigned msb = 63u - (unsigned)__builtin_clzll(v);
+    unsigned b   = (msb - 3u) * 16u + (unsigned)((v >> (msb - 4u)) & 15u);
+    return b < METRICS_BUCKETS ? b : METRICS_BUCKETS - 1;
+}
+
+static inline void metrics_record(metrics_hist_id_t id, uint64_t value) {
+    if (!g_metrics_on) return;
+    metrics_hist_t *h = &metrics_self()->hist[id];
+    metrics_add(&h->count, 1);
+    metrics_add(&h->sum, value);
+    metrics_add(&h->buckets[metrics_bucket(value)], 1);
+}
+
+/* Start of a timed section: 0 (and no clock read) when metrics are off. */
+static inline uint64_t metrics_begin(void) {
+    return g_metrics_on ? metrics_clock() : 0;
+}
+
+static inline void metrics_end(metrics_hist_id_t id, uint64_t begin) {
+    if (begin) metrics_record(id, metrics_clock() - begin);
+}
+
+static inline void metrics_received(msg_type_t type) {
+    if (g_metrics_on) metrics_add(&metrics_self()->msgs_in[type & (METRICS_TYPES - 1)], 1);
+}
+
+static inline void metrics_sent(msg_type_t type, uint64_t count) {
+    if (g_metrics_on) metrics_add(&metrics_self()->msgs_out[type & (METRICS_TYPES - 1)], count);
+}
+
+static inline void metrics_bytes_in(uint64_t n) {
+    if (g_metrics_on) metrics_add(&metrics_self()->bytes_in, n);
+}
+
+static inline void metrics_bytes_out(uint64_t n) {
+    if (g_metrics_on) metrics_add(&metrics_self()->bytes_out, n);
+}
+
+static inline void metrics_dropped(uint64_t n) {
+    if (g_metrics_on) metrics_add(&metrics_self()->dropped, n);
+}
+
+static inline void metrics_slow_closed(void) {
+    if (g_metrics_on) metrics_add(&metrics_self()->slow_closed, 1);
+}
+
+/*
+ * Lock / unlock with wait and hold times. An uncontended trylock costs one
+ * clock read: its wait is recorded as 0. Contended waits are also traced.
+ */
+static inline void metrics_lock(pthread_mutex_t *mx) {
+    if (!g_metrics_on && !g_trace_on) {
+        pthread_mutex_lock(mx);
+        return;
+    }
+    uint64_t start = metrics_clock(), wait = 0;
+    if (pthread_mutex_trylock(mx) != 0) {
+        pthread_mutex_lock(mx);
+        uint64_t got = metrics_clock();
+        TRACE_END(start, "g_clients_mx wait", TRACE_CURRENT(), TRACE_FLOW_NONE, 0);
+        wait  = got - start;
+        start = got;
+    }
+    if (!g_metrics_on) return;
+    metrics_record(METRICS_LOCK_WAIT, wait);
+    metrics_self()->lock_since = start;
+}
+
+static inline void metrics_unlock(pthread_mutex_t *mx) {
+    if (g_metrics_on) {
+        metrics_thread_t *m = metrics_self();
+        if (m->lock_since) metrics_record(METRICS_LOCK_HOLD, metrics_clock() - m->lock_since);
+        m->lock_since = 0;
+    }
+    pthread_mutex_unlock(mx);
+}
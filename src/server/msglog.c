@@ -0,0 +1,663 @@
+#include "../shared/slog.h"
+#include "msglog.h"
+#include "../shared/pool.h"
+#include "../shared/trace.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+/*
+ * Record layout (host byte order):
+ *   [u32 len][u32 crc32 of bytes 8..len][u64 seq][u64 time_ms]
+ *   [u16 room_len][u16 name_len][u32 text_len][room][name][text]
+ * A zero length (the sparse, never written tail of a segment) or a bad
+ * checksum marks the end of the valid records.
+ */
+#define REC_HEADER      32
+#define INDEX_INTERVAL  4096        /* record bytes between two index entries */
+#define BATCH_IOV       256         /* records per pwritev() */
+
+typedef struct {
+    uint64_t seq;                   /* 0 = unused slot */
+    uint64_t time_ms;
+    uint64_t offset;
+} index_entry_t;
+
+typedef struct {
+    uint64_t        first_seq;
+    int             fd, idx_fd;
+    size_t          size;           /* mapped (and file) length */
+    unsigned char  *map;            /* PROT_READ, MAP_SHARED */
+    index_entry_t  *idx;            /* idx_cap entries, PROT_READ | PROT_WRITE */
+    size_t          idx_cap;
+    size_t          idx_written;    /* writer only: entries filled in, maybe not yet synced */
+    _Atomic size_t  idx_count;      /* entries whose records are durable */
+    _Atomic size_t  committed;      /* bytes of durable records */
+    uint64_t        last_seq;       /* writer only: newest record written */
+} segment_t;
+
+typedef struct pending {
+    struct pending *next;
+    size_t          len;
+    unsigned char   rec[];          /* the on-disk record; seq and crc are filled in by the writer */
+} pending_t;
+
+struct msglog {
+    char             dir[PATH_MAX - 32];   /* leaves room for "/<seq>.log" */
+    size_t           segment_bytes;
+
+    pthread_rwlock_t segs_lock;     /* the segs array; written only to add a segment */
+    segment_t      **segs;
+    size_t           seg_count, seg_cap;
+
+    pthread_mutex_t  mx;            /* pending list and stop flag */
+    pthread_cond_t   cv;
+    pending_t       *head, *tail;
+    int              stop;
+    pthread_t        writer;
+
+    /* writer thread only */
+    uint64_t         next_seq;
+    uint64_t         last_time_ms;
+    int              failed;        /* a write failed: stop logging */
+
+    _Atomic uint64_t last_seq;      /* newest durable record */
+
+    /* statistics, reported on SIGUSR1 */
+    _Atomic uint64_t records, bytes, commits, dropped;
+    _Atomic uint64_t sync_ns, sync_max_ns;
+};
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static uint32_t record_crc(const unsigned char *rec, size_t len) {
+    return (uint32_t)crc32(0L, rec + 8, (uInt)(len - 8));
+}
+
+/*
+ * Decodes the record at `off` if it is complete and intact.
+ * Returns its length, or 0 if there is no valid record there.
+ */
+static size_t record_at(const segment_t *seg, size_t off, size_t limit, msglog_entry_t *e) {
+    if (off + REC_HEADER > limit) return 0;
+    const unsigned char *p = seg->map + off;
+    uint32_t len, crc, text_len;
+    uint16_t room_len, name_len;
+    memcpy(&len, p, 4);
+    memcpy(&crc, p + 4, 4);
+    memcpy(&room_len, p + 24, 2);
+    memcpy(&name_len, p + 26, 2);
+    memcpy(&text_len, p + 28, 4);
+    if (len < REC_HEADER || len > limit - off) return 0;
+    if ((size_t)REC_HEADER + room_len + name_len + text_len != len) return 0;
+    if (record_crc(p, len) != crc) return 0;
+
+    memcpy(&e->seq, p + 8, 8);
+    memcpy(&e->time_ms, p + 16, 8);
+    e->room     = (const char *)p + REC_HEADER;
+    e->room_len = room_len;
+    e->name     = e->room + room_len;
+    e->name_len = name_len;
+    e->text     = e->name + name_len;
+    e->text_len = text_len;
+    return len;
+}
+
+static void segment_close(segment_t *seg) {
+    if (seg->map && seg->map != MAP_FAILED) munmap(seg->map, seg->size);
+    if (seg->idx && (void *)seg->idx != MAP_FAILED) munmap(seg->idx, seg->idx_cap * sizeof(index_entry_t));
+    if (seg->fd >= 0)     close(seg->fd);
+    if (seg->idx_fd >= 0) close(seg->idx_fd);
+    free(seg);
+}
+
+/*
+ * Opens (creating if needed) the segment starting at first_seq and maps it
+ * and its index. The segment file is grown to at least min_size; sparse, so
+ * the unwritten tail costs no disk.
+ */
+static segment_t *segment_open(msglog_t *log, uint64_t first_seq, size_t min_size) {
+    segment_t *seg = calloc(1, sizeof(*seg));
+    if (!seg) return NULL;
+    seg->first_seq = first_seq;
+    seg->fd = seg->idx_fd = -1;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%020" PRIu64 ".log", log->dir, first_seq);
+    seg->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    probe(seg->fd >= 0, "cannot open log segment %s", path);
+
+    struct stat st;
+    probe(fstat(seg->fd, &st) == 0, "cannot stat %s", path);
+    seg->size = (size_t)st.st_size;
+    if (seg->size < min_size) {
+        probe(ftruncate(seg->fd, (off_t)min_size) == 0, "cannot size %s", path);
+        seg->size = min_size;
+    }
+    seg->map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, seg->fd, 0);
+    probe(seg->map != MAP_FAILED, "cannot map %s", path);
+
+    snprintf(path, sizeof(path), "%s/%020" PRIu64 ".idx", log->dir, first_seq);
+    seg->idx_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    probe(seg->idx_fd >= 0, "cannot open log index %s", path);
+    seg->idx_cap = seg->size / INDEX_INTERVAL + 2;
+    probe(ftruncate(seg->idx_fd, (off_t)(seg->idx_cap * sizeof(index_entry_t))) == 0,
+          "cannot size %s", path);
+    seg->idx = mmap(NULL, seg->idx_cap * sizeof(index_entry_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, seg->idx_fd, 0);
+    probe((void *)seg->idx != MAP_FAILED, "cannot map %s", path);
+    return seg;
+
+error:
+    segment_close(seg);
+    return NULL;
+}
+
+/* Index entries are added at the first record and then every INDEX_INTERVAL bytes. */
+static int index_due(const segment_t *seg, size_t n, size_t off) {
+    return n == 0 || off - seg->idx[n - 1].offset >= INDEX_INTERVAL;
+}
+
+/*
+ * segment_recover
+ * ---------------
+ * Finds the end of a segment's valid records: back to the newest index
+ * entry that still points at an intact record, then forward record by record.
+ * Index entries lost or left stale by a crash are rewritten on the way.
+ */
+static void segment_recover(segment_t *seg) {
+    msglog_entry_t e;
+    size_t n = 0;
+    while (n < seg->idx_cap && seg->idx[n].seq) n++;
+    while (n && (seg->idx[n - 1].offset >= seg->size ||
+                 !record_at(seg, seg->idx[n - 1].offset, seg->size, &e) ||
+                 e.seq != seg->idx[n - 1].seq)) {
+        n--;
+    }
+
+    size_t   off  = n ? seg->idx[n - 1].offset : 0;
+    uint64_t last = seg->first_seq - 1;
+    size_t   len;
+    while ((len = record_at(seg, off, seg->size, &e)) != 0) {
+        if (index_due(seg, n, off) && n < seg->idx_cap)
+            seg->idx[n++] = (index_entry_t){ e.seq, e.time_ms, off };
+        last = e.seq;
+        off += len;
+    }
+    memset(seg->idx + n, 0, (seg->idx_cap - n) * sizeof(index_entry_t));
+
+    seg->idx_written = n;
+    atomic_store(&seg->idx_count, n);
+    atomic_store(&seg->committed, off);
+    seg->last_seq = last;
+}
+
+static int segs_push(msglog_t *log, segment_t *seg) {
+    pthread_rwlock_wrlock(&log->segs_lock);
+    if (log->seg_count == log->seg_cap) {
+        size_t new_cap = log->seg_cap ? log->seg_cap * 2 : 16;
+        segment_t **grown = realloc(log->segs, new_cap * sizeof(*grown));
+        if (!grown) {
+            pthread_rwlock_unlock(&log->segs_lock);
+            return -1;
+        }
+        log->segs    = grown;
+        log->seg_cap = new_cap;
+    }
+    log->segs[log->seg_count++] = seg;
+    pthread_rwlock_unlock(&log->segs_lock);
+    return 0;
+}
+
+/* Makes a new segment file's directory entry durable. */
+static void sync_dir(const msglog_t *log) {
+    int dfd = open(log->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) return;
+    fsync(dfd);
+    close(dfd);
+}
+
+/*
+ * pwritev() until every byte of iov has reached the file at `off`.
+ * Returns 0, or -1 on error.
+ */
+static int pwritev_all(int fd, struct iovec *iov, int iovcnt, off_t off) {
+    while (iovcnt > 0) {
+        ssize_t wrote = pwritev(fd, iov, iovcnt, off);
+        if (wrote < 0 && errno == EINTR) continue;
+        if (wrote <= 0) return -1;
+        off += wrote;
+        while (iovcnt > 0 && (size_t)wrote >= iov->iov_len) {
+            wrote -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + wrote;
+            iov->iov_len -= (size_t)wrote;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes and syncs one run of records to bytes [start, end) of the active
+ * segment, then publishes them (and the index entries they brought) to readers.
+ */
+static int commit_run(msglog_t *log, segment_t *seg, struct iovec *iov, int n, size_t start, size_t end) {
+    if (!n) return 0;
+    TRACE_BEGIN(span);
+    if (pwritev_all(seg->fd, iov, n, (off_t)start) != 0) {
+        log_err("[log] write to segment %" PRIu64 " failed, logging stops", seg->first_seq);
+        return -1;
+    }
+    uint64_t sync_start = mono_ns();
+    if (fdatasync(seg->fd) != 0) {
+        log_err("[log] fdatasync of segment %" PRIu64 " failed, logging stops", seg->first_seq);
+        return -1;
+    }
+    uint64_t took = mono_ns() - sync_start;
+
+    atomic_store_explicit(&seg->idx_count, seg->idx_written, memory_order_release);
+    atomic_store_explicit(&seg->committed, end, memory_order_release);
+    atomic_store_explicit(&log->last_seq, seg->last_seq, memory_order_release);
+
+    atomic_fetch_add(&log->records, (uint64_t)n);
+    atomic_fetch_add(&log->bytes, end - start);
+    atomic_fetch_add(&log->commits, 1);
+    atomic_fetch_add(&log->sync_ns, took);
+    if (took > atomic_load(&log->sync_max_ns)) atomic_store(&log->sync_max_ns, took);
+    TRACE_END(span, "msglog_commit", 0, TRACE_FLOW_NONE, (uint32_t)n);
+    return 0;
+}
+
+/*
+ * write_batch
+ * -----------
+ * Assigns sequence numbers to everything that was queued, writes it in as few
+ * pwritev() calls as IOV limits and segment boundaries allow and syncs each
+ * run once. A full segment is left behind for a new one.
+ */
+static void write_batch(msglog_t *log, pending_t *batch) {
+    struct iovec iov[BATCH_IOV];
+    int       n   = 0;
+    segment_t *seg = log->segs[log->seg_count - 1];
+    size_t    start = atomic_load(&seg->committed), off = start;
+
+    for (pending_t *p = batch; p && !log->failed; p = p->next) {
+        if (off + p->len > seg->size || n == BATCH_IOV) {
+            if (commit_run(log, seg, iov, n, start, off) != 0) { log->failed = 1; break; }
+            n = 0;
+            start = off;
+        }
+        if (off + p->len > seg->size) {
+            segment_t *next = segment_open(log, log->next_seq, log->segment_bytes);
+            if (next) segment_recover(next);
+            if (!next || segs_push(log, next) != 0) {
+                if (next) segment_close(next);
+                log_err("[log] cannot start segment %" PRIu64 ", logging stops", log->next_seq);
+                log->failed = 1;
+                break;
+            }
+            sync_dir(log);
+            seg   = next;
+            start = off = 0;
+        }
+
+        uint64_t seq = log->next_seq++;
+        uint64_t time_ms;
+        memcpy(&time_ms, p->rec + 16, 8);
+        if (time_ms < log->last_time_ms) time_ms = log->last_time_ms;   /* keep the index sorted */
+        log->last_time_ms = time_ms;
+        memcpy(p->rec + 8, &seq, 8);
+        memcpy(p->rec + 16, &time_ms, 8);
+        uint32_t crc = record_crc(p->rec, p->len);
+        memcpy(p->rec + 4, &crc, 4);
+
+        if (index_due(seg, seg->idx_written, off) && seg->idx_written < seg->idx_cap)
+            seg->idx[seg->idx_written++] = (index_entry_t){ seq, time_ms, off };
+        seg->last_seq = seq;
+        iov[n++] = (struct iovec){ p->rec, p->len };
+        off += p->len;
+    }
+    if (!log->failed && commit_run(log, seg, iov, n, start, off) != 0) log->failed = 1;
+
+    while (batch) {
+        pending_t *next = batch->next;
+        if (log->failed) atomic_fetch_add(&log->dropped, 1);
+        pool_free(batch);
+        batch = next;
+    }
+}
+
+/*
+ * The writer thread: takes everything queued since its last round and
+ * commits it as one group, until msglog_close() asks it to stop.
+ */
+static void *writer_main(void *arg) {
+    msglog_t *log = arg;
+    TRACE_THREAD_NAME("msglog writer");
+    for (;;) {
+        pthread_mutex_lock(&log->mx);
+        while (!log->head && !log->stop) pthread_cond_wait(&log->cv, &log->mx);
+        pending_t *batch = log->head;
+        int        stop  = log->stop;
+        log->head = log->tail = NULL;
+        pthread_mutex_unlock(&log->mx);
+
+        if (!batch && stop) break;
+        write_batch(log, batch);
+    }
+    return NULL;
+}
+
+static int seq_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Sorted first sequence numbers of the segments already in dir.
+ * Returns their count, or -1 on error.
+ */
+static long list_segments(const char *dir, uint64_t **out) {
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    uint64_t *seqs = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        char *end;
+        unsigned long long seq = strtoull(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, ".log") != 0 || seq == 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *grown = realloc(seqs, cap * sizeof(*grown));
+            if (!grown) { free(seqs); closedir(d); return -1; }
+            seqs = grown;
+        }
+        seqs[count++] = seq;
+    }
+    closedir(d);
+    qsort(seqs, count, sizeof(*seqs), seq_compare);
+    *out = seqs;
+    return (long)count;
+}
+
+/*
+ * msglog_open
+ * -----------
+ * Opens (creating if needed) the log in `dir`, recovers the end of every
+ * segment and starts the writer thread. New segments are segment_bytes long.
+ * Returns NULL (after logging why) if the log cannot be used.
+ */
+msglog_t *msglog_open(const char *dir, size_t segment_bytes) {
+    msglog_t *log = calloc(1, sizeof(*log));
+    uint64_t *seqs = NULL;
+    if (!log) return NULL;
+    snprintf(log->dir, sizeof(log->dir), "%s", dir);
+    log->segment_bytes = segment_bytes;
+    pthread_rwlock_init(&log->segs_lock, NULL);
+    pthread_mutex_init(&log->mx, NULL);
+    pthread_cond_init(&log->cv, NULL);
+
+    uint64_t started = mono_ns();
+    probe(strlen(dir) < sizeof(log->dir), "log directory path too long");
+    probe(segment_bytes >= INDEX_INTERVAL, "LOG_SEGMENT_BYTES must be at least %d", INDEX_INTERVAL);
+    probe(mkdir(dir, 0755) == 0 || errno == EEXIST, "cannot create log directory %s", dir);
+    long count = list_segments(dir, &seqs);
+    probe(count >= 0, "cannot read log directory %s", dir);
+
+    for (long i = 0; i < count; i++) {
+        /* Only the newest segment is still written to; older ones keep their size. */
+        segment_t *seg = segment_open(log, seqs[i], i == count - 1 ? segment_bytes : 0);
+        probe(seg, "cannot use log segment %" PRIu64, seqs[i]);
+        segment_recover(seg);
+        if (segs_push(log, seg) != 0) { segment_close(seg); goto error; }
+    }
+    if (log->seg_count == 0) {
+        segment_t *seg = segment_open(log, 1, segment_bytes);
+        probe(seg, "cannot create the first log segment");
+        segment_recover(seg);
+        if (segs_push(log, seg) != 0) { segment_close(seg); goto error; }
+        sync_dir(log);
+    }
+
+    segment_t *active = log->segs[log->seg_count - 1];
+    log->next_seq = active->last_seq + 1;
+    atomic_store(&log->last_seq, active->last_seq);
+    size_t last_idx = atomic_load(&active->idx_count);
+    if (last_idx) log->last_time_ms = active->idx[last_idx - 1].time_ms;
+
+    /* SIGINT / SIGUSR1 must keep landing on reactor 0, not on the writer. */
+    sigset_t block, previous;
+    sigfillset(&block);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+    int rc = pthread_create(&log->writer, NULL, writer_main, log);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    probe(rc == 0, "cannot start the log writer");
+    log_info("[log] %s: %zu segment(s), last seq %" PRIu64 ", opened in %.1f ms",
+             dir, log->seg_count, active->last_seq, (double)(mono_ns() - started) / 1e6);
+    free(seqs);
+    return log;
+
+error:
+    free(seqs);
+    for (size_t i = 0; i < log->seg_count; i++) segment_close(log->segs[i]);
+    free(log->segs);
+    free(log);
+    return NULL;
+}
+
+/*
+ * msglog_close
+ * ------------
+ * Lets the writer commit everything still queued, then unmaps and closes
+ * every segment.
+ */
+void msglog_close(msglog_t *log) {
+    if (!log) return;
+    pthread_mutex_lock(&log->mx);
+    log->stop = 1;
+    pthread_cond_signal(&log->cv);
+    pthread_mutex_unlock(&log->mx);
+    pthread_join(log->writer, NULL);
+
+    for (size_t i = 0; i < log->seg_count; i++) segment_close(log->segs[i]);
+    free(log->segs);
+    pthread_rwlock_destroy(&log->segs_lock);
+    pthread_mutex_destroy(&log->mx);
+    pthread_cond_destroy(&log->cv);
+    free(log);
+}
+
+/*
+ * msglog_append
+ * -------------
+ * Queues a note for the writer thread; never touches the disk.
+ * Returns 0, or -1 if it is too large for a segment or memory ran out.
+ */
+int msglog_append(msglog_t *log, const char *room, const char *name, const char *text) {
+    size_t room_len = room ? strlen(room) : 0;
+    size_t name_len = name ? strlen(name) : 0;
+    size_t text_len = text ? strlen(text) : 0;
+    size_t len      = REC_HEADER + room_len + name_len + text_len;
+    if (room_len > UINT16_MAX || name_len > UINT16_MAX || len > log->segment_bytes) {
+        atomic_fetch_add(&log->dropped, 1);
+        return -1;
+    }
+
+    pending_t *p = pool_alloc(sizeof(*p) + len);
+    if (!p) {
+        atomic_fetch_add(&log->dropped, 1);
+        return -1;
+    }
+    p->next = NULL;
+    p->len  = len;
+
+    uint32_t len32 = (uint32_t)len, text32 = (uint32_t)text_len;
+    uint16_t room16 = (uint16_t)room_len, name16 = (uint16_t)name_len;
+    uint64_t time_ms = wall_ms();
+    memset(p->rec + 4, 0, 12);                  /* crc and seq: the writer's */
+    memcpy(p->rec, &len32, 4);
+    memcpy(p->rec + 16, &time_ms, 8);
+    memcpy(p->rec + 24, &room16, 2);
+    memcpy(p->rec + 26, &name16, 2);
+    memcpy(p->rec + 28, &text32, 4);
+    unsigned char *body = p->rec + REC_HEADER;
+    if (room_len) memcpy(body, room, room_len);
+    if (name_len) memcpy(body + room_len, name, name_len);
+    if (text_len) memcpy(body + room_len + name_len, text, text_len);
+
+    pthread_mutex_lock(&log->mx);
+    if (log->tail) log->tail->next = p;
+    else           log->head = p;
+    log->tail = p;
+    pthread_cond_signal(&log->cv);
+    pthread_mutex_unlock(&log->mx);
+    return 0;
+}
+
+uint64_t msglog_last_seq(msglog_t *log) {
+    return atomic_load_explicit(&log->last_seq, memory_order_acquire);
+}
+
+/*
+ * Index (into segs) of the segment holding `seq`: the last one starting at or
+ * before it. Caller holds segs_lock.
+ */
+static size_t segment_for_seq(const msglog_t *log, uint64_t seq) {
+    size_t lo = 0, hi = log->seg_count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (log->segs[mid]->first_seq <= seq) lo = mid;
+        else                                  hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Offset of the newest index entry of `seg` with seq <= key (by_time: with
+ * time < key), or 0; entries are sorted by both. Scanning on from there
+ * reaches the first record at or past the key.
+ */
+static size_t index_seek(const segment_t *seg, uint64_t key, int by_time) {
+    size_t n = atomic_load_explicit(&seg->idx_count, memory_order_acquire);
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        uint64_t v = by_time ? seg->idx[mid].time_ms : seg->idx[mid].seq;
+        if (by_time ? v < key : v <= key) lo = mid + 1;
+        else                              hi = mid;
+    }
+    return lo ? seg->idx[lo - 1].offset : 0;
+}
+
+/*
+ * msglog_scan
+ * -----------
+ * Calls visit() for up to max_records committed records, oldest first,
+ * starting at seq `from_seq`, straight from the mapped segments. The entry's
+ * strings are only valid during the call.
+ * Returns the number of records visited.
+ */
+size_t msglog_scan(msglog_t *log, uint64_t from_seq, size_t max_records,
+                   msglog_visit_fn visit, void *arg) {
+    size_t visited = 0;
+    pthread_rwlock_rdlock(&log->segs_lock);
+    for (size_t s = segment_for_seq(log, from_seq); s < log->seg_count && visited < max_records; s++) {
+        const segment_t *seg = log->segs[s];
+        size_t limit = atomic_load_explicit(&seg->committed, memory_order_acquire);
+        size_t off   = from_seq > seg->first_seq ? index_seek(seg, from_seq, 0) : 0;
+        msglog_entry_t e;
+        size_t len;
+        while (visited < max_records && (len = record_at(seg, off, limit, &e)) != 0) {
+            off += len;
+            if (e.seq < from_seq) continue;
+            visited++;
+            if (visit(arg, &e)) {
+                max_records = visited;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&log->segs_lock);
+    return visited;
+}
+
+/*
+ * msglog_seq_at
+ * -------------
+ * Sequence number of the first record logged at or after time_ms (ms since
+ * the epoch), or one past the newest record if there is none.
+ */
+uint64_t msglog_seq_at(msglog_t *log, uint64_t time_ms) {
+    uint64_t found = msglog_last_seq(log) + 1;
+    pthread_rwlock_rdlock(&log->segs_lock);
+
+    /* The last segment whose first indexed record is not newer than time_ms. */
+    size_t s = 0;
+    for (size_t lo = 0, hi = log->seg_count; lo < hi; ) {
+        size_t mid = (lo + hi) / 2;
+        const segment_t *seg = log->segs[mid];
+        if (atomic_load(&seg->idx_count) && seg->idx[0].time_ms <= time_ms) { s = mid; lo = mid + 1; }
+        else                                                                  hi = mid;
+    }
+    for (; s < log->seg_count; s++) {
+        const segment_t *seg = log->segs[s];
+        size_t limit = atomic_load_explicit(&seg->committed, memory_order_acquire);
+        size_t off   = index_seek(seg, time_ms, 1);
+        msglog_entry_t e;
+        size_t len;
+        while ((len = record_at(seg, off, limit, &e)) != 0) {
+            if (e.time_ms >= time_ms) {
+                found = e.seq;
+                goto done;
+            }
+            off += len;
+        }
+    }
+done:
+    pthread_rwlock_unlock(&log->segs_lock);
+    return found;
+}
+
+/*
+ * Logs the writer's group commit statistics (SIGUSR1).
+ */
+void msglog_report(msglog_t *log) {
+    uint64_t records = atomic_load(&log->records), commits = atomic_load(&log->commits);
+    log_info("[log] %" PRIu64 " records / %" PRIu64 " bytes in %" PRIu64 " group commits "
+             "(%.1f per fsync), fsync avg %.1f us, max %.1f us, %" PRIu64 " dropped, "
+             "last seq %" PRIu64 ", %zu segment(s)",
+             records, atomic_load(&log->bytes), commits,
+             commits ? (double)records / (double)commits : 0.0,
+             commits ? (double)atomic_load(&log->sync_ns) / (double)commits / 1000.0 : 0.0,
+             (double)atomic_load(&log->sync_max_ns) / 1000.0, atomic_load(&log->dropped),
+             msglog_last_seq(log), log->seg_count);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Persistent message log (LOG_DIR, reactor modes)
+ * -----------------------------------------------
+ * Every delivered note is appended to a segmented, append-only log on disk.
+ * Appends only queue the record; a background writer thread writes whatever
+ * has queued up with one pwritev() and makes it durable with one fdatasync()
+ * (group commit), so the fanout path never waits for the disk.
+ *
+ * Segment files are named after the first sequence number they hold
+ * (<dir>/<seq>.log) and are mapped read-only in full; readers walk committed
+ * records straight from the mappings. Each has a sparse index (<seq>.idx,
+ * mapped read-write by the writer) with one {seq, time, offset} entry per
+ * ~4 KiB of records, used to seek by sequence number or by time. On open only
+ * the tail of each segment after its last valid index entry is re-scanned.
+ */
+typedef struct msglog msglog_t;
+
+/* One logged note. The strings point into a mapped segment and are not NUL-terminated. */
+typedef struct {
+    uint64_t    seq;                /* 1, 2, 3, ... across the whole log */
+    uint64_t    time_ms;            /* wall clock, ms since the epoch, non-decreasing */
+    const char *room, *name, *text;
+    size_t      room_len, name_len, text_len;
+} msglog_entry_t;
+
+/* Return non-zero to stop the scan. */
+typedef int (*msglog_visit_fn)(void *arg, const msglog_entry_t *entry);
+
+msglog_t *msglog_open(const char *dir, size_t segment_bytes);
+void      msglog_close(msglog_t *log);
+int       msglog_append(msglog_t *log, const char *room, const char *name, const char *text);
+
+uint64_t  msglog_last_seq(msglog_t *log);
+uint64_t  msglog_seq_at(msglog_t *log, uint64_t time_ms);
+size_t    msglog_scan(msglog_t *log, uint64_t from_seq, size_t max_records,
+                      msglog_visit_fn visit, void *arg);
+void      msglog_report(msglog_t *log);
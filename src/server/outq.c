@@ -0,0 +1,342 @@
+#include "outq.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#define OUTQ_IOV_BATCH 64           /* frames gathered into one sendmsg() */
+
+/*
+ * outq_push
+ * ---------
+ * Appends a frame, taking a new reference to it (the caller keeps its own).
+ * Returns:
+ *   0 on success
+ *  -1 on allocation failure
+ */
+int outq_push(outq_t *q, msg_frame_t *frame) {
+    if (q->count == q->cap) {
+        size_t new_cap = q->cap ? q->cap * 2 : 16;
+        msg_frame_t **grown = malloc(new_cap * sizeof(*grown));
+        if (!grown) return -1;
+        /* Unroll the ring into the new array so head becomes 0. */
+        for (size_t i = 0; i < q->count; i++)
+            grown[i] = q->frames[(q->head + i) % q->cap];
+        free(q->frames);
+        q->frames = grown;
+        q->cap    = new_cap;
+        q->head   = 0;
+    }
+
+    q->frames[(q->head + q->count) % q->cap] = msg_frame_ref(frame);
+    q->count++;
+    q->bytes += frame->len;
+
+    if (q->count > q->peak_frames) q->peak_frames = q->count;
+    if (q->bytes > q->peak_bytes)  q->peak_bytes  = q->bytes;
+    return 0;
+}
+
+/*
+ * Releases the oldest frame after it has been fully written or dropped.
+ */
+static void outq_pop(outq_t *q) {
+    msg_frame_t *f = q->frames[q->head];
+    q->bytes -= f->len - q->head_off;
+    msg_frame_unref(f);
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    q->head_off = 0;
+}
+
+/*
+ * outq_drop_oldest
+ * ----------------
+ * Discards the oldest frame that has not started going out. A partially
+ * written head frame is kept, otherwise the peer would see a torn frame, and
+ * so are frames pinned by an in-flight asynchronous send and frames marked
+ * `keep`.
+ * Returns:
+ *   0 if a frame was dropped
+ *  -1 if there was nothing droppable
+ */
+int outq_drop_oldest(outq_t *q) {
+    size_t keep = q->pinned;
+    if (keep == 0 && q->head_off) keep = 1;
+    while (keep < q->count && q->frames[(q->head + keep) % q->cap]->keep) keep++;
+
+    if (q->count <= keep) return -1;
+    if (keep == 0) {
+        outq_pop(q);
+        q->dropped++;
+        return 0;
+    }
+
+    /* Remove the first droppable frame by shifting the kept ones forward one slot. */
+    size_t victim = (q->head + keep) % q->cap;
+    q->bytes -= q->frames[victim]->len;
+    msg_frame_unref(q->frames[victim]);
+    for (size_t i = keep; i > 0; i--) {
+        size_t to = (q->head + i) % q->cap;
+        q->frames[to] = q->frames[(q->head + i - 1) % q->cap];
+    }
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    q->dropped++;
+    return 0;
+}
+
+/*
+ * outq_fill_iov
+ * -------------
+ * Describes up to `max_iov` unsent frames, oldest first, as iovecs (the head
+ * frame starting at head_off). Nothing is dequeued; see outq_consume().
+ * Returns the number of iovecs filled; *bytes_out gets their total length.
+ */
+int outq_fill_iov(const outq_t *q, struct iovec *iov, int max_iov, size_t *bytes_out) {
+    size_t bytes = 0;
+    int    n = 0;
+
+    for (size_t i = 0; i < q->count && n < max_iov; i++, n++) {
+        msg_frame_t *f = q->frames[(q->head + i) % q->cap];
+        size_t skip = (i == 0) ? q->head_off : 0;
+        iov[n].iov_base = f->data + skip;
+        iov[n].iov_len  = f->len - skip;
+        bytes          += iov[n].iov_len;
+    }
+    *bytes_out = bytes;
+    return n;
+}
+
+/*
+ * outq_consume
+ * ------------
+ * Accounts for `sent` bytes the kernel took from the front of the queue:
+ * retires every frame it covered completely and advances into the next.
+ */
+void outq_consume(outq_t *q, size_t sent) {
+    metrics_bytes_out(sent);
+    q->bytes -= sent;
+    while (sent) {
+        msg_frame_t *f = q->frames[q->head];
+        size_t remaining = f->len - q->head_off;
+        if (sent < remaining) {
+            q->head_off += sent;
+            break;
+        }
+        sent -= remaining;
+        q->head_off = f->len;
+        outq_pop(q);
+        q->frames_written++;
+    }
+}
+
+/*
+ * outq_enable_zerocopy
+ * --------------------
+ * Opts the socket into MSG_ZEROCOPY for frames of at least `threshold` bytes.
+ * Returns 0, or -1 if the kernel refused SO_ZEROCOPY (frames are then copied
+ * as usual).
+ */
+int outq_enable_zerocopy(outq_t *q, int fd, size_t threshold) {
+    int one = 1;
+    if (threshold == 0 || setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+        return -1;
+    q->zc_threshold = threshold;
+    return 0;
+}
+
+static int zc_reserve(outq_t *q) {
+    if (q->zc_count < q->zc_cap) return 0;
+
+    size_t new_cap = q->zc_cap ? q->zc_cap * 2 : 8;
+    outq_zc_t *grown = malloc(new_cap * sizeof(*grown));
+    if (!grown) return -1;
+    for (size_t i = 0; i < q->zc_count; i++)
+        grown[i] = q->zc[(q->zc_head + i) % q->zc_cap];
+    free(q->zc);
+    q->zc      = grown;
+    q->zc_cap  = new_cap;
+    q->zc_head = 0;
+    return 0;
+}
+
+/*
+ * Releases the frames of every zerocopy send in [lo, hi] (the kernel's ids
+ * are 32-bit and wrap). Completions normally arrive in order; an out-of-order
+ * one just leaves a hole that is skipped once the head catches up.
+ */
+static void zc_complete(outq_t *q, uint32_t lo, uint32_t hi) {
+    for (size_t i = 0; i < q->zc_count; i++) {
+        outq_zc_t *e = &q->zc[(q->zc_head + i) % q->zc_cap];
+        if (e->frame && (uint32_t)(e->id - lo) <= (uint32_t)(hi - lo)) {
+            msg_frame_unref(e->frame);
+            e->frame = NULL;
+        }
+    }
+    while (q->zc_count && !q->zc[q->zc_head].frame) {
+        q->zc_head = (q->zc_head + 1) % q->zc_cap;
+        q->zc_count--;
+    }
+}
+
+/*
+ * outq_zc_reap
+ * ------------
+ * Drains the socket's error queue, where the kernel reports that zerocopy
+ * sends no longer need their pages, and drops our hold on those frames.
+ * If the kernel had to copy after all (loopback, devices without scatter-
+ * gather), zerocopy only costs extra work for this socket and is switched off.
+ * Returns the number of completions handled, or -1 on a socket error.
+ */
+int outq_zc_reap(outq_t *q, int fd) {
+    int handled = 0;
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr mh = {0};
+        mh.msg_control    = control;
+        mh.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return handled;
+            return -1;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            int is_recverr = (cm->cmsg_level == SOL_IP   && cm->cmsg_type == IP_RECVERR) ||
+                             (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!is_recverr) continue;
+
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+            if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            zc_complete(q, serr.ee_info, serr.ee_data);
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                q->zc_copied++;
+                q->zc_threshold = 0;
+            }
+            handled++;
+        }
+    }
+}
+
+/*
+ * outq_zc_detach
+ * --------------
+ * Hands over (reference included) one frame that a zerocopy send still holds,
+ * for a connection being closed before its completions arrived.
+ * Returns NULL when there are none left.
+ */
+msg_frame_t *outq_zc_detach(outq_t *q) {
+    while (q->zc_count) {
+        msg_frame_t *f = q->zc[q->zc_head].frame;
+        q->zc_head = (q->zc_head + 1) % q->zc_cap;
+        q->zc_count--;
+        if (f) return f;
+    }
+    return NULL;
+}
+
+/*
+ * Trims a batch so it is either one large frame, to be sent with
+ * MSG_ZEROCOPY, or only small frames, copied as usual.
+ * Returns 1 for a zerocopy batch.
+ */
+static int zc_split_batch(const outq_t *q, struct iovec *iov, int *n, size_t *bytes) {
+    for (int i = 0; i < *n; i++) {
+        if (q->frames[(q->head + (size_t)i) % q->cap]->len < q->zc_threshold) continue;
+        if (i == 0) *n = 1;
+        else        *n = i;
+        *bytes = 0;
+        for (int k = 0; k < *n; k++) *bytes += iov[k].iov_len;
+        return i == 0;
+    }
+    return 0;
+}
+
+/*
+ * outq_flush
+ * ----------
+ * Writes queued frames in order until the queue is empty or the socket is full.
+ * Up to OUTQ_IOV_BATCH frames go out per sendmsg(), so a backlog of small
+ * frames costs one syscall instead of one per frame. With zerocopy enabled,
+ * each large frame goes out on its own with MSG_ZEROCOPY and stays referenced
+ * until outq_zc_reap() sees the kernel release it.
+ * Returns:
+ *   0 if everything was written or the socket is full (EAGAIN / short write)
+ *  -1 on a socket error
+ */
+int outq_flush(outq_t *q, int fd) {
+    while (q->count) {
+        struct iovec iov[OUTQ_IOV_BATCH];
+        size_t       batch_bytes;
+        int          n = outq_fill_iov(q, iov, OUTQ_IOV_BATCH, &batch_bytes);
+
+        int zerocopy = q->zc_threshold && zc_split_batch(q, iov, &n, &batch_bytes) &&
+                       zc_reserve(q) == 0;
+
+        struct msghdr mh = {0};
+        mh.msg_iov    = iov;
+        mh.msg_iovlen = (size_t)n;
+
+        /* MSG_DONTWAIT: never block, even on a socket left in blocking mode. */
+        int flags = MSG_NOSIGNAL | MSG_DONTWAIT | (zerocopy ? MSG_ZEROCOPY : 0);
+        ssize_t sent = sendmsg(fd, &mh, flags);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            /* Out of locked-page budget: fall back to copying for this socket. */
+            if (errno == ENOBUFS && zerocopy) {
+                q->zc_threshold = 0;
+                continue;
+            }
+            return -1;
+        }
+
+        if (zerocopy) {
+            /* The kernel numbers successful zerocopy sends 0, 1, 2, ... per socket. */
+            outq_zc_t *e = &q->zc[(q->zc_head + q->zc_count++) % q->zc_cap];
+            e->id    = q->zc_next++;
+            e->frame = msg_frame_ref(q->frames[q->head]);
+            q->zc_sends++;
+        }
+        q->writes++;
+        outq_consume(q, (size_t)sent);
+
+        /* A short write means the send buffer is full; EPOLLOUT will call us back. */
+        if ((size_t)sent < batch_bytes) return 0;
+    }
+    return 0;
+}
+
+void outq_free(outq_t *q) {
+    while (q->count) outq_pop(q);
+    for (size_t i = 0; i < q->zc_count; i++) {
+        msg_frame_t *f = q->zc[(q->zc_head + i) % q->zc_cap].frame;
+        if (f) msg_frame_unref(f);
+    }
+    free(q->zc);
+    free(q->frames);
+    memset(q, 0, sizeof(*q));
+}
+
+outq_policy_t outq_policy_from_string(const char *s) {
+    if (s && strcmp(s, "drop_newest") == 0) return OUTQ_DROP_NEWEST;
+    if (s && strcmp(s, "disconnect") == 0)  return OUTQ_DISCONNECT;
+    return OUTQ_DROP_OLDEST;
+}
+
+const char *outq_policy_name(outq_policy_t policy) {
+    switch (policy) {
+    case OUTQ_DROP_NEWEST: return "drop_newest";
+    case OUTQ_DISCONNECT:  return "disconnect";
+    default:               return "drop_oldest";
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "../shared/message.h"
+
+struct iovec;
+
+/* A frame lent to the kernel by a MSG_ZEROCOPY send, held until it completes. */
+typedef struct {
+    uint32_t     id;                /* the kernel's sequence number for that send */
+    msg_frame_t *frame;             /* NULL once completed out of order */
+} outq_zc_t;
+
+/*
+ * Per-connection outbound frame queue (epoll mode).
+ * Holds references to shared msg_frame_t objects, written out in order as the
+ * socket allows; `head_off` tracks how much of the oldest frame the kernel
+ * already took.
+ */
+typedef struct {
+    msg_frame_t **frames;           /* ring buffer */
+    size_t       head, count, cap;
+    size_t       head_off;          /* bytes of frames[head] already sent */
+    size_t       bytes;             /* unsent bytes across all queued frames */
+    size_t       pinned;            /* head frames handed to an in-flight async send */
+
+    size_t       peak_frames;       /* high-water statistics for reporting */
+    size_t       peak_bytes;
+    uint64_t     dropped;           /* frames discarded by the slow-consumer policy */
+    uint64_t     writes;            /* sends that moved bytes */
+    uint64_t     frames_written;    /* frames completely handed to the kernel */
+
+    size_t       zc_threshold;      /* frames this large go out with MSG_ZEROCOPY, 0 = never */
+    uint32_t     zc_next;           /* id of our next zerocopy send */
+    outq_zc_t   *zc;                /* ring of frames the kernel may still read */
+    size_t       zc_head, zc_count, zc_cap;
+    uint64_t     zc_sends;          /* zerocopy sends issued */
+    uint64_t     zc_copied;         /* of those, completions where the kernel copied anyway */
+} outq_t;
+
+/* What to do when a queue would grow past its high-water mark. */
+typedef enum {
+    OUTQ_DROP_OLDEST,
+    OUTQ_DROP_NEWEST,
+    OUTQ_DISCONNECT
+} outq_policy_t;
+
+int  outq_push(outq_t *q, msg_frame_t *frame);
+int  outq_drop_oldest(outq_t *q);
+int  outq_flush(outq_t *q, int fd);
+int  outq_fill_iov(const outq_t *q, struct iovec *iov, int max_iov, size_t *bytes_out);
+void outq_consume(outq_t *q, size_t sent);
+int  outq_enable_zerocopy(outq_t *q, int fd, size_t threshold);
+int  outq_zc_reap(outq_t *q, int fd);
+msg_frame_t *outq_zc_detach(outq_t *q);
+void outq_free(outq_t *q);
+
+outq_policy_t outq_policy_from_string(const char *s);
+const char   *outq_policy_name(outq_policy_t policy);
@@ -0,0 +1,2021 @@
+#include "../shared/slog.h"
+#include "reactor.h"
+#include "main.h"
+#include "membership.h"
+#include "metrics.h"
+#include "msglog.h"
+#include "outq.h"
+#include "uring.h"
+#include "../shared/message.h"
+#include "../shared/pool.h"
+#include "../shared/trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define REACTOR_MAX_EVENTS 256      /* events drained per epoll_wait() call */
+#define NOT_JOINED         SIZE_MAX /* conn_t.joined_idx when not in joined[] */
+#define ROOM_ALL           UINT32_MAX /* inbox_msg_t.room for server-wide indications */
+#define INBOX_ROOM_CLOSED  (-2)     /* inbox_msg_t.fd: the room closed, drop its state */
+
+#define ZC_LINGER_SEC      30       /* how long a closed socket's zerocopy frames are kept */
+
+#define URING_ENTRIES      4096     /* SQ size; the CQ gets four times as many */
+#define URING_BUFS         256      /* provided receive buffers per reactor (power of two) */
+#define URING_BUF_SIZE     8192
+#define URING_SEND_IOV     16       /* frames gathered into one async sendmsg */
+#define URING_DRAIN_MS     1000     /* at exit, how long sends already in flight may take */
+
+/*
+ * io_uring user_data: the listener and the wake eventfd have fixed tags, every
+ * connection operation is the conn_t pointer with the operation in its low bits.
+ */
+#define UD_ACCEPT          1
+#define UD_WAKE            2
+#define UD_TIMER           3
+#define UD_DRAIN           4        /* exit-time timeout, see reactor_uring_quiesce() */
+#define UD_OP_RECV         0
+#define UD_OP_SEND         1
+#define UD_OP_MASK         3
+
+/*
+ * Per-connection state machine:
+ *   CONN_AWAIT_JOIN --JOIN--> CONN_JOINED --LEAVE/SHUTDOWN/EOF/error--> CONN_CLOSING
+ * Connections in CONN_CLOSING are ignored by the event loop and torn down in
+ * reactor_reap() at the end of the current iteration, so a socket is never
+ * closed (and its fd reused) while a fanout may still reference it.
+ */
+typedef enum {
+    CONN_AWAIT_JOIN,
+    CONN_JOINED,
+    CONN_CLOSING
+} conn_state_t;
+
+typedef struct conn {
+    int            fd;
+    conn_state_t   state;
+    int            registered;      /* present in g_clients (must be removed on close) */
+    size_t         joined_idx;      /* slot in the owning reactor's joined[], or NOT_JOINED */
+    char           name[64];
+    int            wire_version;    /* 1, or 2 once negotiated at JOIN */
+    int            deflate;         /* v2 peer takes compressed frames */
+    uint32_t       sender_id;       /* interned id for v2 recipients, 0 = none */
+    uint32_t      *known_senders;   /* ids this (v2) peer has been told about, */
+    size_t         known_count, known_slots;    /* open addressing, 0 = empty */
+    room_t        *room;            /* room our NOTEs go to, once joined */
+    size_t         room_idx;        /* slot in the reactor's member list for that room */
+
+    msg_reader_t   reader;          /* bytes received but not yet parsed into frames */
+
+    outq_t         outq;            /* encoded frames not yet accepted by the kernel */
+    int            over_high_water; /* warned about this backlog already */
+
+    /* write coalescing: frames queued since the last flush */
+    int            dirty;           /* on the reactor's dirty list */
+    size_t         unflushed;       /* bytes queued since the last flush */
+    uint64_t       dirty_since;     /* monotonic ns of the first of them */
+    struct conn   *dirty_prev, *dirty_next;
+
+    /* io_uring backend only */
+    unsigned       uring_ops;       /* requests in flight that carry this conn_t */
+    int            send_inflight;   /* a SENDMSG owns the first outq.pinned frames */
+    int            reaped;          /* torn down, freed once uring_ops drops to 0 */
+    struct iovec  *send_iov;        /* URING_SEND_IOV entries, allocated on first send */
+    struct msghdr  send_msg;
+
+    struct conn   *next_closing;
+} conn_t;
+
+/*
+ * One outgoing message in every encoding a recipient may need: v1, v2 and
+ * compressed v2 (only built while some client can take them), plus the
+ * MSG_SENDER_ID frame that has to reach a v2 recipient before the first v2
+ * frame naming `sender_id`. Each is encoded once and shared by all recipients.
+ */
+typedef struct {
+    msg_type_t   type;
+    msg_frame_t *v1;
+    msg_frame_t *v2;                /* NULL: everybody gets v1 */
+    msg_frame_t *v2z;               /* NULL: v2 is sent uncompressed */
+    msg_frame_t *v2_sender;         /* set iff sender_id is */
+    uint32_t     sender_id;
+    uint64_t     trace_id;          /* message being traced, 0 = none */
+} frame_set_t;
+
+/*
+ * A message posted from one reactor to another. The receiving reactor fans it
+ * out to its own connections in `room` (or all joined ones), or, for a direct
+ * message, queues it to its connection on `fd` only, provided that is still
+ * the member named `to` (the fd may have been closed and reused meanwhile).
+ * Room ids are reused once a room closes, so `room_gen` says which room it was
+ * meant for; INBOX_ROOM_CLOSED carries no frames and tells the reactor to drop
+ * what it keeps for that room.
+ */
+typedef struct inbox_msg {
+    struct inbox_msg *next;
+    frame_set_t       frames;
+    uint32_t          room;
+    uint64_t          room_gen;
+    int               fd;           /* direct message target, -1, or INBOX_ROOM_CLOSED */
+    char              to[64];       /* direct message: the target's name */
+} inbox_msg_t;
+
+/*
+ * A frame a closed connection's zerocopy send may still be transmitting. Its
+ * completion can no longer be read, so it is released after ZC_LINGER_SEC.
+ */
+typedef struct zc_orphan {
+    struct zc_orphan *next;
+    msg_frame_t      *frame;
+    uint64_t          release_at;   /* monotonic ns */
+} zc_orphan_t;
+
+/*
+ * This reactor's members of one room, indexed by room id in reactor_t.rooms.
+ * Room fanout walks only this list, never the whole joined set.
+ *
+ * Every reactor sees every DELIVER of every room (locally or through its
+ * inbox), so each keeps its own copy of the room's recent history: a ring of
+ * the last HISTORY_DEPTH messages, at most HISTORY_BYTES of frames, that only
+ * the owning thread touches. The frames themselves are shared by all copies.
+ */
+typedef struct {
+    uint64_t      gen;              /* room generation the entries below belong to */
+    int           closed;           /* that room has closed: ignore messages for it */
+    struct conn **members;
+    size_t        count, cap;
+    frame_set_t  *history;          /* HISTORY_DEPTH slots, allocated on first DELIVER */
+    size_t        hist_head, hist_count;
+    size_t        hist_bytes;       /* v1 frame bytes held */
+} local_room_t;
+
+/*
+ * One reactor per thread ("shard"). Everything except the inbox is owned by
+ * the reactor's thread and touched without locks.
+ */
+typedef struct {
+    int          id;
+    int          cpu;               /* CPU to pin to, or -1 */
+    pthread_t    thread;
+    int          epfd;
+    int          listen_fd;         /* this shard's SO_REUSEPORT listener */
+    int          wake_fd;           /* eventfd: inbox has mail or it is time to stop */
+    int          timer_fd;          /* timerfd: a flush window ends (FLUSH_WINDOW_US > 0) */
+    uint64_t     timer_deadline;    /* what timer_fd is armed for, monotonic ns */
+
+    uring_t      ring;              /* io_uring backend: replaces epfd */
+    int          accept_armed;      /* multishot accept outstanding */
+    int          sync_flush;        /* shutting down: write synchronously */
+    int          hold_flush;        /* batching a replay: only queue */
+
+    conn_t     **conns;             /* indexed by fd */
+    size_t       conns_cap;
+    conn_t     **joined;            /* dense array of joined connections, for fanout */
+    size_t       joined_count, joined_cap;
+    local_room_t *rooms;            /* indexed by room id, grown on demand */
+    size_t       rooms_cap;
+    conn_t      *closing;           /* teardown list, drained by reactor_reap() */
+    conn_t      *dirty_head, *dirty_tail;   /* unflushed conns, oldest first */
+    zc_orphan_t *orphans_head, *orphans_tail;   /* oldest first */
+
+    pthread_mutex_t inbox_mx;       /* protects inbox_head/inbox_tail only */
+    inbox_msg_t    *inbox_head, *inbox_tail;
+
+    int          report_seen;       /* last g_queue_report_gen this reactor answered */
+
+    /* coalescing statistics, reported on SIGUSR1 */
+    uint64_t     writes;            /* sendmsg calls / SENDMSG requests */
+    uint64_t     frames_written;    /* frames they completed */
+    uint64_t     flushes;           /* dirty connections flushed */
+    uint64_t     delay_sum_ns;      /* time from first queued frame to its flush */
+    uint64_t     delay_max_ns;
+
+    /* compression statistics, reported on SIGUSR1 */
+    uint64_t     deflate_tries;     /* broadcast frames over COMPRESS_THRESHOLD */
+    uint64_t     deflate_skipped;   /* ... that did not get smaller */
+    uint64_t     deflate_in, deflate_out;   /* bytes before / after (skipped: unchanged) */
+    uint64_t     deflate_ns;        /* CPU spent compressing */
+    uint64_t     deflate_sent;      /* compressed frames queued to peers */
+    uint64_t     deflate_saved;     /* bytes those saved on the wire */
+
+    uint64_t     replayed;          /* history messages replayed to joiners */
+} reactor_t;
+
+static reactor_t           *g_reactors;
+static int                  g_reactor_count;
+static volatile int        *g_stop_flag;
+static reactor_cfg_t        g_cfg;
+
+static msglog_t            *g_log;             /* LOG_DIR, NULL when not logging */
+
+static _Atomic int          g_v2_conns;         /* connections speaking wire protocol v2 */
+static _Atomic int          g_deflate_conns;    /* ... of which take compressed frames */
+static _Atomic uint32_t     g_next_sender_id = 1;
+
+/* Bumped by SIGUSR1; every reactor logs its per-client queue depths once per bump. */
+static volatile sig_atomic_t g_queue_report_gen;
+
+/*
+ * Raise the soft descriptor limit to the hard limit so one process can hold
+ * tens of thousands of idle connections.
+ */
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void on_sigusr1(int unused_signal) {
+    (void)unused_signal;
+    g_queue_report_gen++;
+}
+
+/*
+ * SIGUSR1 asks every reactor to log its per-client outbound queue depths.
+ * No SA_RESTART, so it interrupts epoll_wait() like Ctrl-C does.
+ */
+static void install_report_handler(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigusr1;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+static int reactor_uses_uring(void) {
+    return g_cfg.backend == REACTOR_IO_URING;
+}
+
+static int reactor_should_stop(void) {
+    return *g_stop_flag || g_shutdown_all;
+}
+
+static void reactor_wake(reactor_t *r) {
+    uint64_t one = 1;
+    ssize_t unused = write(r->wake_fd, &one, sizeof(one));
+    (void)unused;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static conn_t *conn_lookup(reactor_t *r, int fd) {
+    if (fd < 0 || (size_t)fd >= r->conns_cap) return NULL;
+    return r->conns[fd];
+}
+
+static void conn_mark_closing(reactor_t *r, conn_t *c) {
+    if (c->state == CONN_CLOSING) return;
+    c->state = CONN_CLOSING;
+    c->next_closing = r->closing;
+    r->closing = c;
+}
+
+/*
+ * Dirty list: connections with frames queued since their last flush, in the
+ * order they became dirty, so the ones whose flush window ran out are at the
+ * front.
+ */
+static void conn_mark_dirty(reactor_t *r, conn_t *c) {
+    if (c->dirty) return;
+    c->dirty       = 1;
+    c->dirty_since = now_ns();
+    c->dirty_prev  = r->dirty_tail;
+    c->dirty_next  = NULL;
+    if (r->dirty_tail) r->dirty_tail->dirty_next = c;
+    else               r->dirty_head = c;
+    r->dirty_tail = c;
+}
+
+static void conn_unmark_dirty(reactor_t *r, conn_t *c) {
+    if (!c->dirty) return;
+    if (c->dirty_prev) c->dirty_prev->dirty_next = c->dirty_next;
+    else               r->dirty_head = c->dirty_next;
+    if (c->dirty_next) c->dirty_next->dirty_prev = c->dirty_prev;
+    else               r->dirty_tail = c->dirty_prev;
+    c->dirty = 0;
+}
+
+/*
+ * conn_flush
+ * ----------
+ * Writes as much of the outbound queue as the socket accepts right now.
+ * With edge-triggered EPOLLOUT we get woken again once it drains.
+ * With io_uring a SENDMSG is queued instead (see conn_send_async()).
+ * Returns 0, or -1 on a socket error.
+ */
+static void conn_send_async(reactor_t *r, conn_t *c);
+
+static int conn_flush(reactor_t *r, conn_t *c) {
+    if (c->dirty) {
+        uint64_t delay = now_ns() - c->dirty_since;
+        r->flushes++;
+        r->delay_sum_ns += delay;
+        if (delay > r->delay_max_ns) r->delay_max_ns = delay;
+        conn_unmark_dirty(r, c);
+    }
+    c->unflushed = 0;
+
+    if (reactor_uses_uring() && !r->sync_flush) {
+        conn_send_async(r, c);
+        return 0;
+    }
+    /* The frames an in-flight async send points at must not be written twice. */
+    if (c->send_inflight) return 0;
+
+    uint64_t writes = c->outq.writes, frames = c->outq.frames_written;
+    int rc = outq_flush(&c->outq, c->fd);
+    r->writes         += c->outq.writes - writes;
+    r->frames_written += c->outq.frames_written - frames;
+    if (c->outq.count == 0) c->over_high_water = 0;
+    else                    metrics_record(METRICS_BACKLOG, c->outq.bytes);
+    return rc;
+}
+
+/*
+ * reactor_flush_dirty
+ * -------------------
+ * Flushes every dirty connection whose flush window has run out (all of them
+ * with FLUSH_WINDOW_US = 0 or `force`), then arms the timer for the next
+ * window to close.
+ */
+static void reactor_flush_dirty(reactor_t *r, int force) {
+    uint64_t window = (uint64_t)g_cfg.flush_window_us * 1000u;
+    uint64_t now    = (window && !force) ? now_ns() : 0;
+
+    while (r->dirty_head) {
+        conn_t *c = r->dirty_head;
+        if (window && !force && c->dirty_since + window > now) break;
+        if (conn_flush(r, c) != 0) conn_mark_closing(r, c);
+    }
+
+    if (r->dirty_head && r->timer_fd >= 0) {
+        uint64_t deadline = r->dirty_head->dirty_since + window;
+        if (deadline != r->timer_deadline) {
+            struct itimerspec when = {0};
+            when.it_value.tv_sec  = (time_t)(deadline / 1000000000u);
+            when.it_value.tv_nsec = (long)(deadline % 1000000000u);
+            timerfd_settime(r->timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+            r->timer_deadline = deadline;
+        }
+    }
+}
+
+/* The message type a pre-encoded frame carries. */
+static msg_type_t frame_type(const msg_frame_t *frame) {
+    if (frame->data[0] & MSG_V2_TAG) return (msg_type_t)(frame->data[0] & MSG_V2_TYPE_MASK);
+    uint32_t type;
+    memcpy(&type, frame->data + sizeof(uint32_t), sizeof(type));
+    return (msg_type_t)ntohl(type);
+}
+
+/*
+ * conn_queue_frame
+ * ----------------
+ * Appends a shared, pre-encoded frame to the connection's bounded outbound
+ * queue. Never blocks. The write is coalesced with whatever else the socket
+ * gets before the end of this loop iteration (or its FLUSH_WINDOW_US window),
+ * unless FLUSH_BYTES have piled up. If the queue would grow past
+ * OUTQ_HIGH_WATER bytes, the configured slow-consumer policy decides whether
+ * older frames make room, the new frame is dropped, or the client is cut off.
+ * A frame going into an empty queue is always accepted.
+ */
+static void conn_queue_frame(reactor_t *r, conn_t *c, msg_frame_t *frame) {
+    if (c->state == CONN_CLOSING) return;
+
+    size_t frame_len = frame->len;
+    outq_t *q = &c->outq;
+
+    /* Only frames the kernel has refused count as backlog: flush the rest first. */
+    if (c->dirty && q->bytes + frame_len > g_cfg.outq_high_water) {
+        if (conn_flush(r, c) != 0) {
+            conn_mark_closing(r, c);
+            return;
+        }
+    }
+
+    if (q->count && q->bytes + frame_len > g_cfg.outq_high_water) {
+        if (!c->over_high_water) {
+            c->over_high_water = 1;
+            errno = 0;
+            log_warn("client %s (fd %d) is slow: %zu frames / %zu bytes queued, applying %s",
+                     c->name[0] ? c->name : "(unjoined)", c->fd, q->count, q->bytes,
+                     outq_policy_name(g_cfg.outq_policy));
+        }
+        switch (g_cfg.outq_policy) {
+        case OUTQ_DISCONNECT:
+            metrics_slow_closed();
+            conn_mark_closing(r, c);
+            return;
+        case OUTQ_DROP_NEWEST:
+            if (frame->keep) break;
+            q->dropped++;
+            metrics_dropped(1);
+            return;
+        case OUTQ_DROP_OLDEST: {
+            uint64_t dropped = q->dropped;
+            while (q->count && q->bytes + frame_len > g_cfg.outq_high_water) {
+                if (outq_drop_oldest(q) != 0) break;
+            }
+            metrics_dropped(q->dropped - dropped);
+            break;
+        }
+        }
+    }
+
+    if (outq_push(q, frame) != 0) {
+        conn_mark_closing(r, c);
+        return;
+    }
+    if (g_metrics_on) metrics_sent(frame_type(frame), 1);
+
+    c->unflushed += frame_len;
+    if (!r->hold_flush && (r->sync_flush || c->unflushed >= g_cfg.flush_bytes)) {
+        if (conn_flush(r, c) != 0) conn_mark_closing(r, c);
+    } else {
+        conn_mark_dirty(r, c);
+    }
+}
+
+/*
+ * Logs the outbound queue of every client on this reactor (SIGUSR1).
+ */
+static void reactor_report_queues(reactor_t *r) {
+    log_info("[flush] reactor %d: %llu writes carried %llu frames (%.2f per write), "
+             "coalescing delay avg %.1f us, max %.1f us",
+             r->id, (unsigned long long)r->writes, (unsigned long long)r->frames_written,
+             r->writes ? (double)r->frames_written / (double)r->writes : 0.0,
+             r->flushes ? (double)r->delay_sum_ns / (double)r->flushes / 1000.0 : 0.0,
+             (double)r->delay_max_ns / 1000.0);
+    if (r->deflate_tries || r->deflate_sent) {
+        log_info("[compress] reactor %d: %llu of %llu frames compressed, %llu -> %llu bytes "
+                 "(ratio %.2f), %.1f us CPU (%.2f us per frame), %llu sends saved %llu bytes",
+                 r->id, (unsigned long long)(r->deflate_tries - r->deflate_skipped),
+                 (unsigned long long)r->deflate_tries, (unsigned long long)r->deflate_in,
+                 (unsigned long long)r->deflate_out,
+                 r->deflate_out ? (double)r->deflate_in / (double)r->deflate_out : 0.0,
+                 (double)r->deflate_ns / 1000.0,
+                 r->deflate_tries ? (double)r->deflate_ns / 1000.0 / (double)r->deflate_tries : 0.0,
+                 (unsigned long long)r->deflate_sent, (unsigned long long)r->deflate_saved);
+    }
+    if (g_cfg.history_depth) {
+        size_t rooms = 0, messages = 0, bytes = 0;
+        for (size_t i = 0; i < r->rooms_cap; i++) {
+            if (!r->rooms[i].hist_count) continue;
+            rooms++;
+            messages += r->rooms[i].hist_count;
+            bytes    += r->rooms[i].hist_bytes;
+        }
+        log_info("[history] reactor %d: %zu messages / %zu bytes held for %zu rooms, "
+                 "%llu replayed to joiners",
+                 r->id, messages, bytes, rooms, (unsigned long long)r->replayed);
+    }
+    for (size_t fd = 0; fd < r->conns_cap; fd++) {
+        conn_t *c = r->conns[fd];
+        if (!c) continue;
+        log_info("[queue] reactor %d fd %d %s: %zu frames / %zu bytes queued "
+                 "(peak %zu / %zu, %llu dropped)",
+                 r->id, c->fd, c->name[0] ? c->name : "(unjoined)",
+                 c->outq.count, c->outq.bytes, c->outq.peak_frames, c->outq.peak_bytes,
+                 (unsigned long long)c->outq.dropped);
+        if (c->outq.zc_sends) {
+            log_info("[queue] reactor %d fd %d: %llu zerocopy sends, %llu copied by the kernel, "
+                     "%zu awaiting completion",
+                     r->id, c->fd, (unsigned long long)c->outq.zc_sends,
+                     (unsigned long long)c->outq.zc_copied, c->outq.zc_count);
+        }
+    }
+}
+
+/*
+ * Joined-set bookkeeping: O(1) insert and swap-with-last removal.
+ */
+static int reactor_add_joined(reactor_t *r, conn_t *c) {
+    if (r->joined_count == r->joined_cap) {
+        size_t new_cap = r->joined_cap ? r->joined_cap * 2 : 64;
+        conn_t **grown = realloc(r->joined, new_cap * sizeof(*grown));
+        if (!grown) return -1;
+        r->joined     = grown;
+        r->joined_cap = new_cap;
+    }
+    c->joined_idx = r->joined_count;
+    r->joined[r->joined_count++] = c;
+    return 0;
+}
+
+static void reactor_remove_joined(reactor_t *r, conn_t *c) {
+    conn_t *last = r->joined[--r->joined_count];
+    r->joined[c->joined_idx] = last;
+    last->joined_idx = c->joined_idx;
+    c->joined_idx = NOT_JOINED;
+}
+
+static void history_free(local_room_t *lr);
+
+/*
+ * This reactor's state for room id `room` in generation `gen`, growing the
+ * table if needed. Whatever is left from an older room with that id is
+ * dropped first.
+ * Returns NULL for a room that has closed since (a message that was still on
+ * its way) or on allocation failure.
+ */
+static local_room_t *reactor_local_room(reactor_t *r, uint32_t room, uint64_t gen) {
+    if (room >= r->rooms_cap) {
+        size_t new_cap = r->rooms_cap ? r->rooms_cap : 16;
+        while (new_cap <= room) new_cap *= 2;
+        local_room_t *grown = realloc(r->rooms, new_cap * sizeof(*grown));
+        if (!grown) return NULL;
+        memset(grown + r->rooms_cap, 0, (new_cap - r->rooms_cap) * sizeof(*grown));
+        r->rooms     = grown;
+        r->rooms_cap = new_cap;
+    }
+    local_room_t *lr = &r->rooms[room];
+    if (gen < lr->gen || (gen == lr->gen && lr->closed)) return NULL;
+    if (gen > lr->gen) {
+        history_free(lr);
+        lr->gen    = gen;
+        lr->closed = 0;
+    }
+    return lr;
+}
+
+/*
+ * The room closed everywhere (no member is left on any reactor): release this
+ * reactor's member list and history for it.
+ */
+static void reactor_room_closed(reactor_t *r, uint32_t room, uint64_t gen) {
+    local_room_t *lr = reactor_local_room(r, room, gen);
+    if (!lr) return;
+    history_free(lr);
+    free(lr->members);
+    lr->members = NULL;
+    lr->cap     = 0;
+    lr->closed  = 1;
+}
+
+/*
+ * Per-room member lists, same scheme as joined[].
+ */
+static int reactor_room_add(reactor_t *r, conn_t *c, room_t *to) {
+    local_room_t *lr = reactor_local_room(r, membership_room_id(to), membership_room_gen(to));
+    if (!lr) return -1;
+    if (lr->count == lr->cap) {
+        size_t new_cap = lr->cap ? lr->cap * 2 : 8;
+        conn_t **grown = realloc(lr->members, new_cap * sizeof(*grown));
+        if (!grown) return -1;
+        lr->members = grown;
+        lr->cap     = new_cap;
+    }
+    c->room     = to;
+    c->room_idx = lr->count;
+    lr->members[lr->count++] = c;
+    return 0;
+}
+
+static void reactor_room_remove(reactor_t *r, conn_t *c) {
+    local_room_t *lr   = &r->rooms[membership_room_id(c->room)];
+    conn_t       *last = lr->members[--lr->count];
+    lr->members[c->room_idx] = last;
+    last->room_idx = c->room_idx;
+    c->room = NULL;
+}
+
+/*
+ * frame_set_init
+ * --------------
+ * Encodes a message for v1 recipients and, if any v2 client is connected, for
+ * v2 ones; with a sender_id the v2 frame refers to the sender by id. A v2
+ * frame of at least COMPRESS_THRESHOLD bytes is also compressed, once, if
+ * some client negotiated compression.
+ * Returns 0, or -1 if not even the v1 frame could be built.
+ */
+static int frame_set_init(reactor_t *r, frame_set_t *fs, msg_type_t type, const char *name,
+                          const char *text, uint32_t sender_id) {
+    memset(fs, 0, sizeof(*fs));
+    fs->type = type;
+    fs->trace_id = TRACE_CURRENT();
+    fs->v1   = msg_frame_new(type, name, text);
+    if (!fs->v1) return -1;
+    if (atomic_load_explicit(&g_v2_conns, memory_order_relaxed) == 0) return 0;
+
+    if (sender_id && name) {
+        fs->v2_sender = msg_frame_new_v2(MSG_SENDER_ID, name, NULL, sender_id);
+        fs->sender_id = fs->v2_sender ? sender_id : 0;
+    }
+    fs->v2 = msg_frame_new_v2(type, name, text, fs->sender_id);
+
+    if (fs->v2 && g_cfg.compress_threshold && fs->v2->len >= g_cfg.compress_threshold &&
+        atomic_load_explicit(&g_deflate_conns, memory_order_relaxed) > 0) {
+        uint64_t start = now_ns();
+        fs->v2z = msg_frame_deflate(fs->v2);
+        r->deflate_ns += now_ns() - start;
+        r->deflate_tries++;
+        r->deflate_in  += fs->v2->len;
+        r->deflate_out += fs->v2z ? fs->v2z->len : fs->v2->len;
+        if (!fs->v2z) r->deflate_skipped++;
+    }
+    return 0;
+}
+
+static void frame_set_ref(frame_set_t *dst, const frame_set_t *src) {
+    *dst = *src;
+    msg_frame_ref(dst->v1);
+    if (dst->v2)        msg_frame_ref(dst->v2);
+    if (dst->v2z)       msg_frame_ref(dst->v2z);
+    if (dst->v2_sender) msg_frame_ref(dst->v2_sender);
+}
+
+static void frame_set_release(frame_set_t *fs) {
+    msg_frame_unref(fs->v1);
+    if (fs->v2)        msg_frame_unref(fs->v2);
+    if (fs->v2z)       msg_frame_unref(fs->v2z);
+    if (fs->v2_sender) msg_frame_unref(fs->v2_sender);
+}
+
+/*
+ * Per-connection set of the sender ids a v2 peer already knows (linear
+ * probing on the id, at most half full).
+ */
+static size_t known_slot(const conn_t *c, uint32_t id) {
+    size_t i = ((size_t)id * 0x9e3779b9u) & (c->known_slots - 1);
+    while (c->known_senders[i] && c->known_senders[i] != id) i = (i + 1) & (c->known_slots - 1);
+    return i;
+}
+
+static int conn_knows_sender(const conn_t *c, uint32_t id) {
+    return c->known_count && c->known_senders[known_slot(c, id)] == id;
+}
+
+static int conn_learn_sender(conn_t *c, uint32_t id) {
+    if ((c->known_count + 1) * 2 > c->known_slots) {
+        size_t    slots = c->known_slots ? c->known_slots * 2 : 16;
+        uint32_t *grown = pool_alloc(slots * sizeof(*grown));
+        if (!grown) return -1;
+        memset(grown, 0, slots * sizeof(*grown));
+
+        uint32_t *old = c->known_senders;
+        size_t old_slots = c->known_slots;
+        c->known_senders = grown;
+        c->known_slots   = slots;
+        for (size_t i = 0; i < old_slots; i++)
+            if (old[i]) c->known_senders[known_slot(c, old[i])] = old[i];
+        pool_free(old);
+    }
+    c->known_senders[known_slot(c, id)] = id;
+    c->known_count++;
+    return 0;
+}
+
+/*
+ * Queues the encoding of `fs` this connection speaks. A v2 peer is told who a
+ * sender id stands for the first time it sees it; that frame is never dropped
+ * by the slow-consumer policy, so everything after it stays decodable.
+ */
+static void conn_queue_set(reactor_t *r, conn_t *c, const frame_set_t *fs) {
+    if (c->wire_version < 2 || !fs->v2) {
+        conn_queue_frame(r, c, fs->v1);
+        return;
+    }
+    if (fs->sender_id && !conn_knows_sender(c, fs->sender_id)) {
+        if (conn_learn_sender(c, fs->sender_id) != 0) {
+            conn_queue_frame(r, c, fs->v1);
+            return;
+        }
+        conn_queue_frame(r, c, fs->v2_sender);
+    }
+    if (c->deflate && fs->v2z) {
+        r->deflate_sent++;
+        r->deflate_saved += fs->v2->len - fs->v2z->len;
+        conn_queue_frame(r, c, fs->v2z);
+    } else {
+        conn_queue_frame(r, c, fs->v2);
+    }
+}
+
+/*
+ * Drops the oldest message of a room's history.
+ */
+static void history_evict(local_room_t *lr) {
+    frame_set_t *oldest = &lr->history[lr->hist_head];
+    lr->hist_bytes -= oldest->v1->len;
+    frame_set_release(oldest);
+    lr->hist_head = (lr->hist_head + 1) % g_cfg.history_depth;
+    lr->hist_count--;
+}
+
+/*
+ * history_append
+ * --------------
+ * Keeps one more reference to a DELIVER in the room's history, evicting the
+ * oldest messages to stay within HISTORY_DEPTH and HISTORY_BYTES. A message
+ * larger than the whole byte budget is not kept.
+ */
+static void history_append(local_room_t *lr, const frame_set_t *fs) {
+    if (!g_cfg.history_depth || fs->v1->len > g_cfg.history_bytes) return;
+    if (!lr->history) {
+        lr->history = calloc(g_cfg.history_depth, sizeof(*lr->history));
+        if (!lr->history) return;
+    }
+
+    if (lr->hist_count == g_cfg.history_depth) history_evict(lr);
+    while (lr->hist_count && lr->hist_bytes + fs->v1->len > g_cfg.history_bytes) history_evict(lr);
+
+    size_t slot = (lr->hist_head + lr->hist_count) % g_cfg.history_depth;
+    frame_set_ref(&lr->history[slot], fs);
+    lr->hist_count++;
+    lr->hist_bytes += fs->v1->len;
+}
+
+/*
+ * history_replay
+ * --------------
+ * Queues the room's history, oldest first, to a connection that just entered
+ * it and writes it out as one burst rather than one send per message.
+ */
+static void history_replay(reactor_t *r, conn_t *c, uint32_t room) {
+    if (room >= r->rooms_cap || !r->rooms[room].hist_count) return;
+    local_room_t *lr = &r->rooms[room];
+
+    r->hold_flush = 1;
+    for (size_t i = 0; i < lr->hist_count; i++)
+        conn_queue_set(r, c, &lr->history[(lr->hist_head + i) % g_cfg.history_depth]);
+    r->hold_flush = 0;
+    r->replayed += lr->hist_count;
+
+    if (c->dirty && conn_flush(r, c) != 0) conn_mark_closing(r, c);
+}
+
+static void history_free(local_room_t *lr) {
+    while (lr->hist_count) history_evict(lr);
+    free(lr->history);
+    lr->history = NULL;
+}
+
+/*
+ * Queues a shared message to every connection owned by this reactor that is
+ * in room `room` of generation `gen` (every joined one for ROOM_ALL),
+ * remembering DELIVERs in the room's history.
+ */
+static void fanout_local(reactor_t *r, const conn_t *except, uint32_t room, uint64_t gen,
+                         const frame_set_t *fs) {
+    conn_t **dests;
+    size_t   count;
+
+    if (room == ROOM_ALL) {
+        dests = r->joined;
+        count = r->joined_count;
+    } else {
+        local_room_t *lr = reactor_local_room(r, room, gen);
+        if (!lr) return;
+        if (fs->type == MSG_DELIVER) history_append(lr, fs);
+        dests = lr->members;
+        count = lr->count;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        conn_t *dest = dests[i];
+        if (dest != except) conn_queue_set(r, dest, fs);
+    }
+}
+
+/*
+ * Queues a direct message to this reactor's connection on `fd`, if it is
+ * still joined as `to` (it may have gone away since the sender looked it up,
+ * and its fd gone to someone else).
+ */
+static void deliver_direct(reactor_t *r, int fd, const char *to, const frame_set_t *fs) {
+    conn_t *dest = conn_lookup(r, fd);
+    if (dest && dest->state == CONN_JOINED && strcmp(dest->name, to) == 0) conn_queue_set(r, dest, fs);
+}
+
+/*
+ * inbox_post
+ * ----------
+ * Hands a message (one more reference to its frames) to another reactor, for
+ * fanout to room `room` of generation `gen` or, if fd >= 0, for that one
+ * connection if it is still `to`. With fd == INBOX_ROOM_CLOSED, `fs` is NULL.
+ * Only the first message into an empty inbox pays for the eventfd wakeup;
+ * later ones ride along.
+ */
+static void inbox_post(reactor_t *dest, uint32_t room, uint64_t gen, int fd, const char *to,
+                       const frame_set_t *fs) {
+    inbox_msg_t *m = pool_alloc(sizeof(*m));
+    if (!m) return;
+    m->next  = NULL;
+    if (fs) frame_set_ref(&m->frames, fs);
+    else    memset(&m->frames, 0, sizeof(m->frames));
+    m->room  = room;
+    m->room_gen = gen;
+    m->fd    = fd;
+    snprintf(m->to, sizeof(m->to), "%s", to ? to : "");
+
+    pthread_mutex_lock(&dest->inbox_mx);
+    int was_empty = (dest->inbox_head == NULL);
+    if (dest->inbox_tail) dest->inbox_tail->next = m;
+    else                  dest->inbox_head = m;
+    dest->inbox_tail = m;
+    pthread_mutex_unlock(&dest->inbox_mx);
+
+    if (was_empty) reactor_wake(dest);
+}
+
+/*
+ * Drains this reactor's inbox and fans every message out locally.
+ */
+static void inbox_drain(reactor_t *r) {
+    uint64_t wakeups;
+    ssize_t unused = read(r->wake_fd, &wakeups, sizeof(wakeups));
+    (void)unused;
+
+    pthread_mutex_lock(&r->inbox_mx);
+    inbox_msg_t *m = r->inbox_head;
+    r->inbox_head = r->inbox_tail = NULL;
+    pthread_mutex_unlock(&r->inbox_mx);
+
+    while (m) {
+        inbox_msg_t *next = m->next;
+        TRACE_SET_CURRENT(m->frames.trace_id);
+        TRACE_BEGIN(span);
+        if (m->fd >= 0)                      deliver_direct(r, m->fd, m->to, &m->frames);
+        else if (m->fd == INBOX_ROOM_CLOSED) reactor_room_closed(r, m->room, m->room_gen);
+        else                                 fanout_local(r, NULL, m->room, m->room_gen, &m->frames);
+        TRACE_END(span, "inbox_fanout", m->frames.trace_id, TRACE_FLOW_STEP, m->room);
+        frame_set_release(&m->frames);
+        pool_free(m);
+        m = next;
+    }
+    TRACE_SET_CURRENT(0);
+}
+
+/*
+ * The flush window timer fired; the flush itself happens at the end of the
+ * loop iteration.
+ */
+static void reactor_on_timer(reactor_t *r) {
+    uint64_t expirations;
+    ssize_t unused = read(r->timer_fd, &expirations, sizeof(expirations));
+    (void)unused;
+    r->timer_deadline = 0;
+}
+
+/*
+ * reactor_broadcast
+ * -----------------
+ * Sends an indication to every client in `room` (ROOM_ALL: every joined client
+ * in the server) except `except`: this reactor's own clients directly,
+ * everybody else via their reactor's inbox. Each encoding is built exactly once and shared by all recipients;
+ * it is freed when the last queue has finished writing it. A non-zero
+ * sender_id lets v2 recipients get the name as an interned id.
+ * No global lock is taken on this path.
+ */
+static void reactor_broadcast(reactor_t *r, const conn_t *except, uint32_t room, uint64_t gen,
+                              msg_type_t type, const char *name, const char *text, uint32_t sender_id) {
+    frame_set_t fs;
+    if (frame_set_init(r, &fs, type, name, text, sender_id) != 0) return;
+
+    TRACE_BEGIN(span);
+    fanout_local(r, except, room, gen, &fs);
+    TRACE_END(span, "fanout_local", fs.trace_id, TRACE_FLOW_STEP, room);
+    for (int i = 0; i < g_reactor_count; i++) {
+        if (&g_reactors[i] != r) inbox_post(&g_reactors[i], room, gen, -1, NULL, &fs);
+    }
+    frame_set_release(&fs);
+}
+
+/*
+ * membership hook: a room closed (its last member left, on whichever reactor).
+ * Every reactor, this one included, drops its state for it from its inbox.
+ */
+static void reactor_on_room_closed(uint32_t room, uint64_t gen) {
+    if (reactor_should_stop()) return;
+    for (int i = 0; i < g_reactor_count; i++)
+        inbox_post(&g_reactors[i], room, gen, INBOX_ROOM_CLOSED, NULL, NULL);
+}
+
+/*
+ * Sends MSG_ERROR back to the client whose request failed.
+ */
+static void conn_send_error(reactor_t *r, conn_t *c, const char *reason) {
+    msg_frame_t *frame = msg_frame_new(MSG_ERROR, NULL, reason);
+    if (!frame) return;
+    conn_queue_frame(r, c, frame);
+    msg_frame_unref(frame);
+}
+
+#define HISTORY_REPLY_DEFAULT 20         /* log entries a bare HISTORY request returns */
+#define HISTORY_REPLY_MAX     1000       /* most log entries one HISTORY request returns */
+#define HISTORY_SCAN_MAX      16384      /* most log records one request may look at (per pass) */
+#define HISTORY_REBUILD_MAX   65536      /* newest log records that refill the rings at startup */
+
+typedef struct {
+    reactor_t  *r;
+    conn_t     *c;
+    const char *room;
+    size_t      room_len;
+    size_t      left;               /* entries still wanted */
+} history_req_t;
+
+/*
+ * Sends one logged note of the requester's room, copied straight from the
+ * mapped segment into its frame.
+ */
+static int history_visit(void *arg, const msglog_entry_t *e) {
+    history_req_t *q = arg;
+    if (e->room_len != q->room_len || memcmp(e->room, q->room, e->room_len) != 0) return 0;
+
+    char name[sizeof(q->c->name)];
+    snprintf(name, sizeof(name), "%.*s", (int)e->name_len, e->name);
+    size_t cap  = e->text_len + 48;
+    char  *text = pool_alloc(cap);
+    if (!text) return 1;
+    snprintf(text, cap, "%" PRIu64 " %" PRIu64 " %.*s",
+             e->seq, e->time_ms / 1000, (int)e->text_len, e->text);
+
+    msg_frame_t *frame = msg_frame_new(MSG_HISTORY_ENTRY, name, text);
+    pool_free(text);
+    if (frame) {
+        conn_queue_frame(q->r, q->c, frame);
+        msg_frame_unref(frame);
+    }
+    return --q->left == 0;
+}
+
+typedef struct {
+    const char *room;
+    size_t      room_len;
+    uint64_t    until;              /* last seq of the window being scanned */
+    uint64_t   *ring;               /* seqs of the newest `need` matches in it */
+    size_t      need, matches;
+} history_find_t;
+
+static int history_find_visit(void *arg, const msglog_entry_t *e) {
+    history_find_t *f = arg;
+    if (e->seq > f->until) return 1;
+    if (e->room_len == f->room_len && memcmp(e->room, f->room, e->room_len) == 0)
+        f->ring[f->matches++ % f->need] = e->seq;
+    return 0;
+}
+
+/*
+ * Seq of the oldest of the newest `count` notes of `room`, for a HISTORY
+ * without a start: walks back from the end of the log in growing windows,
+ * looking at no more than HISTORY_SCAN_MAX records. With fewer matches in
+ * reach, the oldest one found; 0 if there is none.
+ */
+static uint64_t history_newest_from(const char *room, size_t count) {
+    uint64_t ring[HISTORY_REPLY_MAX];
+    history_find_t f = { room, strlen(room), 0, ring, count, 0 };
+    uint64_t hi = msglog_last_seq(g_log), oldest = 0;
+    size_t   budget = HISTORY_SCAN_MAX, window = 1024;
+
+    while (hi >= 1 && budget) {
+        size_t   span = window < budget ? window : budget;
+        uint64_t lo   = hi > span ? hi - span + 1 : 1;
+        f.until   = hi;
+        f.matches = 0;
+        budget -= msglog_scan(g_log, lo, (size_t)(hi - lo + 1), history_find_visit, &f);
+        if (f.matches >= f.need) return ring[f.matches % f.need];
+        if (f.matches) oldest = ring[0];        /* not wrapped: ring[0] is the oldest */
+        f.need -= f.matches;
+        hi = lo - 1;
+        window *= 2;
+    }
+    return oldest;
+}
+
+/*
+ * conn_send_history
+ * -----------------
+ * Answers MSG_HISTORY from the persistent log: up to `count` notes of the
+ * client's current room from seq `first_seq` (or from the first one logged at
+ * or after `@unix_time`; by default the room's newest ones), written as one
+ * burst. A count that is zero or not a number is refused with MSG_ERROR; one
+ * over HISTORY_REPLY_MAX is capped. Each pass over the log is bounded by
+ * HISTORY_SCAN_MAX records, since it runs on the reactor thread.
+ */
+static void conn_send_history(reactor_t *r, conn_t *c, const char *text) {
+    if (!g_log) {
+        conn_send_error(r, c, "history log is disabled");
+        return;
+    }
+    const char *p = text ? text : "";
+    char *end;
+    uint64_t from  = 0;
+    unsigned long count = HISTORY_REPLY_DEFAULT;
+
+    while (*p == ' ') p++;
+    if (*p == '@') {
+        from = msglog_seq_at(g_log, strtoull(p + 1, &end, 10) * 1000u);
+        p = end;
+    } else if (*p >= '0' && *p <= '9') {
+        from = strtoull(p, &end, 10);
+        p = end;
+    }
+    while (*p == ' ') p++;
+    if (*p) {
+        end   = (char *)p;
+        count = (*p >= '0' && *p <= '9') ? strtoul(p, &end, 10) : 0;
+        while (*end == ' ') end++;
+        if (count == 0 || *end) {
+            conn_send_error(r, c, "usage: HISTORY [seq | @unix_time] [count > 0]");
+            return;
+        }
+        if (count > HISTORY_REPLY_MAX) count = HISTORY_REPLY_MAX;
+    }
+
+    const char *room = membership_room_name(c->room);
+    if (from == 0 && (from = history_newest_from(room, count)) == 0) {
+        conn_send_error(r, c, "no logged history in that range");
+        return;
+    }
+    history_req_t q = { r, c, room, strlen(room), count };
+    r->hold_flush = 1;
+    msglog_scan(g_log, from, HISTORY_SCAN_MAX, history_visit, &q);
+    r->hold_flush = 0;
+
+    if (q.left == count) conn_send_error(r, c, "no logged history in that range");
+    else if (c->dirty && conn_flush(r, c) != 0) conn_mark_closing(r, c);
+}
+
+/*
+ * Refills the lobby's history ring on every reactor from one logged note
+ * (startup, before the reactor threads run). Other rooms only exist while
+ * they have members, so nobody is in them yet; HISTORY reads their notes
+ * from the log.
+ */
+static int history_rebuild_visit(void *arg, const msglog_entry_t *e) {
+    room_t *lobby = arg;
+    if (e->room_len != strlen(ROOM_LOBBY) || memcmp(e->room, ROOM_LOBBY, e->room_len) != 0) return 0;
+
+    char name[64];
+    snprintf(name, sizeof(name), "%.*s", (int)e->name_len, e->name);
+    char *text = pool_strndup(e->text, e->text_len);
+    if (!text) return 0;
+
+    frame_set_t fs;
+    if (frame_set_init(&g_reactors[0], &fs, MSG_DELIVER, name, text, 0) == 0) {
+        for (int i = 0; i < g_reactor_count; i++) {
+            local_room_t *lr = reactor_local_room(&g_reactors[i], membership_room_id(lobby),
+                                                  membership_room_gen(lobby));
+            if (lr) history_append(lr, &fs);
+        }
+        frame_set_release(&fs);
+    }
+    pool_free(text);
+    return 0;
+}
+
+/*
+ * The client asked for wire protocol v2 in its JOIN: acknowledge (in v1, so
+ * any client can read it) with the features we accept, and send it v2 frames
+ * from now on, compressed ones too if it offered that and it is enabled.
+ */
+static void conn_upgrade_v2(reactor_t *r, conn_t *c, const char *features) {
+    int deflate = g_cfg.compress_threshold && msg_proto_has(features, MSG_PROTO_DEFLATE);
+    msg_frame_t *ack = msg_frame_new(MSG_PROTO_ACK, NULL,
+                                     deflate ? MSG_PROTO_V2 " " MSG_PROTO_DEFLATE : MSG_PROTO_V2);
+    if (!ack) return;
+    conn_queue_frame(r, c, ack);
+    msg_frame_unref(ack);
+    c->wire_version = 2;
+    atomic_fetch_add(&g_v2_conns, 1);
+    if (deflate) {
+        c->deflate = 1;
+        atomic_fetch_add(&g_deflate_conns, 1);
+    }
+}
+
+/*
+ * reactor_direct
+ * --------------
+ * Delivers a private message to the member called `to`, wherever it lives:
+ * the name index gives its socket and owning reactor, so the frame goes to
+ * exactly one connection (via that reactor's inbox if it is not ours).
+ */
+static void reactor_direct(reactor_t *r, conn_t *from, const char *to, const char *text) {
+    int target_sock, target_shard;
+    if (membership_find(to, &target_sock, &target_shard) != 0 ||
+        target_shard < 0 || target_shard >= g_reactor_count) {
+        char reason[96];
+        snprintf(reason, sizeof(reason), "no such user: %.63s", to);
+        conn_send_error(r, from, reason);
+        return;
+    }
+
+    frame_set_t fs;
+    if (frame_set_init(r, &fs, MSG_DIRECT_DELIVER, from->name, text, from->sender_id) != 0) return;
+    if (target_shard == r->id) deliver_direct(r, target_sock, to, &fs);
+    else                       inbox_post(&g_reactors[target_shard], ROOM_ALL, 0, target_sock, to, &fs);
+    frame_set_release(&fs);
+}
+
+/*
+ * conn_handle_frame
+ * -----------------
+ * Applies one decoded client message to the connection's state machine.
+ * Mirrors the protocol handling in talk_to_client().
+ */
+static void conn_handle_frame(reactor_t *r, conn_t *c, msg_type_t type, const char *name, const char *text) {
+    switch (type) {
+
+    case MSG_JOIN:
+        /* g_clients is only consulted here, to keep names unique server-wide. */
+        if (c->state == CONN_AWAIT_JOIN && name && *name) {
+            debug("JOIN from %s\n", name);
+            if (membership_join(c->fd, r->id, name, NULL, NULL) == 0) {
+                c->registered = 1;
+                snprintf(c->name, sizeof(c->name), "%s", name);
+                if (reactor_add_joined(r, c) != 0) { conn_mark_closing(r, c); break; }
+                room_t *lobby = membership_lobby();
+                if (!lobby || reactor_room_add(r, c, lobby) != 0) {
+                    conn_mark_closing(r, c);
+                    break;
+                }
+                c->state = CONN_JOINED;
+                c->sender_id = atomic_fetch_add(&g_next_sender_id, 1);
+                if (msg_proto_has(text, MSG_PROTO_V2)) conn_upgrade_v2(r, c, text);
+                reactor_broadcast(r, c, ROOM_ALL, 0, MSG_JOINING, c->name, NULL, 0);
+                history_replay(r, c, membership_room_id(c->room));
+            }
+        }
+        break;
+
+    case MSG_NOTE:
+        if (c->state == CONN_JOINED && text) {
+            debug("NOTE from %s: %s\n", c->name, text);
+            uint64_t trace_id = TRACE_ID_NEXT();
+            TRACE_SET_CURRENT(trace_id);
+            TRACE_BEGIN(span);
+            uint64_t fanout = metrics_begin();
+            reactor_broadcast(r, c, membership_room_id(c->room), membership_room_gen(c->room),
+                              MSG_DELIVER, c->name, text, c->sender_id);
+            metrics_end(METRICS_FANOUT, fanout);
+            if (g_log) msglog_append(g_log, membership_room_name(c->room), c->name, text);
+            TRACE_END(span, "note", trace_id, TRACE_FLOW_START, (uint32_t)c->fd);
+            TRACE_SET_CURRENT(0);
+        }
+        break;
+
+    case MSG_ROOM_JOIN:
+    case MSG_ROOM_LEAVE:
+        if (c->state == CONN_JOINED) {
+            /* The old room closes in the move if we were its last member: note it first. */
+            uint32_t from_id  = membership_room_id(c->room);
+            uint64_t from_gen = membership_room_gen(c->room);
+            char     from_name[ROOM_NAME_MAX + 1];
+            snprintf(from_name, sizeof(from_name), "%s", membership_room_name(c->room));
+
+            room_t *to;
+            int moved = membership_room_move(c->fd, type == MSG_ROOM_JOIN ? text : ROOM_LOBBY,
+                                             &to, NULL, NULL);
+            if (moved == -2) {
+                conn_send_error(r, c, "invalid room name or too many rooms");
+                break;
+            }
+            if (moved != 0) break;
+
+            reactor_room_remove(r, c);
+            if (reactor_room_add(r, c, to) != 0) {
+                conn_mark_closing(r, c);
+                break;
+            }
+            reactor_broadcast(r, NULL, from_id, from_gen, MSG_ROOM_EXITED, c->name, from_name, 0);
+            reactor_broadcast(r, NULL, membership_room_id(to), membership_room_gen(to),
+                              MSG_ROOM_ENTERED, c->name, membership_room_name(to), 0);
+            history_replay(r, c, membership_room_id(to));
+        }
+        break;
+
+    case MSG_DIRECT:
+        if (c->state == CONN_JOINED && name && text) {
+            debug("DIRECT from %s to %s\n", c->name, name);
+            reactor_direct(r, c, name, text);
+        }
+        break;
+
+    case MSG_HISTORY:
+        if (c->state == CONN_JOINED) conn_send_history(r, c, text);
+        break;
+
+    case MSG_ROOM_LIST:
+        if (c->state == CONN_JOINED) {
+            char *list = membership_room_list();
+            msg_frame_t *reply = list ? msg_frame_new(MSG_ROOM_LIST_REPLY, NULL, list) : NULL;
+            if (reply) conn_queue_frame(r, c, reply);
+            msg_frame_unref(reply);
+            pool_scratch_reset();
+        }
+        break;
+
+    case MSG_LEAVE:
+    case MSG_SHUTDOWN:
+        /* MSG_LEFT is broadcast by reactor_reap() once the connection is torn down. */
+        debug("LEAVE/SHUTDOWN from %s\n", c->registered ? c->name : "(unknown)");
+        conn_mark_closing(r, c);
+        break;
+
+    case MSG_SHUTDOWN_ALL:
+        if (c->state == CONN_JOINED) {
+            /* Set the flag first: the inbox posts below are what wake the other reactors. */
+            g_shutdown_all = 1;
+            reactor_broadcast(r, NULL, ROOM_ALL, 0, MSG_BYE, NULL, "Server shutting down", 0);
+        }
+        conn_mark_closing(r, c);
+        break;
+
+    default:
+        /* Unknown / unsupported message type: ignore. */
+        break;
+    }
+}
+
+/*
+ * Handles every complete frame currently buffered in the connection's reader.
+ * Returns -1 on a malformed frame.
+ */
+static int conn_parse_frames(reactor_t *r, conn_t *c) {
+    while (c->state != CONN_CLOSING) {
+        msg_type_t type;
+        char *name = NULL;
+        char *text = NULL;
+
+        uint64_t decode = metrics_begin();
+        TRACE_BEGIN(span);
+        int parsed = msg_reader_next(&c->reader, &type, &name, &text);
+        if (parsed == 0) break;
+        if (parsed < 0) {
+            debug("client socket %d sent a bad frame\n", c->fd);
+            return -1;
+        }
+        metrics_end(METRICS_DECODE, decode);
+        TRACE_END(span, "msg_decode", 0, TRACE_FLOW_NONE, (uint32_t)c->fd);
+        metrics_received(type);
+
+        conn_handle_frame(r, c, type, name, text);
+        msg_free(name, text);
+    }
+    return 0;
+}
+
+/*
+ * conn_on_readable
+ * ----------------
+ * Edge-triggered: drain the socket until EAGAIN. Each recv() is as large as
+ * the reader's free space, and every complete frame it brought in is handled
+ * before the next one, so under load one syscall carries many messages.
+ * Returns -1 when the connection should be closed.
+ */
+static int conn_on_readable(reactor_t *r, conn_t *c) {
+    while (c->state != CONN_CLOSING) {
+        ssize_t recvd = msg_reader_fill(&c->reader);
+        if (recvd > 0) {
+            metrics_bytes_in((uint64_t)recvd);
+            if (conn_parse_frames(r, c) != 0) return -1;
+            continue;
+        }
+        if (recvd == 0) {
+            debug("client socket %d closed\n", c->fd);
+            return -1;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* Drained: give the buffer back unless a partial frame is pending. */
+            msg_reader_trim(&c->reader);
+            return 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void conn_free(conn_t *c) {
+    if (c->wire_version == 2) atomic_fetch_sub(&g_v2_conns, 1);
+    if (c->deflate)           atomic_fetch_sub(&g_deflate_conns, 1);
+    pool_free(c->known_senders);
+    msg_reader_free(&c->reader);
+    outq_free(&c->outq);
+    pool_free(c->send_iov);
+    free(c);
+}
+
+/*
+ * reactor_register
+ * ----------------
+ * Wraps an accepted (already non-blocking) socket in a conn_t and adds it to
+ * epoll. EPOLLOUT is registered up front: with EPOLLET it only fires when the
+ * socket goes from full to writable, so no epoll_ctl(MOD) calls are needed.
+ * With io_uring a multishot receive is armed instead.
+ */
+static int reactor_register(reactor_t *r, int fd) {
+    if ((size_t)fd >= r->conns_cap) {
+        size_t new_cap = r->conns_cap ? r->conns_cap : 1024;
+        while (new_cap <= (size_t)fd) new_cap *= 2;
+        conn_t **grown = realloc(r->conns, new_cap * sizeof(*grown));
+        if (!grown) return -1;
+        memset(grown + r->conns_cap, 0, (new_cap - r->conns_cap) * sizeof(*grown));
+        r->conns     = grown;
+        r->conns_cap = new_cap;
+    }
+
+    conn_t *c = calloc(1, sizeof(*c));
+    if (!c) return -1;
+    c->fd         = fd;
+    c->state      = CONN_AWAIT_JOIN;
+    c->joined_idx = NOT_JOINED;
+    c->wire_version = 1;
+    msg_reader_init(&c->reader, fd);
+    c->reader.from_client = 1;
+    if (g_cfg.zerocopy_threshold && !reactor_uses_uring() &&
+        outq_enable_zerocopy(&c->outq, fd, g_cfg.zerocopy_threshold) != 0)
+        debug("SO_ZEROCOPY refused on socket %d, copying\n", fd);
+
+    if (reactor_uses_uring()) {
+        if (uring_recv_multishot(&r->ring, fd, (uintptr_t)c | UD_OP_RECV) != 0) {
+            free(c);
+            return -1;
+        }
+        c->uring_ops++;
+        r->conns[fd] = c;
+        return 0;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events  = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        free(c);
+        return -1;
+    }
+
+    r->conns[fd] = c;
+    return 0;
+}
+
+/*
+ * Accepts every pending connection (the listening socket is edge-triggered too).
+ */
+static void reactor_accept(reactor_t *r) {
+    for (;;) {
+        int client_socket = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_err("accept failed");
+            return;
+        }
+        /* Frames leave in one write each, so Nagle would only add latency. */
+        TRACE_BEGIN(span);
+        int nodelay = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        if (reactor_register(r, client_socket) != 0) {
+            log_err("could not register client socket %d", client_socket);
+            close(client_socket);
+        }
+        TRACE_END(span, "accept", 0, TRACE_FLOW_NONE, (uint32_t)client_socket);
+    }
+}
+
+/*
+ * conn_send_async
+ * ---------------
+ * Hands the head of the outbound queue (up to URING_SEND_IOV frames) to the
+ * ring as one SENDMSG. Only one is in flight per connection, so frames go out
+ * in order; the queued frames stay referenced (pinned) until it completes.
+ * Frames queued meanwhile go out together in the next one. The SQE reaches
+ * the kernel with everything else queued this loop iteration.
+ */
+static void conn_send_async(reactor_t *r, conn_t *c) {
+    if (c->send_inflight || c->outq.count == 0) return;
+    if (!c->send_iov) {
+        c->send_iov = pool_alloc(URING_SEND_IOV * sizeof(*c->send_iov));
+        if (!c->send_iov) { conn_mark_closing(r, c); return; }
+    }
+
+    size_t bytes;
+    int n = outq_fill_iov(&c->outq, c->send_iov, URING_SEND_IOV, &bytes);
+    memset(&c->send_msg, 0, sizeof(c->send_msg));
+    c->send_msg.msg_iov    = c->send_iov;
+    c->send_msg.msg_iovlen = (size_t)n;
+    if (uring_sendmsg(&r->ring, c->fd, &c->send_msg, (uintptr_t)c | UD_OP_SEND) != 0) {
+        conn_mark_closing(r, c);
+        return;
+    }
+    c->outq.pinned   = (size_t)n;
+    c->send_inflight = 1;
+    c->uring_ops++;
+    c->outq.writes++;
+    r->writes++;
+}
+
+/* Frees a reaped connection once the ring has nothing left that refers to it. */
+static void conn_release_if_done(conn_t *c) {
+    if (c->reaped && !c->uring_ops) conn_free(c);
+}
+
+/*
+ * conn_on_recv
+ * ------------
+ * One multishot receive completion: copy the bytes out of the provided buffer
+ * (which goes straight back to the kernel) and handle every complete frame.
+ * The request is re-armed if the kernel ended it, e.g. because the buffer
+ * ring ran dry (-ENOBUFS).
+ */
+static void conn_on_recv(reactor_t *r, conn_t *c, int res, unsigned flags) {
+    int more = (flags & IORING_CQE_F_MORE) != 0;
+    if (!more) c->uring_ops--;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && c->state != CONN_CLOSING && !c->reaped) {
+            metrics_bytes_in((uint64_t)res);
+            if (msg_reader_feed(&c->reader, uring_buf(&r->ring, bid), (size_t)res) != 0)
+                conn_mark_closing(r, c);
+        }
+        uring_buf_recycle(&r->ring, bid);
+    }
+    if (c->reaped || c->state == CONN_CLOSING) return;
+
+    if (res > 0) {
+        if (conn_parse_frames(r, c) != 0) conn_mark_closing(r, c);
+        else                              msg_reader_trim(&c->reader);
+    } else if (res == 0) {
+        debug("client socket %d closed\n", c->fd);
+        conn_mark_closing(r, c);
+    } else if (res != -ENOBUFS) {
+        conn_mark_closing(r, c);
+    }
+
+    if (!more && c->state != CONN_CLOSING) {
+        if (uring_recv_multishot(&r->ring, c->fd, (uintptr_t)c | UD_OP_RECV) != 0)
+            conn_mark_closing(r, c);
+        else
+            c->uring_ops++;
+    }
+}
+
+/*
+ * conn_on_sent
+ * ------------
+ * SENDMSG completion: retire what the kernel took and send the rest.
+ */
+static void conn_on_sent(reactor_t *r, conn_t *c, int res) {
+    c->uring_ops--;
+    c->send_inflight = 0;
+    c->outq.pinned   = 0;
+    if (c->reaped || c->state == CONN_CLOSING) return;
+
+    if (res < 0) {
+        if (res != -EINTR && res != -EAGAIN) {
+            conn_mark_closing(r, c);
+            return;
+        }
+    } else {
+        uint64_t frames = c->outq.frames_written;
+        outq_consume(&c->outq, (size_t)res);
+        r->frames_written += c->outq.frames_written - frames;
+    }
+    if (c->outq.count == 0) {
+        c->over_high_water = 0;
+    } else {
+        metrics_record(METRICS_BACKLOG, c->outq.bytes);
+        conn_flush(r, c);
+    }
+}
+
+/*
+ * Multishot accept completion. If the kernel ended the request because we are
+ * out of descriptors, it is re-armed by reactor_reap() once one is released.
+ */
+static void reactor_on_accept(reactor_t *r, int res, unsigned flags) {
+    if (res >= 0) {
+        TRACE_BEGIN(span);
+        int nodelay = 1;
+        setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        if (reactor_register(r, res) != 0) {
+            log_err("could not register client socket %d", res);
+            close(res);
+        }
+        TRACE_END(span, "accept", 0, TRACE_FLOW_NONE, (uint32_t)res);
+    }
+    if (flags & IORING_CQE_F_MORE) return;
+
+    r->accept_armed = 0;
+    if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) {
+        errno = -res;
+        log_err("accept failed, pausing until a connection closes");
+        return;
+    }
+    if (uring_accept_multishot(&r->ring, r->listen_fd, UD_ACCEPT) == 0) r->accept_armed = 1;
+}
+
+/*
+ * reactor_poll_uring
+ * ------------------
+ * One io_uring iteration: submit every SQE queued since the last one (all
+ * sends of the previous fanout included) and wait for completions in the same
+ * io_uring_enter(), then dispatch them.
+ * Returns -1 if the reactor cannot go on.
+ */
+static int reactor_poll_uring(reactor_t *r) {
+    if (uring_submit_and_wait(&r->ring, 1) != 0) {
+        /* EINTR: Ctrl-C or SIGUSR1 interrupted the wait; handled by the caller. */
+        if (errno == EINTR || errno == EBUSY) return 0;
+        log_err("io_uring_enter failed");
+        return -1;
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&r->ring)) != NULL) {
+        uint64_t ud    = cqe->user_data;
+        int      res   = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_cqe_seen(&r->ring);
+
+        if (ud == UD_ACCEPT) {
+            reactor_on_accept(r, res, flags);
+            continue;
+        }
+        if (ud == UD_TIMER) {
+            reactor_on_timer(r);
+            if (!(flags & IORING_CQE_F_MORE))
+                uring_poll_multishot(&r->ring, r->timer_fd, UD_TIMER);
+            continue;
+        }
+        if (ud == UD_WAKE) {
+            inbox_drain(r);
+            if (!(flags & IORING_CQE_F_MORE))
+                uring_poll_multishot(&r->ring, r->wake_fd, UD_WAKE);
+            continue;
+        }
+
+        conn_t *c = (conn_t *)(uintptr_t)(ud & ~(uint64_t)UD_OP_MASK);
+        if ((ud & UD_OP_MASK) == UD_OP_SEND) conn_on_sent(r, c, res);
+        else                                 conn_on_recv(r, c, res, flags);
+        conn_release_if_done(c);
+    }
+    return 0;
+}
+
+/*
+ * Called just before a connection's socket is closed: collects the zerocopy
+ * completions already queued, and parks the frames still lent to the kernel.
+ */
+static void conn_orphan_zerocopy(reactor_t *r, conn_t *c) {
+    outq_zc_reap(&c->outq, c->fd);
+
+    msg_frame_t *frame;
+    while ((frame = outq_zc_detach(&c->outq)) != NULL) {
+        zc_orphan_t *o = pool_alloc(sizeof(*o));
+        if (!o) {
+            msg_frame_unref(frame);
+            continue;
+        }
+        o->next       = NULL;
+        o->frame      = frame;
+        o->release_at = now_ns() + (uint64_t)ZC_LINGER_SEC * 1000000000u;
+        if (r->orphans_tail) r->orphans_tail->next = o;
+        else                 r->orphans_head = o;
+        r->orphans_tail = o;
+    }
+}
+
+/* Releases parked zerocopy frames whose time is up (all of them if `all`). */
+static void reactor_release_orphans(reactor_t *r, int all) {
+    uint64_t now = r->orphans_head ? now_ns() : 0;
+    while (r->orphans_head && (all || r->orphans_head->release_at <= now)) {
+        zc_orphan_t *o = r->orphans_head;
+        r->orphans_head = o->next;
+        msg_frame_unref(o->frame);
+        pool_free(o);
+    }
+    if (!r->orphans_head) r->orphans_tail = NULL;
+}
+
+/*
+ * reactor_reap
+ * ------------
+ * Tears down every connection marked CONN_CLOSING during this iteration.
+ * Joined clients are removed from g_clients (which closes their socket) and
+ * everyone else gets MSG_LEFT; that may in turn mark more connections closing,
+ * so we loop until the list is empty.
+ */
+static void reactor_reap(reactor_t *r) {
+    while (r->closing) {
+        conn_t *c = r->closing;
+        r->closing = c->next_closing;
+        r->conns[c->fd] = NULL;
+
+        /* Frames queued before it was closed (e.g. a BYE) still go out. */
+        if (c->dirty) conn_flush(r, c);
+
+        if (c->joined_idx != NOT_JOINED) {
+            reactor_remove_joined(r, c);
+            if (c->room) reactor_room_remove(r, c);
+            if (!reactor_should_stop())
+                reactor_broadcast(r, c, ROOM_ALL, 0, MSG_LEFT, c->name, NULL, 0);
+        }
+        /*
+         * Requests still in flight keep the conn_t alive; shutting the socket
+         * down makes them complete promptly. The ring holds its own reference
+         * to the file, so the fd number can be reused right away. A send
+         * still sitting in the SQ (e.g. a BYE) is submitted first.
+         */
+        if (c->send_inflight) uring_submit_and_wait(&r->ring, 0);
+        int in_flight = c->uring_ops > 0;
+        if (in_flight) shutdown(c->fd, SHUT_RDWR);
+        if (c->outq.zc_count) conn_orphan_zerocopy(r, c);
+        if (c->registered) membership_leave(c->fd, NULL, NULL);
+        else               close(c->fd);
+        if (in_flight) c->reaped = 1;
+        else           conn_free(c);
+
+        /* An accept that stopped for lack of descriptors can go again. */
+        if (reactor_uses_uring() && !r->accept_armed &&
+            uring_accept_multishot(&r->ring, r->listen_fd, UD_ACCEPT) == 0)
+            r->accept_armed = 1;
+    }
+}
+
+/*
+ * Exit-time completion handler (io_uring): retires what finished sends took
+ * and writes what is queued behind them directly; received data is dropped.
+ * Returns 1 once the UD_DRAIN timeout has fired.
+ */
+static int reactor_uring_retire(reactor_t *r) {
+    int expired = 0;
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&r->ring)) != NULL) {
+        uint64_t ud    = cqe->user_data;
+        int      res   = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_cqe_seen(&r->ring);
+
+        if (ud == UD_DRAIN) expired = 1;
+        if (ud == UD_ACCEPT || ud == UD_WAKE || ud == UD_TIMER || ud == UD_DRAIN) continue;
+
+        conn_t *c = (conn_t *)(uintptr_t)(ud & ~(uint64_t)UD_OP_MASK);
+        if ((ud & UD_OP_MASK) == UD_OP_SEND) {
+            c->uring_ops--;
+            c->send_inflight = 0;
+            c->outq.pinned   = 0;
+            if (res > 0) outq_consume(&c->outq, (size_t)res);
+            if (!c->reaped && c->outq.count) conn_flush(r, c);
+        } else {
+            if (!(flags & IORING_CQE_F_MORE)) c->uring_ops--;
+            if (flags & IORING_CQE_F_BUFFER) uring_buf_recycle(&r->ring, flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        conn_release_if_done(c);
+    }
+    return expired;
+}
+
+/* Whether a connection of this reactor still has a send (or, with !sends, any request) in flight. */
+static int reactor_uring_busy(const reactor_t *r, int sends) {
+    for (size_t fd = 0; fd < r->conns_cap; fd++) {
+        const conn_t *c = r->conns[fd];
+        if (c && (sends ? c->send_inflight : c->uring_ops > 0)) return 1;
+    }
+    return 0;
+}
+
+/*
+ * reactor_uring_quiesce
+ * ---------------------
+ * io_uring backend, at exit: a connection may only be freed once the ring
+ * holds no request that points at it or at its queued frames. Receives are
+ * ended by shutting the read side down. SENDMSGs already in flight get
+ * URING_DRAIN_MS to complete, with what is queued behind them (the BYE)
+ * written directly as each one does; a send still stuck after that is ended
+ * by shutting its socket down completely.
+ */
+static void reactor_uring_quiesce(reactor_t *r) {
+    for (size_t fd = 0; fd < r->conns_cap; fd++)
+        if (r->conns[fd]) shutdown((int)fd, SHUT_RD);
+
+    struct __kernel_timespec limit = { URING_DRAIN_MS / 1000, (URING_DRAIN_MS % 1000) * 1000000LL };
+    int expired = uring_timeout(&r->ring, &limit, UD_DRAIN) != 0;
+    while (!expired && reactor_uring_busy(r, 1)) {
+        if (uring_submit_and_wait(&r->ring, 1) != 0 && errno != EINTR) break;
+        expired = reactor_uring_retire(r);
+    }
+
+    for (size_t fd = 0; fd < r->conns_cap; fd++) {
+        conn_t *c = r->conns[fd];
+        if (c && c->send_inflight) shutdown((int)fd, SHUT_RDWR);
+    }
+    while (reactor_uring_busy(r, 0)) {
+        if (uring_submit_and_wait(&r->ring, 1) != 0 && errno != EINTR) break;
+        reactor_uring_retire(r);
+    }
+}
+
+/*
+ * On exit, say goodbye to everybody still connected to this reactor (unless
+ * SHUTDOWN ALL already did) and release every connection.
+ */
+static void reactor_shutdown(reactor_t *r) {
+    msg_frame_t *bye = g_shutdown_all ? NULL : msg_frame_new(MSG_BYE, NULL, "Server exiting");
+
+    /* The ring is not polled any more: submit what it holds, then write directly. */
+    reactor_flush_dirty(r, 1);
+    if (reactor_uses_uring()) uring_submit_and_wait(&r->ring, 0);
+    r->sync_flush = 1;
+
+    /* A connection with a send in flight only gets its BYE out once that send completes. */
+    for (size_t fd = 0; fd < r->conns_cap; fd++)
+        if (r->conns[fd] && bye) conn_queue_frame(r, r->conns[fd], bye);
+    if (reactor_uses_uring()) reactor_uring_quiesce(r);
+
+    for (size_t fd = 0; fd < r->conns_cap; fd++) {
+        conn_t *c = r->conns[fd];
+        if (!c) continue;
+        if (c->outq.zc_count) conn_orphan_zerocopy(r, c);
+
+        if (c->registered) membership_leave(c->fd, NULL, NULL);
+        else               close(c->fd);
+        r->conns[fd] = NULL;
+        /* Only if quiescing failed: leak it rather than free what the ring still uses. */
+        if (c->uring_ops) c->reaped = 1;
+        else              conn_free(c);
+    }
+    msg_frame_unref(bye);
+    r->closing = NULL;
+    r->joined_count = 0;
+    for (size_t i = 0; i < r->rooms_cap; i++) r->rooms[i].count = 0;
+}
+
+/*
+ * One epoll iteration: wait for readiness and service every ready socket.
+ * Returns -1 if the reactor cannot go on.
+ */
+static int reactor_poll_epoll(reactor_t *r) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    int ready = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, -1);
+    if (ready < 0) {
+        /* EINTR: Ctrl-C or SIGUSR1 interrupted the wait; handled by the caller. */
+        if (errno == EINTR) return 0;
+        log_err("epoll_wait failed");
+        return -1;
+    }
+
+    for (int i = 0; i < ready; i++) {
+        int fd = events[i].data.fd;
+        if (fd == r->listen_fd) {
+            reactor_accept(r);
+            continue;
+        }
+        if (fd == r->wake_fd) {
+            inbox_drain(r);
+            continue;
+        }
+        if (fd == r->timer_fd) {
+            reactor_on_timer(r);
+            continue;
+        }
+
+        conn_t *c = conn_lookup(r, fd);
+        if (!c || c->state == CONN_CLOSING) continue;
+
+        /* Zerocopy completions arrive on the error queue and raise EPOLLERR. */
+        if ((events[i].events & EPOLLERR) && c->outq.zc_count) outq_zc_reap(&c->outq, fd);
+
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            if (conn_on_readable(r, c) != 0) conn_mark_closing(r, c);
+        }
+        if (c->state != CONN_CLOSING && (events[i].events & EPOLLOUT)) {
+            if (conn_flush(r, c) != 0) conn_mark_closing(r, c);
+        }
+    }
+    return 0;
+}
+
+/*
+ * reactor_loop
+ * ------------
+ * One shard's event loop:
+ *   - accept pending connections on this shard's listener,
+ *   - read until EAGAIN and decode frames incrementally (msg_decode),
+ *   - fan out to local clients directly and to other shards via their inbox,
+ *   - flush outbound buffers whenever a socket becomes writable again.
+ * The io_uring backend does the same from completions instead of readiness.
+ */
+static void *reactor_loop(void *arg) {
+    reactor_t *r = arg;
+    TRACE_THREAD_NAME("reactor %d", r->id);
+
+    if (r->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(r->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            log_warn("could not pin reactor %d to CPU %d", r->id, r->cpu);
+    }
+
+    while (!reactor_should_stop()) {
+        int rc = reactor_uses_uring() ? reactor_poll_uring(r) : reactor_poll_epoll(r);
+        if (rc != 0) break;
+
+        reactor_reap(r);
+        reactor_flush_dirty(r, 0);
+        if (r->orphans_head) reactor_release_orphans(r, 0);
+
+        int report_gen = g_queue_report_gen;
+        if (r->report_seen != report_gen) {
+            r->report_seen = report_gen;
+            reactor_report_queues(r);
+            /* Only reactor 0 sees SIGUSR1; pass the request on. */
+            if (r->id == 0) {
+                pool_log_stats();
+                if (g_log) msglog_report(g_log);
+                for (int i = 1; i < g_reactor_count; i++) reactor_wake(&g_reactors[i]);
+            }
+        }
+    }
+
+    /* Deliver anything already posted (e.g. the SHUTDOWN ALL BYE) before leaving. */
+    inbox_drain(r);
+    reactor_reap(r);
+    reactor_shutdown(r);
+    return NULL;
+}
+
+static int reactor_init(reactor_t *r, int id, uint16_t port, int cpu) {
+    r->id  = id;
+    r->cpu = cpu;
+    pthread_mutex_init(&r->inbox_mx, NULL);
+
+    r->listen_fd = create_listening_socket(port, 1);
+    r->wake_fd   = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wake_fd < 0) return -1;
+    if (g_cfg.flush_window_us) {
+        r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (r->timer_fd < 0) return -1;
+    }
+
+    if (reactor_uses_uring()) {
+        /* The listener stays blocking: the ring polls it for us. */
+        if (uring_init(&r->ring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) != 0) return -1;
+        if (uring_accept_multishot(&r->ring, r->listen_fd, UD_ACCEPT) != 0) return -1;
+        if (uring_poll_multishot(&r->ring, r->wake_fd, UD_WAKE) != 0) return -1;
+        if (r->timer_fd >= 0 && uring_poll_multishot(&r->ring, r->timer_fd, UD_TIMER) != 0)
+            return -1;
+        r->accept_armed = 1;
+        return 0;
+    }
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) return -1;
+
+    if (set_nonblocking(r->listen_fd) != 0) return -1;
+
+    struct epoll_event ev = {0};
+    ev.events  = EPOLLIN | EPOLLET;
+    ev.data.fd = r->listen_fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listen_fd, &ev) != 0) return -1;
+
+    ev.data.fd = r->wake_fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wake_fd, &ev) != 0) return -1;
+
+    ev.data.fd = r->timer_fd;
+    if (r->timer_fd >= 0 && epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->timer_fd, &ev) != 0) return -1;
+    return 0;
+}
+
+static void reactor_destroy(reactor_t *r) {
+    inbox_msg_t *m = r->inbox_head;
+    while (m) {
+        inbox_msg_t *next = m->next;
+        frame_set_release(&m->frames);
+        pool_free(m);
+        m = next;
+    }
+    reactor_release_orphans(r, 1);
+    free(r->conns);
+    free(r->joined);
+    for (size_t i = 0; i < r->rooms_cap; i++) {
+        free(r->rooms[i].members);
+        history_free(&r->rooms[i]);
+    }
+    free(r->rooms);
+    if (r->listen_fd >= 0) close(r->listen_fd);
+    if (r->epfd >= 0)      close(r->epfd);
+    if (r->wake_fd >= 0)   close(r->wake_fd);
+    if (r->timer_fd >= 0)  close(r->timer_fd);
+    uring_exit(&r->ring);
+    pthread_mutex_destroy(&r->inbox_mx);
+}
+
+/*
+ * reactor_run
+ * -----------
+ * Starts cfg->threads reactors (0 = one per online CPU), each with its own
+ * SO_REUSEPORT listener on `port` so the kernel spreads accepts across them.
+ * Reactor 0 runs on the calling thread; it alone receives SIGINT and wakes the
+ * others when it is time to stop. Idle connections cost one conn_t, no thread.
+ */
+int reactor_run(uint16_t port, const reactor_cfg_t *cfg, volatile int *stop_flag) {
+    long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online_cpus < 1) online_cpus = 1;
+
+    int count = cfg->threads > 0 ? cfg->threads : (int)online_cpus;
+
+    raise_fd_limit();
+    g_stop_flag     = stop_flag;
+    g_cfg           = *cfg;
+    if (g_cfg.backend == REACTOR_IO_URING && !uring_supported()) {
+        errno = 0;
+        log_warn("io_uring is not available on this kernel, falling back to epoll");
+        g_cfg.backend = REACTOR_EPOLL;
+    }
+    if (g_cfg.zerocopy_threshold && reactor_uses_uring()) {
+        errno = 0;
+        log_warn("ZEROCOPY_THRESHOLD is only used by the epoll backend, ignoring it");
+    }
+    install_report_handler();
+    g_reactor_count = count;
+    g_reactors      = calloc((size_t)count, sizeof(reactor_t));
+    probe(g_reactors, "out of memory");
+
+    for (int i = 0; i < count; i++) {
+        g_reactors[i].listen_fd = g_reactors[i].epfd = g_reactors[i].wake_fd = -1;
+        g_reactors[i].ring.fd   = -1;
+        g_reactors[i].timer_fd  = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        int cpu = cfg->pin_cpus ? (int)(i % online_cpus) : -1;
+        probe(reactor_init(&g_reactors[i], i, port, cpu) == 0, "could not set up reactor %d", i);
+    }
+    membership_on_room_closed(reactor_on_room_closed);
+    if (cfg->log_dir && *cfg->log_dir) {
+        g_log = msglog_open(cfg->log_dir, cfg->log_segment_bytes);
+        if (!g_log) log_warn("[log] continuing without a persistent log");
+    }
+    room_t *lobby = membership_lobby();
+    if (g_log && g_cfg.history_depth && lobby) {
+        uint64_t last = msglog_last_seq(g_log);
+        uint64_t from = last > HISTORY_REBUILD_MAX ? last - HISTORY_REBUILD_MAX + 1 : 1;
+        size_t   seen = msglog_scan(g_log, from, HISTORY_REBUILD_MAX, history_rebuild_visit, lobby);
+        log_info("[log] lobby history rebuilt from the last %zu logged notes", seen);
+    }
+
+    /* Worker reactors block SIGINT/SIGUSR1 so they always land on reactor 0 (this thread). */
+    sigset_t block, previous;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+    for (int i = 1; i < count; i++) {
+        pthread_create(&g_reactors[i].thread, NULL, reactor_loop, &g_reactors[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    log_info("[server] %d %s reactor thread(s)%s, outbound queues capped at %zu bytes (%s)",
+             count, reactor_uses_uring() ? "io_uring" : "epoll",
+             cfg->pin_cpus ? " pinned to CPUs" : "",
+             cfg->outq_high_water, outq_policy_name(cfg->outq_policy));
+    reactor_loop(&g_reactors[0]);
+
+    for (int i = 1; i < count; i++) reactor_wake(&g_reactors[i]);
+    for (int i = 1; i < count; i++) pthread_join(g_reactors[i].thread, NULL);
+    for (int i = 0; i < count; i++) reactor_destroy(&g_reactors[i]);
+    msglog_close(g_log);
+    g_log = NULL;
+
+    free(g_reactors);
+    g_reactors = NULL;
+    g_reactor_count = 0;
+    return 0;
+
+error:
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "outq.h"
+
+/*
+ * Multi-reactor server (SERVER_MODE = epoll, or io_uring for the io_uring
+ * backend, which falls back to epoll if the running kernel lacks support).
+ *   threads  : number of reactor threads, 0 = one per online CPU (REACTOR_THREADS)
+ *   pin_cpus : pin reactor i to CPU i (modulo online CPUs)     (REACTOR_PIN_CPUS)
+ *   outq_high_water : per-client outbound backlog cap in bytes (OUTQ_HIGH_WATER)
+ *   outq_policy     : drop_oldest | drop_newest | disconnect   (OUTQ_POLICY)
+ *   zerocopy_threshold : frames of at least this many bytes are sent with
+ *                        MSG_ZEROCOPY, 0 = never (ZEROCOPY_THRESHOLD, epoll only)
+ *   flush_window_us : how long frames to one socket may wait to be written
+ *                     together, 0 = until the end of the loop iteration (FLUSH_WINDOW_US)
+ *   flush_bytes     : write at once when this much is waiting, 0 = never
+ *                     coalesce (FLUSH_BYTES)
+ *   compress_threshold : v2 frames of at least this many bytes are compressed for
+ *                        clients that negotiated it, 0 = never (COMPRESS_THRESHOLD)
+ *   history_depth : notes per room replayed to whoever joins it, 0 = none (HISTORY_DEPTH)
+ *   history_bytes : cap on the frame bytes one room's history holds (HISTORY_BYTES)
+ *   log_dir       : directory of the persistent message log, NULL/"" = none (LOG_DIR);
+ *                   it also refills the room histories at startup
+ *   log_segment_bytes : size of one log segment file (LOG_SEGMENT_BYTES)
+ * Send SIGUSR1 to log every client's outbound queue depth and the pool hit rates.
+ */
+typedef enum {
+    REACTOR_EPOLL,
+    REACTOR_IO_URING
+} reactor_backend_t;
+
+typedef struct {
+    int           threads;
+    int           pin_cpus;
+    size_t        outq_high_water;
+    outq_policy_t outq_policy;
+    reactor_backend_t backend;
+    size_t        zerocopy_threshold;
+    unsigned      flush_window_us;
+    size_t        flush_bytes;
+    size_t        compress_threshold;
+    size_t        history_depth;
+    size_t        history_bytes;
+    const char   *log_dir;
+    size_t        log_segment_bytes;
+} reactor_cfg_t;
+
+/*
+ * Runs the reactors until *stop_flag or g_shutdown_all is set, then sends
+ * MSG_BYE to everyone still connected and closes all sockets.
+ */
+int reactor_run(uint16_t port, const reactor_cfg_t *cfg, volatile int *stop_flag);
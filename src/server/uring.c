@@ -0,0 +1,302 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define URING_BUF_GROUP 0
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned load_acquire(const unsigned *p) {
+    return atomic_load_explicit((_Atomic unsigned *)p, memory_order_acquire);
+}
+
+static void store_release(unsigned *p, unsigned v) {
+    atomic_store_explicit((_Atomic unsigned *)p, v, memory_order_release);
+}
+
+/*
+ * Maps the rings of a freshly set up io_uring instance.
+ */
+static int map_rings(uring_t *ring, const struct io_uring_params *p) {
+    ring->sq_map_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring->cq_map_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_len > ring->sq_map_len) ring->sq_map_len = ring->cq_map_len;
+        ring->cq_map_len = ring->sq_map_len;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) { ring->sq_map = NULL; return -1; }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) { ring->cq_map = NULL; return -1; }
+    }
+
+    ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) { ring->sqes = NULL; return -1; }
+
+    unsigned char *sq = ring->sq_map;
+    ring->sq_head    = (unsigned *)(sq + p->sq_off.head);
+    ring->sq_tail    = (unsigned *)(sq + p->sq_off.tail);
+    ring->sq_array   = (unsigned *)(sq + p->sq_off.array);
+    ring->sq_mask    = *(unsigned *)(sq + p->sq_off.ring_mask);
+    ring->sq_entries = *(unsigned *)(sq + p->sq_off.ring_entries);
+    ring->sq_pending_tail = *ring->sq_tail;
+
+    unsigned char *cq = ring->cq_map;
+    ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Registers `buf_count` receive buffers of `buf_size` bytes as buffer group 0.
+ */
+static int setup_buffers(uring_t *ring, unsigned buf_count, unsigned buf_size) {
+    size_t ring_len = buf_count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) { ring->buf_ring = NULL; return -1; }
+
+    ring->bufs = mmap(NULL, (size_t)buf_count * buf_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED) { ring->bufs = NULL; return -1; }
+    ring->buf_count = buf_count;
+    ring->buf_size  = buf_size;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid         = URING_BUF_GROUP;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+
+    for (unsigned bid = 0; bid < buf_count; bid++) uring_buf_recycle(ring, bid);
+    return 0;
+}
+
+/*
+ * uring_init
+ * ----------
+ * Sets up a ring with `entries` SQEs (and four times as many CQEs, since
+ * multishot requests complete many times) plus the receive buffer ring.
+ * `entries` and `buf_count` must be powers of two.
+ * Returns 0, or -1 with errno set (ENOSYS/EPERM/EINVAL on kernels or sandboxes
+ * without the needed io_uring features).
+ */
+int uring_init(uring_t *ring, unsigned entries, unsigned buf_count, unsigned buf_size) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags      = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    ring->fd = sys_setup(entries, &params);
+    if (ring->fd < 0) return -1;
+
+    if (map_rings(ring, &params) != 0 || setup_buffers(ring, buf_count, buf_size) != 0) {
+        int saved = errno;
+        uring_exit(ring);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_exit(uring_t *ring) {
+    if (ring->bufs)     munmap(ring->bufs, (size_t)ring->buf_count * ring->buf_size);
+    if (ring->buf_ring) munmap(ring->buf_ring, ring->buf_count * sizeof(struct io_uring_buf));
+    if (ring->sqes)     munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_len);
+    if (ring->sq_map)   munmap(ring->sq_map, ring->sq_map_len);
+    if (ring->fd >= 0)  close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/*
+ * Publishes queued SQEs and submits them without waiting.
+ */
+static int submit(uring_t *ring) {
+    store_release(ring->sq_tail, ring->sq_pending_tail);
+    unsigned to_submit = ring->sq_pending_tail - load_acquire(ring->sq_head);
+    if (!to_submit) return 0;
+    return sys_enter(ring->fd, to_submit, 0, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Returns a zeroed SQE, submitting what is queued first if the ring is full.
+ */
+static struct io_uring_sqe *get_sqe(uring_t *ring) {
+    while (ring->sq_pending_tail - load_acquire(ring->sq_head) >= ring->sq_entries) {
+        if (submit(ring) != 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return NULL;
+    }
+
+    unsigned idx = ring->sq_pending_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_pending_tail++;
+    return sqe;
+}
+
+int uring_accept_multishot(uring_t *ring, int listen_fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = listen_fd;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data    = user_data;
+    return 0;
+}
+
+int uring_recv_multishot(uring_t *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = fd;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_poll_multishot(uring_t *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len           = IORING_POLL_ADD_MULTI;
+    sqe->user_data     = user_data;
+    return 0;
+}
+
+/* Completes with -ETIME once `ts` has passed; `ts` must live until submitted. */
+int uring_timeout(uring_t *ring, const struct __kernel_timespec *ts, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode    = IORING_OP_TIMEOUT;
+    sqe->addr      = (uint64_t)(uintptr_t)ts;
+    sqe->len       = 1;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_sendmsg(uring_t *ring, int fd, const struct msghdr *msg, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t)(uintptr_t)msg;
+    sqe->len       = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+/*
+ * uring_submit_and_wait
+ * ---------------------
+ * Submits everything queued and, unless completions are already waiting,
+ * blocks until at least `wait_nr` arrive: one syscall for both.
+ * Returns 0, or -1 with errno set (EINTR when a signal interrupted the wait).
+ */
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr) {
+    store_release(ring->sq_tail, ring->sq_pending_tail);
+    unsigned to_submit = ring->sq_pending_tail - load_acquire(ring->sq_head);
+
+    if (load_acquire(ring->cq_tail) != *ring->cq_head) wait_nr = 0;
+    if (!to_submit && !wait_nr) return 0;
+
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    return sys_enter(ring->fd, to_submit, wait_nr, flags) < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == load_acquire(ring->cq_tail)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+void *uring_buf(uring_t *ring, unsigned bid) {
+    return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+/*
+ * Hands receive buffer `bid` back to the kernel.
+ */
+void uring_buf_recycle(uring_t *ring, unsigned bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(ring, bid);
+    buf->len  = ring->buf_size;
+    buf->bid  = (uint16_t)bid;
+    ring->buf_tail++;
+    atomic_store_explicit((_Atomic uint16_t *)&ring->buf_ring->tail, ring->buf_tail,
+                          memory_order_release);
+}
+
+/*
+ * uring_supported
+ * ---------------
+ * Checks at runtime that the kernel (and any seccomp policy) allows io_uring
+ * with provided buffer rings and multishot receive (Linux 6.0+; multishot
+ * accept is older): a one-byte round trip over a socketpair.
+ * Returns 1 if the io_uring backend can be used, 0 otherwise.
+ */
+int uring_supported(void) {
+    uring_t ring;
+    if (uring_init(&ring, 4, 4, 64) != 0) return 0;
+
+    int ok = 0;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0) {
+        if (uring_recv_multishot(&ring, pair[0], 1) == 0 &&
+            uring_submit_and_wait(&ring, 0) == 0 &&
+            write(pair[1], "x", 1) == 1 &&
+            uring_submit_and_wait(&ring, 1) == 0) {
+            struct io_uring_cqe *cqe = uring_peek_cqe(&ring);
+            ok = cqe && cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) &&
+                 (cqe->flags & IORING_CQE_F_BUFFER);
+        }
+        close(pair[0]);
+        close(pair[1]);
+    }
+    uring_exit(&ring);
+    return ok;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+struct msghdr;
+struct __kernel_timespec;
+
+/*
+ * Minimal io_uring wrapper on the raw syscalls (no liburing): one SQ/CQ ring
+ * pair plus one provided-buffer ring (group 0) that multishot receives pick
+ * their buffers from.
+ *
+ * SQEs are only queued by the uring_* prep helpers; nothing reaches the kernel
+ * until uring_submit_and_wait(), so everything queued while handling one batch
+ * of completions (e.g. one send per fanout recipient) goes in a single
+ * io_uring_enter().
+ */
+typedef struct {
+    int                   fd;
+
+    unsigned             *sq_head, *sq_tail, *sq_array;
+    unsigned              sq_mask, sq_entries;
+    unsigned              sq_pending_tail;      /* our tail, published at submit */
+    struct io_uring_sqe  *sqes;
+
+    unsigned             *cq_head, *cq_tail;
+    unsigned              cq_mask;
+    struct io_uring_cqe  *cqes;
+
+    void                 *sq_map, *cq_map;
+    size_t                sq_map_len, cq_map_len, sqes_len;
+
+    struct io_uring_buf_ring *buf_ring;         /* provided receive buffers */
+    unsigned char        *bufs;
+    unsigned              buf_count, buf_size;
+    uint16_t              buf_tail;
+} uring_t;
+
+int  uring_supported(void);
+int  uring_init(uring_t *ring, unsigned entries, unsigned buf_count, unsigned buf_size);
+void uring_exit(uring_t *ring);
+
+int  uring_accept_multishot(uring_t *ring, int listen_fd, uint64_t user_data);
+int  uring_recv_multishot(uring_t *ring, int fd, uint64_t user_data);
+int  uring_poll_multishot(uring_t *ring, int fd, uint64_t user_data);
+int  uring_sendmsg(uring_t *ring, int fd, const struct msghdr *msg, uint64_t user_data);
+int  uring_timeout(uring_t *ring, const struct __kernel_timespec *ts, uint64_t user_data);
+
+int                  uring_submit_and_wait(uring_t *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void                 uring_cqe_seen(uring_t *ring);
+
+void *uring_buf(uring_t *ring, unsigned bid);
+void  uring_buf_recycle(uring_t *ring, unsigned bid);
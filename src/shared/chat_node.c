@@ -3,90 +3,202 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#define CN_MIN_SLOTS 16     /* tables are kept at most half full */
+
+typedef enum { KEY_NAME, KEY_SOCK } cn_key_t;
+
+static size_t hash_name(const char *name) {
+    uint64_t h = 1469598103934665603ULL;           /* FNV-1a */
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+static size_t hash_sock(int sock) {
+    uint64_t h = (uint32_t)sock;                    /* splitmix64 finaliser */
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+static uint32_t *table_for(const chat_registry_t *reg, cn_key_t kind) {
+    return kind == KEY_NAME ? reg->by_name : reg->by_sock;
+}
+
+/* Home slot of node `idx` in the given table. */
+static size_t home_of(const chat_registry_t *reg, cn_key_t kind, size_t idx) {
+    const chat_node_t *n = &reg->nodes[idx];
+    size_t h = kind == KEY_NAME ? hash_name(n->name) : hash_sock(n->sock);
+    return h & (reg->slots - 1);
+}
+
+static void index_insert(chat_registry_t *reg, cn_key_t kind, size_t idx) {
+    uint32_t *table = table_for(reg, kind);
+    size_t    mask  = reg->slots - 1;
+    size_t    i     = home_of(reg, kind, idx);
+    while (table[i]) i = (i + 1) & mask;
+    table[i] = (uint32_t)idx + 1;
+}
+
+/* Slot that currently holds node `idx` (which must be indexed). */
+static size_t index_slot_of(const chat_registry_t *reg, cn_key_t kind, size_t idx) {
+    const uint32_t *table = table_for(reg, kind);
+    size_t          mask  = reg->slots - 1;
+    size_t          i     = home_of(reg, kind, idx);
+    while (table[i] != idx + 1) i = (i + 1) & mask;
+    return i;
+}
+
 /*
- * cn_list_create
- * --------------
- * Creates an empty chat node list. We represent an empty list as NULL
+ * Empties slot `hole` and shifts later members of the probe run back into it
+ * (backward-shift deletion), so linear probing needs no tombstones.
  */
-chat_node_list_t *cn_list_create(void) { 
-    return NULL; 
+static void index_delete(chat_registry_t *reg, cn_key_t kind, size_t hole) {
+    uint32_t *table = table_for(reg, kind);
+    size_t    mask  = reg->slots - 1;
+
+    table[hole] = 0;
+    for (size_t j = (hole + 1) & mask; table[j]; j = (j + 1) & mask) {
+        size_t home = home_of(reg, kind, table[j] - 1);
+        /* Move it unless its home lies cyclically in (hole, j]. */
+        int stays = (hole <= j) ? (home > hole && home <= j)
+                                : (home > hole || home <= j);
+        if (stays) continue;
+        table[hole] = table[j];
+        table[j]    = 0;
+        hole        = j;
+    }
+}
+
+/* Rebuilds both tables at `slots` entries from the dense array. */
+static int index_rebuild(chat_registry_t *reg, size_t slots) {
+    uint32_t *by_name = calloc(slots, sizeof(*by_name));
+    uint32_t *by_sock = calloc(slots, sizeof(*by_sock));
+    if (!by_name || !by_sock) {
+        free(by_name);
+        free(by_sock);
+        return -1;
+    }
+    free(reg->by_name);
+    free(reg->by_sock);
+    reg->by_name = by_name;
+    reg->by_sock = by_sock;
+    reg->slots   = slots;
+
+    for (size_t i = 0; i < reg->count; i++) {
+        index_insert(reg, KEY_NAME, i);
+        index_insert(reg, KEY_SOCK, i);
+    }
+    return 0;
 }
 
 /*
- * cn_list_free
- * ------------
- * Frees an entire linked list of chat_node_list_t entries.
- * Also closes each socket stored in each chat_node_t.
+ * Unlinks node `idx` from both indexes, closes its socket and fills the hole
+ * with the last node.
+ */
+static void remove_at(chat_registry_t *reg, size_t idx) {
+    size_t last = reg->count - 1;
+
+    index_delete(reg, KEY_NAME, index_slot_of(reg, KEY_NAME, idx));
+    index_delete(reg, KEY_SOCK, index_slot_of(reg, KEY_SOCK, idx));
+    close(reg->nodes[idx].sock);
+
+    if (idx != last) {
+        size_t name_slot = index_slot_of(reg, KEY_NAME, last);
+        size_t sock_slot = index_slot_of(reg, KEY_SOCK, last);
+        reg->nodes[idx] = reg->nodes[last];
+        reg->by_name[name_slot] = (uint32_t)idx + 1;
+        reg->by_sock[sock_slot] = (uint32_t)idx + 1;
+    }
+    reg->count--;
+}
+
+/*
+ * cn_registry_init
+ * ----------------
+ * Prepares an empty registry. Storage is allocated by the first cn_add().
+ */
+void cn_registry_init(chat_registry_t *reg) {
+    memset(reg, 0, sizeof(*reg));
+}
+
+/*
+ * cn_registry_free
+ * ----------------
+ * Releases the registry and closes every socket still stored in it.
  *
  * This actively closes sockets. Only called during shutdown
  * when all client connections should be terminated.
  */
-void cn_list_free(chat_node_list_t *head) {
-    while (head) {
-        chat_node_list_t *next_node = head->next;
-        close(head->node.sock);  /* Close client's TCP socket */
-        free(head);              /* Free list node wrapper */
-        head = next_node;
-    }
+void cn_registry_free(chat_registry_t *reg) {
+    for (size_t i = 0; i < reg->count; i++)
+        close(reg->nodes[i].sock);
+    free(reg->nodes);
+    free(reg->by_name);
+    free(reg->by_sock);
+    cn_registry_init(reg);
 }
 
 /*
  * cn_add
  * ------
- * Adds a new chat_node_t to the head of the linked list.
+ * Appends a copy of `new_node`. Names and sockets must be unique; callers check
+ * with cn_find_by_name() first.
  * Returns:
  *   0 on success
  *  -1 on allocation failure
  */
-int cn_add(chat_node_list_t **head, const chat_node_t *new_node) {
-    chat_node_list_t *entry = calloc(1, sizeof(*entry));
-    if (!entry) return -1;
+int cn_add(chat_registry_t *reg, const chat_node_t *new_node) {
+    if (reg->count == reg->cap) {
+        size_t new_cap = reg->cap ? reg->cap * 2 : CN_MIN_SLOTS / 2;
+        chat_node_t *grown = realloc(reg->nodes, new_cap * sizeof(*grown));
+        if (!grown) return -1;
+        reg->nodes = grown;
+        reg->cap   = new_cap;
+    }
+    /* Keep the load factor at or below 1/2 so probe runs stay short. */
+    if ((reg->count + 1) * 2 > reg->slots) {
+        size_t slots = reg->slots ? reg->slots * 2 : CN_MIN_SLOTS;
+        if (index_rebuild(reg, slots) < 0) return -1;
+    }
 
-    entry->node = *new_node;   /* Copy node data (name + socket) */
-    entry->next = *head;       /* Insert at list front */
-    *head = entry;
+    size_t idx = reg->count++;
+    reg->nodes[idx] = *new_node;
+    index_insert(reg, KEY_NAME, idx);
+    index_insert(reg, KEY_SOCK, idx);
     return 0;
 }
 
 /*
  * cn_remove_by_sock
  * -----------------
- * Removes a client from the list based on matching socket fd.
- * Also closes that client's socket before freeing the node.
+ * Removes a client from the registry based on matching socket fd.
+ * Also closes that client's socket.
  * Returns:
  *   0 on success (node removed)
  *  -1 if no matching socket was found
  */
-int cn_remove_by_sock(chat_node_list_t **head, int sock) {
-    for (chat_node_list_t **current = head; *current; current = &(*current)->next) {
-        if ((*current)->node.sock == sock) {
-            chat_node_list_t *to_delete = *current;
-            *current = to_delete->next;
-            close(to_delete->node.sock);
-            free(to_delete);
-            return 0;
-        }
-    }
-    return -1;
+int cn_remove_by_sock(chat_registry_t *reg, int sock) {
+    chat_node_t *n = cn_find_by_sock(reg, sock);
+    if (!n) return -1;
+    remove_at(reg, (size_t)(n - reg->nodes));
+    return 0;
 }
 
 /*
  * cn_remove_by_name
  * -----------------
- * Removes a client from the list based on their chat username.
- * Also closes the socket and frees the node.
+ * Removes a client from the registry based on their chat username.
+ * Also closes the socket.
  */
-int cn_remove_by_name(chat_node_list_t **head, const char *name) {
-    for (chat_node_list_t **current = head; *current; current = &(*current)->next) {
-        if (strcmp((*current)->node.name, name) == 0) {
-            chat_node_list_t *to_delete = *current;
-            *current = to_delete->next;
-            close(to_delete->node.sock);
-            free(to_delete);
-            return 0;
-        }
-    }
-    return -1;
+int cn_remove_by_name(chat_registry_t *reg, const char *name) {
+    chat_node_t *n = cn_find_by_name(reg, name);
+    if (!n) return -1;
+    remove_at(reg, (size_t)(n - reg->nodes));
+    return 0;
 }
 
 /*
@@ -94,15 +206,32 @@ int cn_remove_by_name(chat_node_list_t **head, const char *name) {
  * ----------------
  * Searches for an existing participant by their human-readable name.
  * Returns:
- *   pointer to the chat_node_t entry, OR
+ *   pointer to the chat_node_t entry (valid until the registry changes), OR
  *   NULL if not found.
  *
  * Used by server JOIN validation to ensure names are unique.
  */
-chat_node_t *cn_find_by_name(chat_node_list_t *head, const char *name) {
-    for (; head; head = head->next) {
-        if (strcmp(head->node.name, name) == 0)
-            return &head->node;
+chat_node_t *cn_find_by_name(const chat_registry_t *reg, const char *name) {
+    if (!reg->count) return NULL;
+    size_t mask = reg->slots - 1;
+    for (size_t i = hash_name(name) & mask; reg->by_name[i]; i = (i + 1) & mask) {
+        chat_node_t *n = &reg->nodes[reg->by_name[i] - 1];
+        if (strcmp(n->name, name) == 0) return n;
+    }
+    return NULL;
+}
+
+/*
+ * cn_find_by_sock
+ * ---------------
+ * Same as cn_find_by_name(), keyed by socket fd.
+ */
+chat_node_t *cn_find_by_sock(const chat_registry_t *reg, int sock) {
+    if (!reg->count) return NULL;
+    size_t mask = reg->slots - 1;
+    for (size_t i = hash_sock(sock) & mask; reg->by_sock[i]; i = (i + 1) & mask) {
+        chat_node_t *n = &reg->nodes[reg->by_sock[i] - 1];
+        if (n->sock == sock) return n;
     }
     return NULL;
 }
@@ -1,21 +1,39 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
 typedef struct {
     char name[64];
     int  sock;
     struct sockaddr_in addr;
+    int      shard;         /* epoll reactor that owns the socket, -1 in thread mode */
+    uint32_t room;          /* id of the room this participant is in */
+    size_t   room_idx;      /* its slot in that room's member index */
 } chat_node_t;
 
-typedef struct chat_node_list {
-    chat_node_t            node;
-    struct chat_node_list *next;
-} chat_node_list_t;
+/*
+ * Participant registry.
+ * Entries live in a dense array (iterate nodes[0..count) for broadcasts) and
+ * are indexed by two open-addressing hash tables, one keyed by name and one by
+ * socket. Each table slot holds a node index + 1 (0 = empty). Removal moves the
+ * last entry into the hole, so node pointers and order are not stable across
+ * cn_add()/cn_remove_*().
+ */
+typedef struct {
+    chat_node_t *nodes;
+    size_t       count, cap;
+
+    uint32_t    *by_name;
+    uint32_t    *by_sock;
+    size_t       slots;         /* size of both tables, a power of two */
+} chat_registry_t;
 
 // helpers
-chat_node_list_t *cn_list_create(void);
-void cn_list_free(chat_node_list_t *head);
-int  cn_add(chat_node_list_t **head, const chat_node_t *n);
-int  cn_remove_by_sock(chat_node_list_t **head, int sock);
-int  cn_remove_by_name(chat_node_list_t **head, const char *name);
-chat_node_t *cn_find_by_name(chat_node_list_t *head, const char *name);
+void cn_registry_init(chat_registry_t *reg);
+void cn_registry_free(chat_registry_t *reg);
+int  cn_add(chat_registry_t *reg, const chat_node_t *n);
+int  cn_remove_by_sock(chat_registry_t *reg, int sock);
+int  cn_remove_by_name(chat_registry_t *reg, const char *name);
+chat_node_t *cn_find_by_name(const chat_registry_t *reg, const char *name);
+chat_node_t *cn_find_by_sock(const chat_registry_t *reg, int sock);
@@ -1,8 +1,19 @@
 #include "message.h"
+#include "pool.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#define MSG_READER_CHUNK 16384      /* initial (and minimum) receive buffer size */
+#define MSG_BODY_MAX     (32u << 20)    /* largest frame body either version accepts */
+#define VARINT_MAX       5          /* bytes in the longest uint32 varint */
+#define DEFLATE_LEVEL    Z_BEST_SPEED   /* frames are compressed on the send path */
 
 /*
  * send_all
@@ -15,7 +26,7 @@
 int send_all(int fd, const void *buf, size_t len) {
     const unsigned char *p = buf;
     while (len > 0) {
-        ssize_t sent = send(fd, p, len, 0);
+        ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
         if (sent <= 0) return -1;
         p   += sent;
         len -= (size_t)sent;
@@ -23,6 +34,42 @@ int send_all(int fd, const void *buf, size_t len) {
     return 0;
 }
 
+/*
+ * send_iov_all
+ * ------------
+ * Gather-send: writes every byte described by `iov` with as few sendmsg()
+ * calls as the kernel allows (normally one), resuming after partial writes.
+ * The iovec array is consumed (advanced in place) as data goes out.
+ * Returns:
+ *   0 on success
+ *  -1 on failure or socket closure.
+ */
+int send_iov_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0 && iov->iov_len == 0) { iov++; iovcnt--; }
+
+    while (iovcnt > 0) {
+        struct msghdr mh = {0};
+        mh.msg_iov    = iov;
+        mh.msg_iovlen = (size_t)iovcnt;
+
+        ssize_t sent = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+
+        /* Skip fully written entries, then trim the partially written one. */
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + sent;
+            iov->iov_len -= (size_t)sent;
+        }
+    }
+    return 0;
+}
+
 /*
  * recv_all
  * --------
@@ -49,7 +96,8 @@ int recv_all(int fd, void *buf, size_t len) {
  *
  * wire_len = sizeof(header) + name_len + text_len (in network byte order).
  *
- * This keeps protocol decoding correct and future-proof.
+ * The whole frame goes out through one sendmsg() (see send_iov_all), so a
+ * small message is a single TCP segment rather than four.
  */
 int msg_send(int sock, msg_type_t type, const char *name, const char *text) {
     uint32_t name_len = name ? (uint32_t)strlen(name) : 0;
@@ -64,11 +112,19 @@ int msg_send(int sock, msg_type_t type, const char *name, const char *text) {
     uint32_t total_body_len = sizeof(header) + name_len + text_len;
     uint32_t wire_len = htonl(total_body_len);
 
-    if (send_all(sock, &wire_len, sizeof(wire_len))) return -1;
-    if (send_all(sock, &header, sizeof(header))) return -1;
-    if (name_len && send_all(sock, name, name_len)) return -1;
-    if (text_len && send_all(sock, text, text_len)) return -1;
-    return 0;
+    unsigned char prefix[sizeof(wire_len) + sizeof(header)];
+    memcpy(prefix, &wire_len, sizeof(wire_len));
+    memcpy(prefix + sizeof(wire_len), &header, sizeof(header));
+
+    struct iovec iov[3] = {
+        { prefix,        sizeof(prefix) },
+        { (void *)name,  name_len },
+        { (void *)text,  text_len }
+    };
+    TRACE_BEGIN(span);
+    int rc = send_iov_all(sock, iov, 3);
+    TRACE_END(span, "msg_send", TRACE_CURRENT(), TRACE_FLOW_STEP, (uint32_t)sock);
+    return rc;
 }
 
 /*
@@ -84,6 +140,8 @@ int msg_recv(int sock, msg_type_t *type, char **name_out, char **text_out) {
     uint32_t wire_len_net;
     if (recv_all(sock, &wire_len_net, sizeof(wire_len_net))) return -1;
 
+    /* Traced from the first byte on, not while idly waiting for it. */
+    TRACE_BEGIN(span);
     uint32_t body_len = ntohl(wire_len_net);
 
     /* Basic sanity check (32MB max cap) */
@@ -105,32 +163,763 @@ int msg_recv(int sock, msg_type_t *type, char **name_out, char **text_out) {
     char *text_buf = NULL;
 
     if (name_len) {
-        name_buf = malloc(name_len + 1);
+        name_buf = pool_alloc(name_len + 1);
+        if (!name_buf) return -1;
+        if (recv_all(sock, name_buf, name_len)) { pool_free(name_buf); return -1; }
+        name_buf[name_len] = '\0';
+    }
+
+    if (text_len) {
+        text_buf = pool_alloc(text_len + 1);
+        if (!text_buf) { pool_free(name_buf); return -1; }
+        if (recv_all(sock, text_buf, text_len)) { pool_free(name_buf); pool_free(text_buf); return -1; }
+        text_buf[text_len] = '\0';
+    }
+
+    *type = (msg_type_t)type_val;
+    if (name_out) *name_out = name_buf; else pool_free(name_buf);
+    if (text_out) *text_out = text_buf; else pool_free(text_buf);
+
+    TRACE_END(span, "msg_recv", 0, TRACE_FLOW_NONE, (uint32_t)sock);
+    return 0;
+}
+
+/*
+ * msg_encoded_len
+ * ---------------
+ * Number of bytes msg_encode() will write for this name/text pair,
+ * including the leading uint32 wire length.
+ */
+size_t msg_encoded_len(const char *name, const char *text) {
+    size_t name_len = name ? strlen(name) : 0;
+    size_t text_len = text ? strlen(text) : 0;
+    return sizeof(uint32_t) + sizeof(msg_hdr_t) + name_len + text_len;
+}
+
+/*
+ * msg_encode
+ * ----------
+ * Serializes one frame into `dst` (which must hold msg_encoded_len() bytes),
+ * byte-for-byte identical to what msg_send() puts on the wire.
+ */
+void msg_encode(void *dst, msg_type_t type, const char *name, const char *text) {
+    uint32_t name_len = name ? (uint32_t)strlen(name) : 0;
+    uint32_t text_len = text ? (uint32_t)strlen(text) : 0;
+
+    msg_hdr_t header = {
+        htonl((uint32_t)type),
+        htonl(name_len),
+        htonl(text_len)
+    };
+    uint32_t wire_len = htonl((uint32_t)sizeof(header) + name_len + text_len);
+
+    unsigned char *p = dst;
+    memcpy(p, &wire_len, sizeof(wire_len)); p += sizeof(wire_len);
+    memcpy(p, &header, sizeof(header));     p += sizeof(header);
+    if (name_len) { memcpy(p, name, name_len); p += name_len; }
+    if (text_len) { memcpy(p, text, text_len); }
+}
+
+/*
+ * msg_decode
+ * ----------
+ * Incremental counterpart of msg_recv() for callers that buffer socket data
+ * themselves. Looks at the first `len` bytes of `buf` and, if they contain a
+ * complete frame, decodes it exactly like msg_recv() (same 32MB cap and length
+ * check, same ownership of name/text).
+ * Returns:
+ *   >0 number of bytes consumed (one whole frame)
+ *    0 if more data is needed
+ *   -1 on malformed frame or allocation failure
+ */
+int msg_decode(const void *buf, size_t len, msg_type_t *type, char **name_out, char **text_out) {
+    const unsigned char *p = buf;
+    uint32_t wire_len_net;
+    if (len < sizeof(wire_len_net)) return 0;
+    memcpy(&wire_len_net, p, sizeof(wire_len_net));
+
+    uint32_t body_len = ntohl(wire_len_net);
+    if (body_len < sizeof(msg_hdr_t) || body_len > (32u << 20))
+        return -1;
+    if (len - sizeof(wire_len_net) < body_len) return 0;
+    p += sizeof(wire_len_net);
+
+    msg_hdr_t header;
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+
+    uint32_t type_val = ntohl(header.type);
+    uint32_t name_len = ntohl(header.name_len);
+    uint32_t text_len = ntohl(header.text_len);
+
+    /* Validate that lengths add up exactly */
+    if (sizeof(header) + name_len + text_len != body_len)
+        return -1;
+
+    char *name_buf = NULL;
+    char *text_buf = NULL;
+
+    if (name_len) {
+        name_buf = pool_alloc(name_len + 1);
         if (!name_buf) return -1;
-        if (recv_all(sock, name_buf, name_len)) { free(name_buf); return -1; }
+        memcpy(name_buf, p, name_len);
         name_buf[name_len] = '\0';
+        p += name_len;
     }
 
     if (text_len) {
-        text_buf = malloc(text_len + 1);
-        if (!text_buf) { free(name_buf); return -1; }
-        if (recv_all(sock, text_buf, text_len)) { free(name_buf); free(text_buf); return -1; }
+        text_buf = pool_alloc(text_len + 1);
+        if (!text_buf) { pool_free(name_buf); return -1; }
+        memcpy(text_buf, p, text_len);
         text_buf[text_len] = '\0';
     }
 
     *type = (msg_type_t)type_val;
-    if (name_out) *name_out = name_buf; else free(name_buf);
-    if (text_out) *text_out = text_buf; else free(text_buf);
+    if (name_out) *name_out = name_buf; else pool_free(name_buf);
+    if (text_out) *text_out = text_buf; else pool_free(text_buf);
+
+    return (int)(sizeof(wire_len_net) + body_len);
+}
+
+/*
+ * Varints (LEB128): 7 bits per byte, least significant group first, top bit
+ * set on every byte but the last.
+ */
+static size_t varint_len(uint32_t v) {
+    size_t n = 1;
+    while (v >= 0x80) { v >>= 7; n++; }
+    return n;
+}
+
+static unsigned char *varint_put(unsigned char *p, uint32_t v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+/* Returns bytes used, 0 if `len` ends mid-varint, -1 if it does not fit 32 bits. */
+static int varint_get(const unsigned char *p, size_t len, uint32_t *out) {
+    uint32_t v = 0;
+    for (size_t i = 0; i < VARINT_MAX; i++) {
+        if (i == len) return 0;
+        if (i == VARINT_MAX - 1 && p[i] > 0x0f) return -1;
+        v |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *out = v;
+            return (int)i + 1;
+        }
+    }
+    return -1;
+}
+
+/* v2 body length for this message (see message.h for the layout). */
+static size_t v2_body_len(msg_type_t type, size_t name_len, size_t text_len, uint32_t sender_id) {
+    if (!sender_id) return varint_len((uint32_t)name_len) + name_len + text_len;
+    if (type == MSG_SENDER_ID) return varint_len(sender_id) + varint_len((uint32_t)name_len) + name_len;
+    return varint_len(sender_id) + text_len;
+}
+
+/*
+ * Writes the tag, body length and the body up to (not including) the
+ * name/text bytes. Returns the end of what was written; at most
+ * 1 + 3 * VARINT_MAX bytes.
+ */
+static unsigned char *v2_put_prefix(unsigned char *p, msg_type_t type, size_t name_len,
+                                    size_t text_len, uint32_t sender_id) {
+    *p++ = (unsigned char)(MSG_V2_TAG | (sender_id ? MSG_V2_SENDER : 0) |
+                           ((unsigned)type & MSG_V2_TYPE_MASK));
+    p = varint_put(p, (uint32_t)v2_body_len(type, name_len, text_len, sender_id));
+    if (sender_id) p = varint_put(p, sender_id);
+    if (!sender_id || type == MSG_SENDER_ID) p = varint_put(p, (uint32_t)name_len);
+    return p;
+}
+
+/*
+ * msg_encoded_len_v2 / msg_encode_v2
+ * ----------------------------------
+ * Compact framing. With a non-zero `sender_id` the name is left out (the
+ * recipient must already know the id), except in the MSG_SENDER_ID frame that
+ * introduces it, which carries the name and no text.
+ */
+size_t msg_encoded_len_v2(msg_type_t type, const char *name, const char *text, uint32_t sender_id) {
+    size_t name_len = name ? strlen(name) : 0;
+    size_t text_len = text ? strlen(text) : 0;
+    size_t body     = v2_body_len(type, name_len, text_len, sender_id);
+    return 1 + varint_len((uint32_t)body) + body;
+}
 
+void msg_encode_v2(void *dst, msg_type_t type, const char *name, const char *text, uint32_t sender_id) {
+    size_t name_len = name ? strlen(name) : 0;
+    size_t text_len = text ? strlen(text) : 0;
+
+    unsigned char *p = v2_put_prefix(dst, type, name_len, text_len, sender_id);
+    if (!sender_id || type == MSG_SENDER_ID) {
+        if (name_len) { memcpy(p, name, name_len); p += name_len; }
+    }
+    if (type != MSG_SENDER_ID || !sender_id) {
+        if (text_len) memcpy(p, text, text_len);
+    }
+}
+
+/*
+ * msg_proto_has
+ * -------------
+ * Whether the space separated feature list (a JOIN or PROTO_ACK text)
+ * contains `feature`.
+ */
+int msg_proto_has(const char *features, const char *feature) {
+    size_t len = strlen(feature);
+    for (const char *p = features; p && *p; ) {
+        p += strspn(p, " ");
+        size_t word = strcspn(p, " ");
+        if (word == len && memcmp(p, feature, len) == 0) return 1;
+        p += word;
+    }
     return 0;
 }
 
+/*
+ * msg_send_v2
+ * -----------
+ * Blocking send of one v2 frame (clients never intern names). Bodies of at
+ * least `deflate_min` bytes are compressed when that shrinks them; 0 never
+ * compresses.
+ */
+int msg_send_v2(int sock, msg_type_t type, const char *name, const char *text, size_t deflate_min) {
+    size_t name_len = name ? strlen(name) : 0;
+    size_t text_len = text ? strlen(text) : 0;
+    if (name_len + text_len > MSG_BODY_MAX) return -1;
+
+    if (deflate_min && name_len + text_len >= deflate_min) {
+        msg_frame_t *plain = msg_frame_new_v2(type, name, text, 0);
+        if (!plain) return -1;
+        msg_frame_t *packed = msg_frame_deflate(plain);
+        int rc = msg_frame_send(sock, packed ? packed : plain);
+        msg_frame_unref(packed);
+        msg_frame_unref(plain);
+        return rc;
+    }
+
+    unsigned char prefix[1 + 3 * VARINT_MAX];
+    unsigned char *end = v2_put_prefix(prefix, type, name_len, text_len, 0);
+
+    struct iovec iov[3] = {
+        { prefix,       (size_t)(end - prefix) },
+        { (void *)name, name_len },
+        { (void *)text, text_len }
+    };
+    return send_iov_all(sock, iov, 3);
+}
+
+/*
+ * Sender ids a v2 peer has bound on this connection: open addressing on the
+ * id (never 0), kept at most half full.
+ */
+struct msg_sender_table {
+    uint32_t *ids;
+    char    **names;
+    size_t    count, slots;
+};
+
+static size_t sender_slot(const struct msg_sender_table *t, uint32_t id) {
+    size_t i = ((size_t)id * 0x9e3779b9u) & (t->slots - 1);
+    while (t->ids[i] && t->ids[i] != id) i = (i + 1) & (t->slots - 1);
+    return i;
+}
+
+static const char *sender_lookup(const struct msg_sender_table *t, uint32_t id) {
+    if (!t || !t->count) return NULL;
+    size_t i = sender_slot(t, id);
+    return t->ids[i] ? t->names[i] : NULL;
+}
+
+static void sender_table_free(struct msg_sender_table *t) {
+    if (!t) return;
+    for (size_t i = 0; i < t->slots; i++) pool_free(t->names[i]);
+    free(t->ids);
+    free(t->names);
+    free(t);
+}
+
+/*
+ * Binds `id` to a copy of name[0..name_len). Returns 0, or -1 on allocation
+ * failure or when the peer binds more than MSG_SENDERS_MAX ids.
+ */
+static int sender_bind(msg_reader_t *rd, uint32_t id, const unsigned char *name, size_t name_len) {
+    struct msg_sender_table *t = rd->senders;
+    if (!t) {
+        t = rd->senders = calloc(1, sizeof(*t));
+        if (!t) return -1;
+    }
+    if (t->count >= MSG_SENDERS_MAX && !sender_lookup(t, id)) return -1;
+    if ((t->count + 1) * 2 > t->slots) {
+        size_t    slots = t->slots ? t->slots * 2 : 16;
+        uint32_t *ids   = calloc(slots, sizeof(*ids));
+        char    **names = calloc(slots, sizeof(*names));
+        if (!ids || !names) { free(ids); free(names); return -1; }
+        struct msg_sender_table grown = { ids, names, t->count, slots };
+        for (size_t i = 0; i < t->slots; i++) {
+            if (!t->ids[i]) continue;
+            size_t j = sender_slot(&grown, t->ids[i]);
+            ids[j]   = t->ids[i];
+            names[j] = t->names[i];
+        }
+        free(t->ids);
+        free(t->names);
+        *t = grown;
+    }
+
+    char *copy = pool_alloc(name_len + 1);
+    if (!copy) return -1;
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+
+    size_t i = sender_slot(t, id);
+    if (t->ids[i]) pool_free(t->names[i]);
+    else           t->count++;
+    t->ids[i]   = id;
+    t->names[i] = copy;
+    return 0;
+}
+
+/* pool-allocated, NUL-terminated copy of p[0..len), or NULL for len == 0. */
+static int copy_field(const unsigned char *p, size_t len, char **out) {
+    *out = NULL;
+    if (!len) return 0;
+    *out = pool_alloc(len + 1);
+    if (!*out) return -1;
+    memcpy(*out, p, len);
+    (*out)[len] = '\0';
+    return 0;
+}
+
+/*
+ * Total length of the frame starting at p (either version) if its header is
+ * complete and sane, else 0.
+ */
+static size_t frame_total_len(const unsigned char *p, size_t avail) {
+    if (!avail) return 0;
+    if (p[0] & MSG_V2_TAG) {
+        uint32_t body;
+        int used = varint_get(p + 1, avail - 1, &body);
+        return (used > 0 && body <= MSG_BODY_MAX) ? 1 + (size_t)used + body : 0;
+    }
+    if (avail < sizeof(uint32_t)) return 0;
+    uint32_t wire_len_net;
+    memcpy(&wire_len_net, p, sizeof(wire_len_net));
+    uint32_t body = ntohl(wire_len_net);
+    return body <= MSG_BODY_MAX ? sizeof(wire_len_net) + body : 0;
+}
+
+/*
+ * Parses a plain (uncompressed) v2 body; see decode_v2().
+ * Returns 0, or -1 on a malformed body.
+ */
+static int decode_v2_body(msg_reader_t *rd, unsigned tag, const unsigned char *body, size_t body_len,
+                          msg_type_t *type, char **name_out, char **text_out) {
+    const unsigned char *end = body + body_len;
+    msg_type_t t = (msg_type_t)(tag & MSG_V2_TYPE_MASK);
+    const char *interned = NULL;
+    uint32_t value;
+    int used;
+
+    /* Only servers bind ids, and a binding always carries its id. */
+    if (t == MSG_SENDER_ID && (rd->from_client || !(tag & MSG_V2_SENDER))) return -1;
+
+    if (tag & MSG_V2_SENDER) {
+        used = varint_get(body, (size_t)(end - body), &value);
+        if (used <= 0 || value == 0) return -1;
+        body += used;
+        uint32_t sender_id = value;
+
+        if (t == MSG_SENDER_ID) {
+            used = varint_get(body, (size_t)(end - body), &value);
+            if (used <= 0 || value != (size_t)(end - body - used)) return -1;
+            if (sender_bind(rd, sender_id, body + used, value) != 0) return -1;
+            *type = t;
+            if (name_out) *name_out = NULL;
+            if (text_out) *text_out = NULL;
+            return 0;
+        }
+        interned = sender_lookup(rd->senders, sender_id);
+        if (!interned) return -1;
+    } else {
+        used = varint_get(body, (size_t)(end - body), &value);
+        if (used <= 0 || value > (size_t)(end - body - used)) return -1;
+        body += used;
+    }
+
+    char *name_buf = NULL, *text_buf = NULL;
+    size_t name_len = interned ? strlen(interned) : value;
+    const unsigned char *name_src = interned ? (const unsigned char *)interned : body;
+    if (!interned) body += name_len;
+
+    if (copy_field(name_src, name_len, &name_buf) != 0 ||
+        copy_field(body, (size_t)(end - body), &text_buf) != 0) {
+        pool_free(name_buf);
+        return -1;
+    }
+
+    *type = t;
+    if (name_out) *name_out = name_buf; else pool_free(name_buf);
+    if (text_out) *text_out = text_buf; else pool_free(text_buf);
+    return 0;
+}
+
+/*
+ * Inflates a MSG_V2_DEFLATE body into a pool-allocated plain body of exactly
+ * the announced length (bounded like any other body).
+ * Returns 0, or -1 on a malformed or oversized stream.
+ */
+static int inflate_body(const unsigned char *body, size_t body_len,
+                        unsigned char **plain_out, size_t *plain_len_out) {
+    uint32_t plain_len;
+    int used = varint_get(body, body_len, &plain_len);
+    if (used <= 0 || plain_len > MSG_BODY_MAX) return -1;
+
+    unsigned char *plain = pool_alloc(plain_len ? plain_len : 1);
+    if (!plain) return -1;
+    uLongf out_len = plain_len;
+    if (uncompress(plain, &out_len, body + used, (uLong)(body_len - (size_t)used)) != Z_OK ||
+        out_len != plain_len) {
+        pool_free(plain);
+        return -1;
+    }
+    *plain_out     = plain;
+    *plain_len_out = plain_len;
+    return 0;
+}
+
+/*
+ * decode_v2
+ * ---------
+ * v2 counterpart of msg_decode(); interned sender ids are resolved through
+ * (and MSG_SENDER_ID frames recorded in) the reader's table, and compressed
+ * bodies are inflated first. A MSG_SENDER_ID frame is returned with no
+ * name/text for the caller to skip.
+ * Returns bytes consumed, 0 if more data is needed, -1 on a malformed frame.
+ */
+static int decode_v2(msg_reader_t *rd, const unsigned char *p, size_t len,
+                     msg_type_t *type, char **name_out, char **text_out) {
+    uint32_t body_len;
+    int used = varint_get(p + 1, len - 1, &body_len);
+    if (used <= 0) return used;
+    if (body_len > MSG_BODY_MAX) return -1;
+    size_t header = 1 + (size_t)used;
+    if (len - header < body_len) return 0;
+
+    unsigned tag = p[0];
+    const unsigned char *body = p + header;
+    if (!(tag & MSG_V2_DEFLATE)) {
+        if (decode_v2_body(rd, tag, body, body_len, type, name_out, text_out) != 0) return -1;
+        return (int)(header + body_len);
+    }
+
+    unsigned char *plain;
+    size_t plain_len;
+    if (inflate_body(body, body_len, &plain, &plain_len) != 0) return -1;
+    int rc = decode_v2_body(rd, tag, plain, plain_len, type, name_out, text_out);
+    pool_free(plain);
+    return rc != 0 ? -1 : (int)(header + body_len);
+}
+
+/*
+ * msg_reader_init / msg_reader_free
+ * ---------------------------------
+ * The buffer is allocated lazily on the first fill, so connections that
+ * never send anything cost nothing.
+ */
+void msg_reader_init(msg_reader_t *rd, int fd) {
+    memset(rd, 0, sizeof(*rd));
+    rd->fd = fd;
+}
+
+void msg_reader_free(msg_reader_t *rd) {
+    pool_free(rd->buf);
+    rd->buf = NULL;
+    rd->cap = rd->start = rd->end = 0;
+    sender_table_free(rd->senders);
+    rd->senders = NULL;
+}
+
+/*
+ * msg_reader_trim
+ * ---------------
+ * Releases the buffer if it holds no partial frame. Event-driven callers use
+ * this once a socket is drained so idle connections do not pin memory.
+ */
+void msg_reader_trim(msg_reader_t *rd) {
+    if (rd->start != rd->end) return;
+    pool_free(rd->buf);
+    rd->buf = NULL;
+    rd->cap = rd->start = rd->end = 0;
+}
+
+/*
+ * Moves the pending bytes to the front of a buffer of at least `need` bytes,
+ * reallocating only if the current one is too small.
+ */
+static int reader_regrow(msg_reader_t *rd, size_t need) {
+    size_t pending = rd->end - rd->start;
+
+    if (rd->cap >= need) {
+        memmove(rd->buf, rd->buf + rd->start, pending);
+    } else {
+        size_t new_cap = rd->cap ? rd->cap : MSG_READER_CHUNK;
+        while (new_cap < need) new_cap *= 2;
+        unsigned char *grown = pool_alloc(new_cap);
+        if (!grown) { errno = ENOMEM; return -1; }
+        if (pending) memcpy(grown, rd->buf + rd->start, pending);
+        pool_free(rd->buf);
+        rd->buf = grown;
+        rd->cap = new_cap;
+    }
+    rd->start = 0;
+    rd->end   = pending;
+    return 0;
+}
+
+/*
+ * msg_reader_fill
+ * ---------------
+ * One recv() into the free tail of the buffer. Makes room first: when the
+ * pending frame's length prefix says it is larger than the buffer, grows it to
+ * fit (bounded by the 32MB frame cap); otherwise compacts consumed bytes away
+ * once the tail gets short.
+ * Returns:
+ *   >0 bytes received
+ *    0 on orderly shutdown by the peer
+ *   -1 on error (errno set; EAGAIN for a drained non-blocking socket)
+ */
+ssize_t msg_reader_fill(msg_reader_t *rd) {
+    size_t pending = rd->end - rd->start;
+    size_t need    = MSG_READER_CHUNK;
+
+    /* A partially received frame tells us how much room it will need. */
+    size_t frame_len = frame_total_len(rd->buf + rd->start, pending);
+    if (frame_len > need) need = frame_len;
+
+    if (rd->cap < need || (rd->start && rd->cap - rd->end < MSG_READER_CHUNK / 4)) {
+        if (reader_regrow(rd, need) != 0) return -1;
+    }
+
+    ssize_t recvd = recv(rd->fd, rd->buf + rd->end, rd->cap - rd->end, 0);
+    if (recvd > 0) rd->end += (size_t)recvd;
+    return recvd;
+}
+
+/*
+ * msg_reader_feed
+ * ---------------
+ * Appends bytes that were received elsewhere (e.g. into an io_uring provided
+ * buffer) so msg_reader_next() can parse them.
+ * Returns 0, or -1 if the buffer could not grow.
+ */
+int msg_reader_feed(msg_reader_t *rd, const void *data, size_t len) {
+    if (rd->cap - rd->end < len) {
+        size_t need = rd->end - rd->start + len;
+        if (need < MSG_READER_CHUNK) need = MSG_READER_CHUNK;
+        if (reader_regrow(rd, need) != 0) return -1;
+    }
+    memcpy(rd->buf + rd->end, data, len);
+    rd->end += len;
+    return 0;
+}
+
+/*
+ * msg_reader_next
+ * ---------------
+ * Parses the next complete frame (v1 or v2) already sitting in the buffer
+ * (no I/O). Same validation and ownership rules as msg_recv().
+ * Returns:
+ *   1 if a frame was decoded
+ *   0 if more data is needed
+ *  -1 on a malformed frame
+ */
+int msg_reader_next(msg_reader_t *rd, msg_type_t *type, char **name_out, char **text_out) {
+    for (;;) {
+        size_t avail = rd->end - rd->start;
+        if (!avail) return 0;
+
+        const unsigned char *p = rd->buf + rd->start;
+        int used = (p[0] & MSG_V2_TAG) ? decode_v2(rd, p, avail, type, name_out, text_out)
+                                       : msg_decode(p, avail, type, name_out, text_out);
+        if (used <= 0) return used;
+
+        rd->start += (size_t)used;
+        if (rd->start == rd->end) rd->start = rd->end = 0;
+        /* Sender id bindings are bookkeeping, not messages. */
+        if (!(p[0] & MSG_V2_TAG) || *type != MSG_SENDER_ID) return 1;
+        if (name_out) { msg_free(*name_out, NULL); *name_out = NULL; }
+        if (text_out) { msg_free(NULL, *text_out); *text_out = NULL; }
+    }
+}
+
+/*
+ * msg_reader_recv
+ * ---------------
+ * Blocking drop-in for msg_recv(): returns the next frame, reading from the
+ * socket only when the buffer does not already hold one.
+ * Returns:
+ *   0 on success
+ *  -1 on malformed frame, socket error or closure.
+ */
+int msg_reader_recv(msg_reader_t *rd, msg_type_t *type, char **name_out, char **text_out) {
+    for (;;) {
+        TRACE_BEGIN(span);
+        int parsed = msg_reader_next(rd, type, name_out, text_out);
+        if (parsed > 0) {
+            TRACE_END(span, "msg_decode", 0, TRACE_FLOW_NONE, (uint32_t)rd->fd);
+            return 0;
+        }
+        if (parsed < 0) return -1;
+
+        ssize_t recvd = msg_reader_fill(rd);
+        if (recvd < 0 && errno == EINTR) continue;
+        if (recvd <= 0) return -1;
+    }
+}
+
+/*
+ * msg_frame_new
+ * -------------
+ * Encodes a frame once into a single allocation with a reference count of 1.
+ * Returns NULL on allocation failure.
+ */
+msg_frame_t *msg_frame_new(msg_type_t type, const char *name, const char *text) {
+    size_t len = msg_encoded_len(name, text);
+    msg_frame_t *frame = pool_alloc(sizeof(*frame) + len);
+    if (!frame) return NULL;
+
+    atomic_init(&frame->refs, 1);
+    frame->keep = 0;
+    frame->len  = len;
+    msg_encode(frame->data, type, name, text);
+    return frame;
+}
+
+/*
+ * msg_frame_new_v2
+ * ----------------
+ * Same as msg_frame_new(), in v2 framing (see msg_encode_v2()).
+ */
+msg_frame_t *msg_frame_new_v2(msg_type_t type, const char *name, const char *text, uint32_t sender_id) {
+    size_t len = msg_encoded_len_v2(type, name, text, sender_id);
+    msg_frame_t *frame = pool_alloc(sizeof(*frame) + len);
+    if (!frame) return NULL;
+
+    atomic_init(&frame->refs, 1);
+    frame->keep = (type == MSG_SENDER_ID);
+    frame->len  = len;
+    msg_encode_v2(frame->data, type, name, text, sender_id);
+    return frame;
+}
+
+/*
+ * Compresses src into dst (*dst_len in: capacity, out: used) with a
+ * per-thread stream that is reset rather than rebuilt between frames:
+ * setting up deflate state costs more than compressing a typical note.
+ */
+static int deflate_buf(unsigned char *dst, uLongf *dst_len, const unsigned char *src, size_t src_len) {
+    static _Thread_local z_stream t_zs;
+    static _Thread_local int      t_zs_ready;
+
+    if (!t_zs_ready) {
+        if (deflateInit(&t_zs, DEFLATE_LEVEL) != Z_OK) return -1;
+        t_zs_ready = 1;
+    } else if (deflateReset(&t_zs) != Z_OK) {
+        return -1;
+    }
+    t_zs.next_in   = (Bytef *)src;
+    t_zs.avail_in  = (uInt)src_len;
+    t_zs.next_out  = dst;
+    t_zs.avail_out = (uInt)*dst_len;
+    if (deflate(&t_zs, Z_FINISH) != Z_STREAM_END) return -1;
+    *dst_len = t_zs.total_out;
+    return 0;
+}
+
+/*
+ * msg_frame_deflate
+ * -----------------
+ * Builds the MSG_V2_DEFLATE version of a plain v2 frame, to be shared by
+ * every peer that negotiated compression. Marks carry over.
+ * Returns NULL if the frame is not v2, is already compressed, would not get
+ * smaller, or memory ran out.
+ */
+msg_frame_t *msg_frame_deflate(const msg_frame_t *frame) {
+    if (!(frame->data[0] & MSG_V2_TAG) || (frame->data[0] & MSG_V2_DEFLATE)) return NULL;
+    uint32_t plain_len;
+    int used = varint_get(frame->data + 1, frame->len - 1, &plain_len);
+    if (used <= 0) return NULL;
+    const unsigned char *plain = frame->data + 1 + used;
+
+    uLongf packed_len = compressBound(plain_len);
+    unsigned char *packed = pool_alloc(packed_len);
+    if (!packed) return NULL;
+    if (deflate_buf(packed, &packed_len, plain, plain_len) != 0) {
+        pool_free(packed);
+        return NULL;
+    }
+
+    size_t body = varint_len(plain_len) + packed_len;
+    size_t len  = 1 + varint_len((uint32_t)body) + body;
+    msg_frame_t *out = NULL;
+    if (len < frame->len && body <= MSG_BODY_MAX) out = pool_alloc(sizeof(*out) + len);
+    if (out) {
+        atomic_init(&out->refs, 1);
+        out->keep = frame->keep;
+        out->len  = len;
+        unsigned char *p = out->data;
+        *p++ = frame->data[0] | MSG_V2_DEFLATE;
+        p = varint_put(p, (uint32_t)body);
+        p = varint_put(p, plain_len);
+        memcpy(p, packed, packed_len);
+    }
+    pool_free(packed);
+    return out;
+}
+
+/*
+ * msg_frame_ref / msg_frame_unref
+ * -------------------------------
+ * Share a frame with another recipient / release one share. The last
+ * unref frees it. Safe to call from different threads.
+ */
+msg_frame_t *msg_frame_ref(msg_frame_t *frame) {
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+    return frame;
+}
+
+void msg_frame_unref(msg_frame_t *frame) {
+    if (!frame) return;
+    if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) == 1)
+        pool_free(frame);
+}
+
+/*
+ * msg_frame_send
+ * --------------
+ * Blocking send of a pre-encoded frame (thread-per-client mode).
+ * Returns 0 on success, -1 on failure.
+ */
+int msg_frame_send(int sock, const msg_frame_t *frame) {
+    TRACE_BEGIN(span);
+    int rc = send_all(sock, frame->data, frame->len);
+    TRACE_END(span, "msg_frame_send", TRACE_CURRENT(), TRACE_FLOW_STEP, (uint32_t)sock);
+    return rc;
+}
+
 /*
  * msg_free
  * --------
- * Frees the name and text buffers allocated by msg_recv().
+ * Frees the name and text buffers allocated by msg_recv() and friends
+ * (they come from the slab pools in pool.c, not malloc).
  */
 void msg_free(char *name, char *text) {
-    free(name);
-    free(text);
+    pool_free(name);
+    pool_free(text);
 }
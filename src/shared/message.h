@@ -1,6 +1,8 @@
 #pragma once
 #include <stdint.h>
 #include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
 
 // Message types
 typedef enum {
@@ -9,12 +11,25 @@ typedef enum {
     MSG_NOTE = 3,
     MSG_SHUTDOWN = 4,
     MSG_SHUTDOWN_ALL = 5,
+    MSG_ROOM_JOIN = 6,          // text = room to move to
+    MSG_ROOM_LEAVE = 7,         // back to the lobby
+    MSG_ROOM_LIST = 8,
+    MSG_DIRECT = 9,             // name = recipient, text = message
 
     // server -> client indications
     MSG_JOINING = 10,
     MSG_LEFT = 11,
     MSG_DELIVER = 12,
-    MSG_BYE = 13
+    MSG_BYE = 13,
+    MSG_ROOM_ENTERED = 14,      // name entered room `text` (also sent to the mover)
+    MSG_ROOM_EXITED = 15,       // name left room `text`
+    MSG_ROOM_LIST_REPLY = 16,   // text = "room (members), ..."
+    MSG_DIRECT_DELIVER = 17,    // private message from `name`
+    MSG_ERROR = 18,             // text = why the last request failed
+    MSG_PROTO_ACK = 19,         // text = wire protocol the server switched to (MSG_PROTO_V2)
+    MSG_SENDER_ID = 20,         // v2 only: binds an interned sender id to a name
+    MSG_HISTORY = 21,           // text = "[first_seq | @unix_time] [count]": logged notes of our room
+    MSG_HISTORY_ENTRY = 22      // name = sender, text = "seq unix_time note"
 } msg_type_t;
 
 typedef struct {
@@ -23,9 +38,100 @@ typedef struct {
     uint32_t text_len;
 } msg_hdr_t;
 
+/*
+ * Wire protocol v2
+ * ----------------
+ * A client asks for it by sending JOIN whose text is a space separated feature
+ * list containing MSG_PROTO_V2 (and MSG_PROTO_DEFLATE if it can take
+ * compressed frames); a server that supports it answers MSG_PROTO_ACK (still
+ * v1 framed, text = the features it accepted) before anything else and then
+ * sends v2 frames. Either side may keep sending v1 frames: the first byte
+ * tells them apart (a v1 length prefix never has its top bit set), so readers
+ * always accept both.
+ *
+ *   [tag: 0x80 | flags | type][varint body_len][body]
+ *   body without MSG_V2_SENDER: [varint name_len][name][text]
+ *   body with MSG_V2_SENDER:    [varint sender_id][text]
+ *                               (MSG_SENDER_ID: [varint sender_id][varint name_len][name])
+ *
+ * With MSG_V2_DEFLATE the body is [varint plain_len][zlib stream of the plain
+ * body above]; it is only sent to peers that negotiated MSG_PROTO_DEFLATE, and
+ * only when that makes the frame smaller.
+ *
+ * Varints are LEB128, at most 5 bytes. A sender id stands for the name it was
+ * bound to by an earlier MSG_SENDER_ID frame on the same connection;
+ * msg_reader_t resolves and swallows those frames.
+ */
+#define MSG_PROTO_V2      "v2"
+#define MSG_PROTO_DEFLATE "deflate"
+#define MSG_V2_TAG        0x80
+#define MSG_V2_DEFLATE    0x40      /* body is zlib-compressed */
+#define MSG_V2_SENDER     0x20      /* name replaced by an interned sender id */
+#define MSG_V2_TYPE_MASK  0x1f
+#define MSG_DEFLATE_MIN   1024      /* smaller bodies rarely compress enough to pay */
+
+int  msg_proto_has(const char *features, const char *feature);
+
 int  msg_send(int sock, msg_type_t type, const char *name, const char *text);
+int  msg_send_v2(int sock, msg_type_t type, const char *name, const char *text, size_t deflate_min);
 int  msg_recv(int sock, msg_type_t *type, char **name_out, char **text_out);
 void msg_free(char *name, char *text);
 
+/* Buffer-based framing for non-blocking I/O (same wire format as msg_send/msg_recv). */
+size_t msg_encoded_len(const char *name, const char *text);
+void   msg_encode(void *dst, msg_type_t type, const char *name, const char *text);
+int    msg_decode(const void *buf, size_t len, msg_type_t *type, char **name_out, char **text_out);
+size_t msg_encoded_len_v2(msg_type_t type, const char *name, const char *text, uint32_t sender_id);
+void   msg_encode_v2(void *dst, msg_type_t type, const char *name, const char *text, uint32_t sender_id);
+
+/*
+ * Pre-serialized, reference-counted frame for broadcasts: encoded once, then
+ * shared by every recipient's send path and freed by the last msg_frame_unref().
+ */
+typedef struct {
+    _Atomic unsigned refs;
+    unsigned char    keep;          /* later frames depend on it: never drop it */
+    size_t           len;
+    unsigned char    data[];        /* one complete v1 or v2 frame */
+} msg_frame_t;
+
+msg_frame_t *msg_frame_new(msg_type_t type, const char *name, const char *text);
+msg_frame_t *msg_frame_new_v2(msg_type_t type, const char *name, const char *text, uint32_t sender_id);
+msg_frame_t *msg_frame_deflate(const msg_frame_t *frame);
+msg_frame_t *msg_frame_ref(msg_frame_t *frame);
+void         msg_frame_unref(msg_frame_t *frame);
+int          msg_frame_send(int sock, const msg_frame_t *frame);
+
+/*
+ * Buffered frame reader: large recv()s into a per-connection buffer, then as
+ * many complete frames as it holds are parsed out without further syscalls.
+ * Unparsed bytes live in buf[start, end). Reads v1 and v2 frames alike; the
+ * v2 sender ids seen on this connection are kept in `senders` (at most
+ * MSG_SENDERS_MAX). Servers set `from_client`: clients never bind sender ids,
+ * so a MSG_SENDER_ID frame from one is malformed.
+ */
+#define MSG_SENDERS_MAX (1u << 18)
+
+struct msg_sender_table;
+
+typedef struct {
+    int            fd;
+    unsigned char *buf;
+    size_t         cap;
+    size_t         start, end;
+    struct msg_sender_table *senders;
+    int            from_client;
+} msg_reader_t;
+
+void    msg_reader_init(msg_reader_t *rd, int fd);
+void    msg_reader_free(msg_reader_t *rd);
+void    msg_reader_trim(msg_reader_t *rd);
+ssize_t msg_reader_fill(msg_reader_t *rd);
+int     msg_reader_feed(msg_reader_t *rd, const void *data, size_t len);
+int     msg_reader_next(msg_reader_t *rd, msg_type_t *type, char **name_out, char **text_out);
+int     msg_reader_recv(msg_reader_t *rd, msg_type_t *type, char **name_out, char **text_out);
+
+struct iovec;
 int  send_all(int fd, const void *buf, size_t len);
+int  send_iov_all(int fd, struct iovec *iov, int iovcnt);
 int  recv_all(int fd, void *buf, size_t len);
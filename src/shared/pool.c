@@ -0,0 +1,350 @@
+#include "slog.h"
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_MIN_SHIFT  5                   /* smallest class: 32 bytes */
+#define POOL_CLASSES    12                  /* 32 B .. 64 KB, powers of two */
+#define POOL_BIG        POOL_CLASSES        /* header tag for malloc'd oversize blocks */
+#define POOL_BATCH      32                  /* blocks moved per depot refill/spill */
+#define POOL_CACHE_MAX  (2 * POOL_BATCH)    /* per-thread free blocks kept per class */
+#define POOL_SLAB_BYTES (256 * 1024)        /* carved into blocks when the depot is dry */
+#define SCRATCH_CHUNK   4096
+
+/*
+ * Every block is preceded by a 16-byte header remembering its class, so
+ * pool_free() needs no size argument and payload alignment stays at 16.
+ */
+typedef struct {
+    uint32_t cls;
+    uint32_t unused[3];
+} pool_hdr_t;
+
+typedef struct pool_block {
+    struct pool_block *next;
+} pool_block_t;
+
+typedef struct scratch_chunk {
+    struct scratch_chunk *prev;
+    size_t                cap, used;
+    unsigned char         data[];
+} scratch_chunk_t;
+
+/*
+ * Per-thread state. Counters are only written by the owning thread; they are
+ * atomics so pool_log_stats() may read them from another thread.
+ */
+typedef struct pool_cache {
+    pool_block_t     *free[POOL_CLASSES];
+    unsigned          count[POOL_CLASSES];
+    _Atomic uint64_t  hits[POOL_CLASSES + 1];
+    _Atomic uint64_t  misses[POOL_CLASSES + 1];
+    scratch_chunk_t  *scratch;
+    struct pool_cache *prev, *next;         /* registry of live caches */
+} pool_cache_t;
+
+static struct {
+    pthread_mutex_t mx;
+    pool_block_t   *free[POOL_CLASSES];
+    size_t          count[POOL_CLASSES];
+    pool_cache_t   *caches;                 /* live thread caches, for stats */
+    uint64_t        retired_hits[POOL_CLASSES + 1];
+    uint64_t        retired_misses[POOL_CLASSES + 1];
+} g_depot = { .mx = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_key_t  g_cache_key;
+static pthread_once_t g_cache_once = PTHREAD_ONCE_INIT;
+static _Thread_local pool_cache_t *t_cache;
+
+static size_t class_size(unsigned cls) {
+    return (size_t)1 << (cls + POOL_MIN_SHIFT);
+}
+
+static unsigned class_for(size_t size) {
+    unsigned cls = 0;
+    while (cls < POOL_CLASSES && class_size(cls) < size) cls++;
+    return cls;    /* POOL_BIG if it does not fit any class */
+}
+
+/*
+ * Returns every block a cache holds to the depot and folds its counters into
+ * the retired totals. Runs when a thread exits (pthread key destructor).
+ */
+static void cache_destroy(void *arg) {
+    pool_cache_t *cache = arg;
+
+    pthread_mutex_lock(&g_depot.mx);
+    for (unsigned cls = 0; cls < POOL_CLASSES; cls++) {
+        while (cache->free[cls]) {
+            pool_block_t *b = cache->free[cls];
+            cache->free[cls] = b->next;
+            b->next = g_depot.free[cls];
+            g_depot.free[cls] = b;
+            g_depot.count[cls]++;
+        }
+    }
+    for (unsigned cls = 0; cls <= POOL_CLASSES; cls++) {
+        g_depot.retired_hits[cls]   += atomic_load_explicit(&cache->hits[cls], memory_order_relaxed);
+        g_depot.retired_misses[cls] += atomic_load_explicit(&cache->misses[cls], memory_order_relaxed);
+    }
+    if (cache->prev) cache->prev->next = cache->next;
+    else             g_depot.caches = cache->next;
+    if (cache->next) cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&g_depot.mx);
+
+    while (cache->scratch) {
+        scratch_chunk_t *prev = cache->scratch->prev;
+        free(cache->scratch);
+        cache->scratch = prev;
+    }
+    free(cache);
+    t_cache = NULL;
+}
+
+static void make_cache_key(void) {
+    pthread_key_create(&g_cache_key, cache_destroy);
+}
+
+/*
+ * The calling thread's cache, created on first use (one malloc per thread).
+ */
+static pool_cache_t *my_cache(void) {
+    if (t_cache) return t_cache;
+
+    pthread_once(&g_cache_once, make_cache_key);
+    pool_cache_t *cache = calloc(1, sizeof(*cache));
+    if (!cache) return NULL;
+
+    pthread_mutex_lock(&g_depot.mx);
+    cache->next = g_depot.caches;
+    if (g_depot.caches) g_depot.caches->prev = cache;
+    g_depot.caches = cache;
+    pthread_mutex_unlock(&g_depot.mx);
+
+    pthread_setspecific(g_cache_key, cache);
+    t_cache = cache;
+    return cache;
+}
+
+static void count_event(_Atomic uint64_t *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+/*
+ * refill
+ * ------
+ * Moves up to POOL_BATCH blocks of one class from the depot into the cache.
+ * If the depot is empty, carves a fresh slab instead (the only malloc on
+ * the pooled path). Returns 1 if a slab had to be allocated, 0 if the depot
+ * served the request, -1 on allocation failure.
+ */
+static int refill(pool_cache_t *cache, unsigned cls) {
+    pthread_mutex_lock(&g_depot.mx);
+    for (int i = 0; i < POOL_BATCH && g_depot.free[cls]; i++) {
+        pool_block_t *b = g_depot.free[cls];
+        g_depot.free[cls] = b->next;
+        g_depot.count[cls]--;
+        b->next = cache->free[cls];
+        cache->free[cls] = b;
+        cache->count[cls]++;
+    }
+    pthread_mutex_unlock(&g_depot.mx);
+    if (cache->free[cls]) return 0;
+
+    size_t block = sizeof(pool_hdr_t) + class_size(cls);
+    size_t per_slab = POOL_SLAB_BYTES / block;
+    if (per_slab < 4) per_slab = 4;
+
+    unsigned char *slab = malloc(per_slab * block);
+    if (!slab) return -1;
+    for (size_t i = 0; i < per_slab; i++) {
+        pool_hdr_t *hdr = (pool_hdr_t *)(slab + i * block);
+        hdr->cls = cls;
+        pool_block_t *b = (pool_block_t *)(hdr + 1);
+        b->next = cache->free[cls];
+        cache->free[cls] = b;
+        cache->count[cls]++;
+    }
+    return 1;
+}
+
+/*
+ * pool_alloc
+ * ----------
+ * Returns a block of at least `size` bytes, or NULL on allocation failure.
+ * Release it with pool_free() from any thread.
+ */
+void *pool_alloc(size_t size) {
+    unsigned cls = class_for(size);
+    pool_cache_t *cache = my_cache();
+
+    if (cls == POOL_BIG || !cache) {
+        pool_hdr_t *hdr = malloc(sizeof(*hdr) + size);
+        if (!hdr) return NULL;
+        hdr->cls = POOL_BIG;
+        if (cache) count_event(&cache->misses[POOL_BIG]);
+        return hdr + 1;
+    }
+
+    if (!cache->free[cls]) {
+        int carved = refill(cache, cls);
+        if (carved < 0) return NULL;
+        count_event(carved ? &cache->misses[cls] : &cache->hits[cls]);
+    } else {
+        count_event(&cache->hits[cls]);
+    }
+
+    pool_block_t *b = cache->free[cls];
+    cache->free[cls] = b->next;
+    cache->count[cls]--;
+    return b;
+}
+
+/*
+ * pool_free
+ * ---------
+ * Returns a block to the calling thread's cache; when the cache holds too
+ * many blocks of that class, a batch is spilled to the depot.
+ */
+void pool_free(void *ptr) {
+    if (!ptr) return;
+    pool_hdr_t *hdr = (pool_hdr_t *)ptr - 1;
+    unsigned cls = hdr->cls;
+    pool_cache_t *cache = my_cache();
+
+    if (cls == POOL_BIG || !cache) {
+        if (cls == POOL_BIG) { free(hdr); return; }
+        /* No cache (OOM): hand the block straight to the depot. */
+        pool_block_t *b = ptr;
+        pthread_mutex_lock(&g_depot.mx);
+        b->next = g_depot.free[cls];
+        g_depot.free[cls] = b;
+        g_depot.count[cls]++;
+        pthread_mutex_unlock(&g_depot.mx);
+        return;
+    }
+
+    pool_block_t *b = ptr;
+    b->next = cache->free[cls];
+    cache->free[cls] = b;
+    cache->count[cls]++;
+
+    if (cache->count[cls] > POOL_CACHE_MAX) {
+        pthread_mutex_lock(&g_depot.mx);
+        for (int i = 0; i < POOL_BATCH; i++) {
+            pool_block_t *spill = cache->free[cls];
+            cache->free[cls] = spill->next;
+            cache->count[cls]--;
+            spill->next = g_depot.free[cls];
+            g_depot.free[cls] = spill;
+            g_depot.count[cls]++;
+        }
+        pthread_mutex_unlock(&g_depot.mx);
+    }
+}
+
+/*
+ * pool_strndup
+ * ------------
+ * Copies `len` bytes into a pooled, NUL-terminated string.
+ */
+char *pool_strndup(const char *src, size_t len) {
+    char *dst = pool_alloc(len + 1);
+    if (!dst) return NULL;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return dst;
+}
+
+/*
+ * pool_scratch_alloc
+ * ------------------
+ * Bump-allocates from the calling thread's scratch arena. Everything handed
+ * out stays valid until pool_scratch_reset(). Chunks are only malloc'd while
+ * the arena is still growing towards its working-set size.
+ */
+void *pool_scratch_alloc(size_t size) {
+    pool_cache_t *cache = my_cache();
+    if (!cache) return NULL;
+
+    size = (size + 15) & ~(size_t)15;
+    scratch_chunk_t *chunk = cache->scratch;
+    if (!chunk || chunk->cap - chunk->used < size) {
+        size_t cap = chunk ? chunk->cap * 2 : SCRATCH_CHUNK;
+        while (cap < size) cap *= 2;
+        scratch_chunk_t *fresh = malloc(sizeof(*fresh) + cap);
+        if (!fresh) return NULL;
+        fresh->prev = chunk;
+        fresh->cap  = cap;
+        fresh->used = 0;
+        cache->scratch = chunk = fresh;
+    }
+
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+/*
+ * pool_scratch_reset
+ * ------------------
+ * Releases everything allocated from the scratch arena since the last reset.
+ * Only the newest (largest) chunk is kept, so after warm-up a whole message's
+ * scratch fits in one chunk and no further malloc happens.
+ */
+void pool_scratch_reset(void) {
+    pool_cache_t *cache = t_cache;
+    if (!cache || !cache->scratch) return;
+
+    scratch_chunk_t *keep = cache->scratch;
+    while (keep->prev) {
+        scratch_chunk_t *older = keep->prev;
+        keep->prev = older->prev;
+        free(older);
+    }
+    keep->used = 0;
+}
+
+/*
+ * pool_log_stats
+ * --------------
+ * Logs, per size class, how many allocations were served from pooled blocks
+ * (hits) versus how many had to go to malloc (misses), summed over all
+ * threads past and present.
+ */
+void pool_log_stats(void) {
+    uint64_t hits[POOL_CLASSES + 1], misses[POOL_CLASSES + 1];
+    size_t   depot[POOL_CLASSES];
+
+    pthread_mutex_lock(&g_depot.mx);
+    for (unsigned cls = 0; cls <= POOL_CLASSES; cls++) {
+        hits[cls]   = g_depot.retired_hits[cls];
+        misses[cls] = g_depot.retired_misses[cls];
+        if (cls < POOL_CLASSES) depot[cls] = g_depot.count[cls];
+    }
+    for (pool_cache_t *c = g_depot.caches; c; c = c->next) {
+        for (unsigned cls = 0; cls <= POOL_CLASSES; cls++) {
+            hits[cls]   += atomic_load_explicit(&c->hits[cls], memory_order_relaxed);
+            misses[cls] += atomic_load_explicit(&c->misses[cls], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&g_depot.mx);
+
+    for (unsigned cls = 0; cls <= POOL_CLASSES; cls++) {
+        uint64_t total = hits[cls] + misses[cls];
+        if (!total) continue;
+        if (cls == POOL_BIG) {
+            log_info("[pool] >%6zu B: %llu oversize allocations (malloc)",
+                     (size_t)POOL_MAX_SIZE, (unsigned long long)misses[cls]);
+        } else {
+            log_info("[pool] %7zu B: %llu allocs, %.2f%% hit rate, %zu blocks in depot",
+                     class_size(cls), (unsigned long long)total,
+                     100.0 * (double)hits[cls] / (double)total, depot[cls]);
+        }
+    }
+}
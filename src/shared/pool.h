@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * Size-classed slab pools for message payloads, frames and receive buffers.
+ *
+ * pool_alloc() serves blocks of up to POOL_MAX_SIZE bytes from a per-thread
+ * cache of free blocks (no locking, no malloc). Threads that free more than
+ * they allocate (e.g. the last reactor to send a shared frame) spill batches
+ * into a global depot that other threads refill from. Only a cold depot or an
+ * oversized request reaches malloc().
+ *
+ * The scratch arena is a per-thread bump allocator for short-lived data that
+ * dies together at the end of one message (e.g. recipient snapshots).
+ */
+#define POOL_MAX_SIZE (64 * 1024)
+
+void *pool_alloc(size_t size);
+void  pool_free(void *ptr);
+char *pool_strndup(const char *src, size_t len);
+
+void *pool_scratch_alloc(size_t size);
+void  pool_scratch_reset(void);
+
+void  pool_log_stats(void);
@@ -0,0 +1,426 @@
+#include "slog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define SLOG_TEXT       216         /* message bytes kept per line, longer ones end in "..." */
+#define SLOG_FLUSH_MS   100         /* longest a line waits in its ring */
+#define SLOG_PARK_MAX   1024        /* rings of exited threads kept for reuse */
+#define SLOG_OUT_BYTES  (64u << 10) /* writer batch buffer */
+#define SLOG_LINE_MAX   (6 * SLOG_TEXT + 512)   /* a formatted line, JSON escapes included */
+
+/* One line, formatted by the thread that logged it. */
+typedef struct {
+    uint64_t    ts;                 /* CLOCK_REALTIME ns */
+    const char *file;
+    int         line;
+    int         level;
+    int         err;                /* errno at the call (error / warn only) */
+    uint32_t    tid;
+    uint32_t    len;
+    char        text[SLOG_TEXT];
+} slog_record_t;
+
+/*
+ * Single producer (the owning thread) / single consumer (the writer): the
+ * owner fills rec[head] and publishes head, the writer formats rec[tail..head)
+ * and publishes tail. Full means drop, never wait.
+ */
+typedef struct slog_ring {
+    _Atomic uint64_t  head, tail;
+    _Atomic uint64_t  dropped;      /* owner only writes */
+    uint64_t          reported;     /* writer only: drops already reported */
+    uint32_t          tid;
+    struct slog_ring *next;         /* registry of all rings, never shrinks */
+    slog_record_t     rec[];
+} slog_ring_t;
+
+_Atomic int g_slog_level = SLOG_INFO;
+
+static int             g_async;             /* writer running: log calls go to rings */
+static int             g_json;
+static unsigned        g_rate;
+static size_t          g_records;           /* power of two */
+static int             g_fd = STDERR_FILENO;
+
+static _Thread_local slog_ring_t *t_ring;
+
+static pthread_mutex_t g_rings_mx = PTHREAD_MUTEX_INITIALIZER;
+static slog_ring_t    *g_rings;
+static slog_ring_t    *g_parked[SLOG_PARK_MAX];
+static size_t          g_parked_count;
+static pthread_key_t   g_key;
+static pthread_once_t  g_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t       g_writer;
+static sem_t           g_wake;
+static volatile int    g_writer_stop;
+static char            g_out[SLOG_OUT_BYTES];   /* writer only */
+static size_t          g_out_len;
+
+static const char *const g_level_names[] = { "error", "warn", "info", "debug" };
+static const char *const g_level_tags[]  = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+const char *slog_level_name(int level) {
+    return level >= SLOG_ERROR && level <= SLOG_DEBUG ? g_level_names[level] : "?";
+}
+
+/* Changes the level at runtime. Returns 0, or -1 for an unknown name. */
+int slog_set_level(const char *name) {
+    for (int level = SLOG_ERROR; level <= SLOG_DEBUG; level++) {
+        if (name && strcasecmp(name, g_level_names[level]) == 0) {
+            atomic_store_explicit(&g_slog_level, level, memory_order_relaxed);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint32_t thread_id(void) {
+    return (uint32_t)syscall(SYS_gettid);
+}
+
+static void park_ring(void *ring) {
+    pthread_mutex_lock(&g_rings_mx);
+    if (g_parked_count < SLOG_PARK_MAX) g_parked[g_parked_count++] = ring;
+    pthread_mutex_unlock(&g_rings_mx);
+}
+
+static void make_key(void) {
+    pthread_key_create(&g_key, park_ring);
+}
+
+/* Gives the calling thread a ring, a parked one if possible. */
+static slog_ring_t *ring_attach(void) {
+    pthread_once(&g_key_once, make_key);
+
+    pthread_mutex_lock(&g_rings_mx);
+    slog_ring_t *ring = g_parked_count ? g_parked[--g_parked_count] : NULL;
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring) + g_records * sizeof(slog_record_t));
+        if (ring) {
+            ring->next = g_rings;
+            g_rings    = ring;
+        }
+    }
+    pthread_mutex_unlock(&g_rings_mx);
+    if (!ring) return NULL;
+
+    ring->tid = thread_id();
+    t_ring = ring;
+    pthread_setspecific(g_key, ring);
+    return ring;
+}
+
+/*
+ * Lets at most g_rate lines per second through one call site. The first line
+ * of a new second collects the count suppressed during the previous one.
+ */
+static int site_admit(slog_site_t *site, uint64_t second, uint32_t *suppressed) {
+    if (!g_rate) return 1;
+    uint64_t seen = atomic_load_explicit(&site->second, memory_order_relaxed);
+    if (seen != second && atomic_compare_exchange_strong(&site->second, &seen, second)) {
+        atomic_store(&site->lines, 0);
+        *suppressed = atomic_exchange(&site->suppressed, 0);
+    }
+    if (atomic_fetch_add(&site->lines, 1) < g_rate) return 1;
+    atomic_fetch_add(&site->suppressed, 1);
+    return 0;
+}
+
+static void fill(slog_record_t *rec, uint64_t ts, int level, const char *file, int line, int err,
+                 uint32_t tid, const char *fmt, va_list ap) {
+    rec->ts    = ts;
+    rec->file  = file;
+    rec->line  = line;
+    rec->level = level;
+    rec->err   = level <= SLOG_WARN ? err : 0;
+    rec->tid   = tid;
+
+    int n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+    size_t len = n < 0 ? 0 : (size_t)n;
+    if (len >= sizeof(rec->text)) {
+        len = sizeof(rec->text) - 1;
+        memcpy(rec->text + len - 3, "...", 3);
+    }
+    /* dbg.h-style messages carry their own line breaks; the writer adds one. */
+    while (len && rec->text[len - 1] == '\n') len--;
+    rec->len = (uint32_t)len;
+}
+
+/* ---- formatting ------------------------------------------------------- */
+
+static void out_flush(void) {
+    size_t done = 0;
+    while (done < g_out_len) {
+        ssize_t n = write(g_fd, g_out + done, g_out_len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;                  /* nowhere to complain to; drop the batch */
+        done += (size_t)n;
+    }
+    g_out_len = 0;
+}
+
+/* snprintf at out[*at], never moving *at past the last byte of `out`. */
+static void append(char *out, size_t cap, size_t *at, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+static void append(char *out, size_t cap, size_t *at, const char *fmt, ...) {
+    if (*at >= cap - 1) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out + *at, cap - *at, fmt, ap);
+    va_end(ap);
+    if (n > 0) *at = *at + (size_t)n < cap - 1 ? *at + (size_t)n : cap - 1;
+}
+
+static void append_json_string(char *out, size_t cap, size_t *at, const char *s, size_t len) {
+    for (size_t i = 0; i < len && *at + 7 < cap; i++) {
+        unsigned char ch = (unsigned char)s[i];
+        if (ch == '"' || ch == '\\') {
+            out[(*at)++] = '\\';
+            out[(*at)++] = (char)ch;
+        } else if (ch < 0x20) {
+            append(out, cap, at, "\\u%04x", ch);
+        } else {
+            out[(*at)++] = (char)ch;
+        }
+    }
+}
+
+/* Formats one record as a full line into `out`; returns its length. */
+static size_t format_record(const slog_record_t *rec, char *out, size_t cap) {
+    char stamp[32];
+    time_t seconds = (time_t)(rec->ts / 1000000000ULL);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    size_t stamp_len = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(stamp + stamp_len, sizeof(stamp) - stamp_len, ".%06uZ",
+             (unsigned)(rec->ts % 1000000000ULL / 1000));
+
+    const char *text = rec->text;
+    size_t len = rec->len;
+    while (len && *text == '\n') { text++; len--; }
+
+    /* Room for the closing characters is kept back so a long line stays well-formed. */
+    size_t at = 0, body = cap - 4;
+    if (g_json) {
+        append(out, body, &at, "{\"ts\":\"%s\",\"level\":\"%s\",\"tid\":%u,\"src\":\"%s:%d\"",
+               stamp, slog_level_name(rec->level), rec->tid, rec->file, rec->line);
+        if (rec->err) append(out, body, &at, ",\"errno\":\"%s\"", strerror(rec->err));
+        append(out, body, &at, ",\"msg\":\"");
+        append_json_string(out, body, &at, text, len);
+        append(out, cap, &at, "\"}\n");
+    } else {
+        append(out, body, &at, "%s [%s] [tid %u] (%s:%d", stamp, g_level_tags[rec->level],
+               rec->tid, rec->file, rec->line);
+        if (rec->err) append(out, body, &at, ": errno: %s", strerror(rec->err));
+        append(out, body, &at, ") %.*s", (int)len, text);
+        append(out, cap, &at, "\n");
+    }
+    return at;
+}
+
+/* Queues a formatted line in the writer's batch (writer thread only). */
+static void out_record(const slog_record_t *rec) {
+    if (g_out_len + SLOG_LINE_MAX > sizeof(g_out)) out_flush();
+    g_out_len += format_record(rec, g_out + g_out_len, SLOG_LINE_MAX);
+}
+
+static void out_note(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void out_note(int level, const char *fmt, ...) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    slog_record_t rec;
+    va_list ap;
+    va_start(ap, fmt);
+    fill(&rec, (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec, level, __FILE__,
+         __LINE__, 0, thread_id(), fmt, ap);
+    va_end(ap);
+    out_record(&rec);
+}
+
+/* ---- producers -------------------------------------------------------- */
+
+static void push(slog_ring_t *ring, uint64_t ts, int level, const char *file, int line, int err,
+                 const char *fmt, va_list ap) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= g_records) {
+        atomic_store_explicit(&ring->dropped,
+                              atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return;
+    }
+    fill(&ring->rec[head & (g_records - 1)], ts, level, file, line, err, ring->tid, fmt, ap);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    /* Problems go out right away, everything else when the ring is half full or on the tick. */
+    if (level <= SLOG_WARN || head + 1 - tail == g_records / 2) sem_post(&g_wake);
+}
+
+static void push_line(slog_ring_t *ring, uint64_t ts, int level, const char *file, int line,
+                      int err, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    push(ring, ts, level, file, line, err, fmt, ap);
+    va_end(ap);
+}
+
+static void write_now(uint64_t ts, int level, const char *file, int line, int err,
+                      const char *fmt, va_list ap) {
+    slog_record_t rec;
+    char out[SLOG_LINE_MAX];
+    fill(&rec, ts, level, file, line, err, thread_id(), fmt, ap);
+    fwrite(out, 1, format_record(&rec, out, sizeof(out)), stderr);
+}
+
+static void write_now_line(uint64_t ts, int level, const char *file, int line,
+                           const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    write_now(ts, level, file, line, 0, fmt, ap);
+    va_end(ap);
+}
+
+/*
+ * slog_write
+ * ----------
+ * Slow half of SLOG(): the level already passed. Applies the call site's rate
+ * limit, then hands the line to the writer (or stderr, if none runs).
+ * Preserves errno.
+ */
+void slog_write(slog_site_t *site, slog_level_t level, const char *file, int line,
+                const char *fmt, ...) {
+    int err = errno;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t ts = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+
+    uint32_t suppressed = 0;
+    if (!site_admit(site, (uint64_t)now.tv_sec, &suppressed)) {
+        errno = err;
+        return;
+    }
+
+    slog_ring_t *ring = g_async ? (t_ring ? t_ring : ring_attach()) : NULL;
+    va_list ap;
+    va_start(ap, fmt);
+    if (ring) {
+        if (suppressed) push_line(ring, ts, SLOG_WARN, file, line, 0, "%u similar lines suppressed", suppressed);
+        push(ring, ts, level, file, line, err, fmt, ap);
+    } else {
+        if (suppressed) write_now_line(ts, SLOG_WARN, file, line, "%u similar lines suppressed", suppressed);
+        write_now(ts, level, file, line, err, fmt, ap);
+    }
+    va_end(ap);
+    errno = err;
+}
+
+/* ---- writer ----------------------------------------------------------- */
+
+static void drain(void) {
+    pthread_mutex_lock(&g_rings_mx);
+    slog_ring_t *head = g_rings;
+    pthread_mutex_unlock(&g_rings_mx);
+
+    for (slog_ring_t *ring = head; ring; ring = ring->next) {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t end  = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail < end; tail++) out_record(&ring->rec[tail & (g_records - 1)]);
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->reported) {
+            out_note(SLOG_WARN, "[log] dropped %llu lines from thread %u, its buffer was full",
+                     (unsigned long long)(dropped - ring->reported), ring->tid);
+            ring->reported = dropped;
+        }
+    }
+    out_flush();
+}
+
+static void *writer_loop(void *unused) {
+    (void)unused;
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SLOG_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (sem_timedwait(&g_wake, &deadline) != 0 && errno == EINTR) { }
+
+        int stop = g_writer_stop;
+        drain();
+        if (stop) break;
+    }
+    return NULL;
+}
+
+/*
+ * slog_start
+ * ----------
+ * Applies `cfg` and starts the writer thread. Must run before the threads
+ * whose lines should go through it start. An unknown level or an unusable
+ * file is reported and leaves logging synchronous on stderr. Returns 0 or -1.
+ */
+int slog_start(const slog_cfg_t *cfg) {
+    if (cfg->level && slog_set_level(cfg->level) != 0)
+        log_warn("[log] unknown SERVER_LOG_LEVEL %s, keeping %s", cfg->level,
+                 slog_level_name(atomic_load(&g_slog_level)));
+    g_json = cfg->format && strcmp(cfg->format, "json") == 0;
+    g_rate = cfg->rate;
+
+    g_records = 1;
+    while (g_records < (cfg->records ? cfg->records : 256)) g_records <<= 1;
+
+    if (cfg->file && *cfg->file) {
+        g_fd = open(cfg->file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        probe(g_fd >= 0, "[log] cannot open SERVER_LOG_FILE %s", cfg->file);
+    }
+    probe(sem_init(&g_wake, 0, 0) == 0, "[log] sem_init failed");
+
+    /* The writer never takes signals meant for the accept loop. */
+    sigset_t block, previous;
+    sigfillset(&block);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+    g_writer_stop = 0;
+    int rc = pthread_create(&g_writer, NULL, writer_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    probe(rc == 0, "[log] writer thread failed");
+
+    g_async = 1;
+    atexit(slog_stop);
+    log_info("[log] level %s, %s lines to %s, %zu buffered per thread, %u/s per call site",
+             slog_level_name(atomic_load(&g_slog_level)), g_json ? "json" : "text",
+             cfg->file && *cfg->file ? cfg->file : "stderr", g_records, g_rate);
+    return 0;
+
+error:
+    if (g_fd > STDERR_FILENO) close(g_fd);
+    g_fd = STDERR_FILENO;
+    return -1;
+}
+
+/* Flushes everything logged so far and returns to synchronous stderr. */
+void slog_stop(void) {
+    if (!g_async) return;
+    g_async       = 0;
+    g_writer_stop = 1;
+    sem_post(&g_wake);
+    pthread_join(g_writer, NULL);
+    if (g_fd > STDERR_FILENO) close(g_fd);
+    g_fd = STDERR_FILENO;
+}
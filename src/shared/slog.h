@@ -0,0 +1,72 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+#include "dbg.h"
+
+/*
+ * Server log (SERVER_LOG_*; all server modes)
+ * -------------------------------------------
+ * Levelled, structured diagnostics. A log call formats its line into the
+ * calling thread's own ring of records (no lock, no stdio) and a writer
+ * thread drains every ring to SERVER_LOG_FILE (stderr by default) in batches,
+ * as plain text or as one JSON object per line.
+ *
+ * The level is checked inline, so a disabled level (debug() by default) costs
+ * one load and one branch; it can be changed at runtime with slog_set_level()
+ * ("LOG <level>" on the metrics socket). Each call site may emit at most
+ * SERVER_LOG_RATE lines per second, the rest are counted and reported as
+ * suppressed. A full ring drops lines instead of blocking.
+ *
+ * Before slog_start() (and in programs that never call it, like the client)
+ * lines are written to stderr synchronously.
+ *
+ * Including this header reroutes dbg.h's debug() / log_info() / log_warn() /
+ * log_err(), and through them probe() and sentinel().
+ */
+
+typedef enum {
+    SLOG_ERROR,
+    SLOG_WARN,
+    SLOG_INFO,
+    SLOG_DEBUG
+} slog_level_t;
+
+/* Rate-limit state of one call site. */
+typedef struct {
+    _Atomic uint64_t second;        /* window the counts belong to */
+    _Atomic uint32_t lines, suppressed;
+} slog_site_t;
+
+typedef struct {
+    const char *level;              /* error | warn | info | debug (default info) */
+    const char *file;               /* NULL or "" = stderr */
+    const char *format;             /* text (default) | json */
+    unsigned    rate;               /* lines per second per call site, 0 = unlimited */
+    unsigned    records;            /* ring size per thread, rounded up to a power of two */
+} slog_cfg_t;
+
+extern _Atomic int g_slog_level;
+
+int  slog_start(const slog_cfg_t *cfg);
+void slog_stop(void);
+int  slog_set_level(const char *name);
+const char *slog_level_name(int level);
+void slog_write(slog_site_t *site, slog_level_t level, const char *file, int line,
+                const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+
+#define SLOG(level, M, ...)                                                                  \
+    do {                                                                                     \
+        if ((int)(level) <= atomic_load_explicit(&g_slog_level, memory_order_relaxed)) {     \
+            static slog_site_t slog_site_;                                                   \
+            slog_write(&slog_site_, (level), __FILE__, __LINE__, M, ##__VA_ARGS__);          \
+        }                                                                                    \
+    } while (0)
+
+#undef debug
+#undef log_err
+#undef log_warn
+#undef log_info
+#define debug(M, ...)    SLOG(SLOG_DEBUG, M, ##__VA_ARGS__)
+#define log_err(M, ...)  SLOG(SLOG_ERROR, M, ##__VA_ARGS__)
+#define log_warn(M, ...) SLOG(SLOG_WARN,  M, ##__VA_ARGS__)
+#define log_info(M, ...) SLOG(SLOG_INFO,  M, ##__VA_ARGS__)
@@ -0,0 +1,292 @@
+#include "slog.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_NAMES_MAX 4096        /* thread ids that keep a name */
+#define TRACE_PARK_MAX  1024        /* rings of exited threads kept for reuse */
+
+/*
+ * One recorded span. Every field is written with relaxed atomics between two
+ * stores of `seq`: 2*i+1 while event i is being written, 2*i+2 once it is
+ * complete. A reader accepts a slot only if it saw the same even value before
+ * and after copying it.
+ */
+typedef struct {
+    _Atomic uint64_t seq;
+    _Atomic uint64_t start, dur;    /* monotonic ns */
+    _Atomic uint64_t id;            /* message id, 0 = none */
+    _Atomic uint64_t name;          /* const char * to a string literal */
+    _Atomic uint64_t meta;          /* tid << 32 | flow << 24 | arg (24 bits) */
+} trace_event_t;
+
+typedef struct trace_ring {
+    _Atomic uint64_t   head;        /* events ever written */
+    uint32_t           tid;         /* current owner's trace thread id */
+    struct trace_ring *next;        /* registry of all rings, never shrinks */
+    trace_event_t      ev[];
+} trace_ring_t;
+
+int g_trace_on;
+_Thread_local uint64_t t_trace_current;
+
+static _Thread_local trace_ring_t *t_ring;
+
+static pthread_mutex_t g_rings_mx = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t   *g_rings;
+static trace_ring_t   *g_parked[TRACE_PARK_MAX];
+static size_t          g_parked_count;
+static size_t          g_ring_events;       /* power of two */
+static _Atomic uint32_t g_next_tid = 1;
+static _Atomic uint64_t g_next_id = 1;
+static char            g_names[TRACE_NAMES_MAX][32];
+
+static pthread_key_t   g_key;
+static pthread_once_t  g_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t       g_dumper;
+static sem_t           g_dump_sem;
+static volatile int    g_dump_stop;
+static char            g_path[4096];
+
+static void park_ring(void *ring) {
+    pthread_mutex_lock(&g_rings_mx);
+    if (g_parked_count < TRACE_PARK_MAX) g_parked[g_parked_count++] = ring;
+    pthread_mutex_unlock(&g_rings_mx);
+}
+
+static void make_key(void) {
+    pthread_key_create(&g_key, park_ring);
+}
+
+/*
+ * Gives the calling thread a ring (a parked one if possible) and a fresh
+ * thread id. Events a reused ring still holds keep their old thread id.
+ */
+static trace_ring_t *ring_attach(void) {
+    pthread_once(&g_key_once, make_key);
+
+    pthread_mutex_lock(&g_rings_mx);
+    trace_ring_t *ring = g_parked_count ? g_parked[--g_parked_count] : NULL;
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring) + g_ring_events * sizeof(trace_event_t));
+        if (ring) {
+            ring->next = g_rings;
+            g_rings    = ring;
+        }
+    }
+    pthread_mutex_unlock(&g_rings_mx);
+    if (!ring) return NULL;
+
+    ring->tid = atomic_fetch_add(&g_next_tid, 1);
+    t_ring = ring;
+    pthread_setspecific(g_key, ring);
+    return ring;
+}
+
+/*
+ * trace_record
+ * ------------
+ * Appends one span that started at `start_ns` and ends now, overwriting the
+ * oldest event once the ring is full. Lock-free; only the owner writes.
+ */
+void trace_record(uint64_t start_ns, const char *name, uint64_t id, int flow, uint32_t arg) {
+    if (!g_trace_on) return;
+    trace_ring_t *ring = t_ring ? t_ring : ring_attach();
+    if (!ring) return;
+
+    uint64_t end = trace_now();
+    uint64_t i   = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event_t *ev = &ring->ev[i & (g_ring_events - 1)];
+
+    atomic_store_explicit(&ev->seq, 2 * i + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&ev->start, start_ns, memory_order_relaxed);
+    atomic_store_explicit(&ev->dur, end > start_ns ? end - start_ns : 0, memory_order_relaxed);
+    atomic_store_explicit(&ev->id, id, memory_order_relaxed);
+    atomic_store_explicit(&ev->name, (uint64_t)(uintptr_t)name, memory_order_relaxed);
+    atomic_store_explicit(&ev->meta, (uint64_t)ring->tid << 32 | (uint64_t)(flow & 0xff) << 24 |
+                                     (arg & 0xffffffu), memory_order_relaxed);
+    atomic_store_explicit(&ev->seq, 2 * i + 2, memory_order_release);
+    atomic_store_explicit(&ring->head, i + 1, memory_order_release);
+}
+
+uint64_t trace_next_id(void) {
+    return g_trace_on ? atomic_fetch_add_explicit(&g_next_id, 1, memory_order_relaxed) : 0;
+}
+
+/* Names the calling thread in dumps ("reactor 2", "client fd 17", ...). */
+void trace_thread_name(const char *fmt, ...) {
+    if (!g_trace_on) return;
+    trace_ring_t *ring = t_ring ? t_ring : ring_attach();
+    if (!ring || ring->tid >= TRACE_NAMES_MAX) return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(g_names[ring->tid], sizeof(g_names[ring->tid]), fmt, ap);
+    va_end(ap);
+}
+
+/* ---- dump ------------------------------------------------------------- */
+
+static void put_event(FILE *out, int *first, uint64_t start, uint64_t dur, uint64_t id,
+                      const char *name, uint64_t meta) {
+    unsigned tid  = (unsigned)(meta >> 32);
+    int      flow = (int)((meta >> 24) & 0xff);
+    unsigned arg  = (unsigned)(meta & 0xffffffu);
+
+    fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+                 "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%u,\"msg\":%llu}",
+            *first ? "" : ",\n", name, (int)getpid(), tid,
+            (double)start / 1000.0, (double)dur / 1000.0, arg, (unsigned long long)id);
+    /* Flow v2: slices sharing a bind_id are chained in time order across threads. */
+    if (id && flow != TRACE_FLOW_NONE) {
+        fprintf(out, ",\"bind_id\":\"0x%llx\",\"flow_out\":true%s", (unsigned long long)id,
+                flow == TRACE_FLOW_STEP ? ",\"flow_in\":true" : "");
+    }
+    fputc('}', out);
+    *first = 0;
+}
+
+/*
+ * Writes every ring as Chrome trace-event JSON to a temporary file and
+ * renames it over g_path, so readers never see a half-written trace.
+ */
+static void dump(void) {
+    char tmp[sizeof(g_path) + 8];
+    snprintf(tmp, sizeof(tmp), "%.4090s.tmp", g_path);
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        log_err("[trace] cannot write %s", tmp);
+        return;
+    }
+
+    pthread_mutex_lock(&g_rings_mx);
+    trace_ring_t *head = g_rings;
+    pthread_mutex_unlock(&g_rings_mx);
+
+    int    first = 1;
+    size_t events = 0, rings = 0;
+    uint32_t max_tid = atomic_load(&g_next_tid);
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for (uint32_t tid = 1; tid < max_tid && tid < TRACE_NAMES_MAX; tid++) {
+        if (!g_names[tid][0]) continue;
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                     "\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", (int)getpid(), tid, g_names[tid]);
+        first = 0;
+    }
+
+    for (trace_ring_t *ring = head; ring; ring = ring->next) {
+        uint64_t end  = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t from = end > g_ring_events ? end - g_ring_events : 0;
+        rings++;
+        for (uint64_t i = from; i < end; i++) {
+            const trace_event_t *ev = &ring->ev[i & (g_ring_events - 1)];
+            uint64_t seq = atomic_load_explicit(&ev->seq, memory_order_acquire);
+            if (seq != 2 * i + 2) continue;     /* being overwritten */
+
+            uint64_t start = atomic_load_explicit(&ev->start, memory_order_relaxed);
+            uint64_t dur   = atomic_load_explicit(&ev->dur, memory_order_relaxed);
+            uint64_t id    = atomic_load_explicit(&ev->id, memory_order_relaxed);
+            uint64_t name  = atomic_load_explicit(&ev->name, memory_order_relaxed);
+            uint64_t meta  = atomic_load_explicit(&ev->meta, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&ev->seq, memory_order_relaxed) != seq) continue;
+
+            put_event(out, &first, start, dur, id, (const char *)(uintptr_t)name, meta);
+            events++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out) != 0 || rename(tmp, g_path) != 0) {
+        log_err("[trace] writing %s failed", g_path);
+        unlink(tmp);
+        return;
+    }
+    log_info("[trace] wrote %zu events from %zu threads to %s", events, rings, g_path);
+}
+
+static void *dump_loop(void *unused) {
+    (void)unused;
+    for (;;) {
+        while (sem_wait(&g_dump_sem) != 0 && errno == EINTR) { }
+        if (g_dump_stop) break;
+        dump();
+    }
+    return NULL;
+}
+
+static void on_sigusr2(int unused_signal) {
+    (void)unused_signal;
+    sem_post(&g_dump_sem);      /* async-signal-safe */
+}
+
+/* Asks the dump thread for a trace file; safe from signal handlers. */
+void trace_dump_request(void) {
+    if (g_trace_on) sem_post(&g_dump_sem);
+}
+
+/*
+ * trace_start
+ * -----------
+ * Enables recording with rings of `events_per_thread` (rounded up to a power
+ * of two; 0 leaves tracing off), starts the dump thread and installs the
+ * SIGUSR2 trigger. Must run before the threads it should see start.
+ * Returns 0, or -1 with tracing off.
+ */
+int trace_start(const char *path, unsigned events_per_thread) {
+    if (!events_per_thread) return 0;
+#ifndef CHAT_TRACE
+    log_warn("[trace] TRACE_EVENTS is set but trace points were compiled out (make TRACE=0)");
+    return -1;
+#endif
+    g_ring_events = 1;
+    while (g_ring_events < events_per_thread) g_ring_events <<= 1;
+    snprintf(g_path, sizeof(g_path), "%s", path && *path ? path : "chat_trace.json");
+
+    probe(sem_init(&g_dump_sem, 0, 0) == 0, "[trace] sem_init failed");
+    g_dump_stop = 0;
+    /* SIGINT / SIGUSR1 stay with reactor 0; SIGUSR2 only posts the semaphore. */
+    sigset_t block, previous;
+    sigfillset(&block);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+    int rc = pthread_create(&g_dumper, NULL, dump_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    probe(rc == 0, "[trace] thread failed");
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigusr2;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &action, NULL);
+
+    g_trace_on = 1;
+    log_info("[trace] recording the last %zu events per thread; SIGUSR2 writes %s",
+             g_ring_events, g_path);
+    return 0;
+
+error:
+    return -1;
+}
+
+void trace_stop(void) {
+    if (!g_trace_on) return;
+    g_trace_on  = 0;
+    g_dump_stop = 1;
+    sem_post(&g_dump_sem);
+    pthread_join(g_dumper, NULL);
+    signal(SIGUSR2, SIG_IGN);
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Hot-path tracing (built with CHAT_TRACE, i.e. make TRACE=1, the default)
+ * ------------------------------------------------------------------------
+ * Trace points record complete spans (name, start, duration, one small
+ * argument such as an fd or a recipient count) into a per-thread ring of the
+ * last TRACE_EVENTS events. The owning thread overwrites the oldest entry
+ * without any lock; each slot carries a sequence number, so a reader copying
+ * a slot that is being rewritten notices and skips it.
+ *
+ * A span may carry a message id (TRACE_ID_NEXT() when a NOTE arrives, then
+ * TRACE_SET_CURRENT() on every thread that works on it). Spans with an id are
+ * linked by flow arrows, so the whole life of one message shows up across
+ * threads: receive, snapshot/fanout, cross-reactor hand-off, sends.
+ *
+ * trace_dump_request() (SIGUSR2, or "TRACE" on the metrics socket) wakes a
+ * background thread that writes every ring to TRACE_FILE in Chrome trace-event
+ * JSON, loadable in chrome://tracing or ui.perfetto.dev.
+ *
+ * Without CHAT_TRACE the TRACE_* macros compile to nothing. With it but
+ * tracing not started, each trace point costs one branch and no clock read.
+ */
+
+/* How a span takes part in its message's flow. */
+enum {
+    TRACE_FLOW_NONE,
+    TRACE_FLOW_START,               /* the message enters the server here */
+    TRACE_FLOW_STEP                 /* later work on it, on any thread */
+};
+
+extern int g_trace_on;
+extern _Thread_local uint64_t t_trace_current;
+
+int      trace_start(const char *path, unsigned events_per_thread);
+void     trace_stop(void);
+void     trace_dump_request(void);
+void     trace_thread_name(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+uint64_t trace_next_id(void);
+void     trace_record(uint64_t start_ns, const char *name, uint64_t id, int flow, uint32_t arg);
+
+static inline uint64_t trace_now(void) {
+    if (!g_trace_on) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#ifdef CHAT_TRACE
+#define TRACE_BEGIN(var)                      uint64_t var = trace_now()
+#define TRACE_END(var, name, id, flow, arg)   do { if (var) trace_record(var, name, id, flow, arg); } while (0)
+#define TRACE_ID_NEXT()                       trace_next_id()
+#define TRACE_SET_CURRENT(id)                 (t_trace_current = (id))
+#define TRACE_CURRENT()                       t_trace_current
+#define TRACE_THREAD_NAME(...)                trace_thread_name(__VA_ARGS__)
+#else
+#define TRACE_BEGIN(var)                      do { } while (0)
+#define TRACE_END(var, name, id, flow, arg)   do { } while (0)
+#define TRACE_ID_NEXT()                       ((uint64_t)0)
+#define TRACE_SET_CURRENT(id)                 ((void)(id))
+#define TRACE_CURRENT()                       ((uint64_t)0)
+#define TRACE_THREAD_NAME(...)                do { } while (0)
+#endif